@@ -1,19 +1,16 @@
-#include <mbed.h>
 #include "XBeeAPIParser.h"
 
 /**
  * @brief Construct a new XBeeAPIParser::XBeeAPIParser object from pointer
  * 
- * @param modem pointer to a BufferedSerial object connected to the XBee
+ * @param modem serial port connected to the XBee (BufferedSerial on mbed, 
+ * XBeePosixSerial on a POSIX host)
  */
-XBeeAPIParser::XBeeAPIParser(BufferedSerial* modem){ 
-  // Since BufferedSerial is non-copyable, change assignment of 
-  // tx, rx, and baud rate from constructor assignment to passing a pointer 
-  // and assigning it to the XBeeAPIParser private BufferedSerial pointer
-  _modem = modem; 
-  _init();
+XBeeAPIParser::XBeeAPIParser(FileHandle* modem) : 
+  XBeeAPIParser(modem, NULL, MAX_INCOMING_FRAMES, MAX_FRAME_LENGTH, NULL, XBEE_RX_STACK_SIZE) {
 }
 
+#if XBEE_PLATFORM_MBED
 /**
  * @brief Construct a new XBeeAPIParser::XBeeAPIParser object from pin names
  * 
@@ -21,26 +18,146 @@ XBeeAPIParser::XBeeAPIParser(BufferedSerial* modem){
  * @param rx RX pin linked to XBee
  * @param baud 
  */
-XBeeAPIParser::XBeeAPIParser(PinName tx, PinName rx, int baud) { 
+XBeeAPIParser::XBeeAPIParser(PinName tx, PinName rx, int baud) : 
   // Create a pointer to a BufferedSerial from pins
-  _modem = new BufferedSerial(tx, rx, baud); 
+  XBeeAPIParser(new BufferedSerial(tx, rx, baud)) {
+}
+#endif
+
+/**
+ * @brief Construct a new XBeeAPIParser::XBeeAPIParser object using caller 
+ * supplied buffers. XBeeAPIParserStatic is the usual way to get here.
+ * 
+ * @param modem serial port connected to the XBee (BufferedSerial on mbed, 
+ * XBeePosixSerial on a POSIX host)
+ * @param pool XBEE_FRAME_POOL_BYTES(frames, frameLength) bytes, 4-byte aligned, or NULL to allocate
+ * @param frames number of received frames to buffer, 1 to XBEE_MAX_FRAMES
+ * @param frameLength largest received frame data to accept, 1 to MAX_FRAME_LENGTH
+ * 
+ * Sizes out of range are clamped with a warning. If that makes them larger,
+ * the pool is allocated rather than overrun.
+ * @param stack receive thread stack of stackSize bytes, 8-byte aligned, or NULL to allocate
+ * @param stackSize receive thread stack size
+ */
+XBeeAPIParser::XBeeAPIParser(FileHandle* modem, char* pool, int frames, int frameLength, unsigned char* stack, uint32_t stackSize) : 
+  _frameArrived(_frameBufferMutex), 
+  _frameFreed(_frameBufferMutex), 
+  _txWindowOpen(_txMutex),
+  _updateBufferThread(osPriorityNormal, stackSize, stack, "XBeeAPIParser") { 
+  // Since serial ports are non-copyable, change assignment of 
+  // tx, rx, and baud rate from constructor assignment to passing a pointer 
+  // and assigning it to the XBeeAPIParser private FileHandle pointer
+  _modem = modem; 
+  if ((frames < 1) || (frames > XBEE_MAX_FRAMES) || (frameLength < 1) || (frameLength > MAX_FRAME_LENGTH)) {
+    printf("XBeeAPIParser: %d frames of %d bytes is out of range\r\n", frames, frameLength);
+    if ((frames < 1) || (frameLength < 1)) pool = NULL; // Too small for the clamped sizes
+    frames = (frames < 1) ? 1 : ((frames > XBEE_MAX_FRAMES) ? XBEE_MAX_FRAMES : frames);
+    frameLength = (frameLength < 1) ? 1 : ((frameLength > MAX_FRAME_LENGTH) ? MAX_FRAME_LENGTH : frameLength);
+  }
+  _maxFrames = frames;
+  _frameLength = frameLength;
+  _blockSize = XBEE_FRAME_BLOCK_SIZE(frameLength);
+  // Without caller supplied storage, fall back to the heap like earlier versions
+  _ownsPool = (pool == NULL);
+  _pool = (pool != NULL) ? pool : new char[XBEE_FRAME_POOL_BYTES(frames, frameLength)];
   _init();
 }
 
+/**
+ * @brief Stops the receive thread and returns a heap allocated pool. Frame
+ * handles, futures and queues must be released before the parser goes.
+ */
+XBeeAPIParser::~XBeeAPIParser() {
+  _stopping = true;
+  _serialEvents.set(XBEE_RX_SIGNAL_FLAG);
+  _updateBufferThread.join();
+  _modem->sigio(nullptr);
+  if (_ownsPool) delete[] _pool;
+}
+
 // Move all of the stuff common to the constructor methods to one place
 void XBeeAPIParser::_init() {
-  for (int i = 0; i < MAX_INCOMING_FRAMES; i++) {
-    _frameBuffer.frame[i].type = 0xFF; // Set frame type to generic 
-    _frameBuffer.frame[i].id = 0x00;
-    _frameBuffer.frame[i].length = 0;
+  _frameHead = XBEE_NO_FRAME;
+  _frameTail = XBEE_NO_FRAME;
+  _frameCount = 0;
+  _rxRingHead = 0;
+  _rxRingTail = 0;
+  _freeRingHead = 0;
+  _freeRingTail = 0;
+  for (int i = 0; i < XBEE_FRAME_INDEX_BUCKETS; i++) _frameIndex[i] = XBEE_NO_FRAME;
+  for (int lane = 0; lane < XBEE_LANES; lane++) {
+    _laneUsed[lane] = 0;
+    _laneLimit[lane] = _maxFrames;
+    _lanePolicy[lane] = XBEE_DROP_OLDEST;
+    _laneDrops[lane] = 0;
   }
-  _frameBuffer.length = 0;
+  // Keep one frame of room for responses unless the buffer is tiny
+  if (_maxFrames > 1) _laneLimit[XBEE_LANE_DATA] = _maxFrames - 1;
+  // _free_block notifies _frameFreed, which mbed only allows with its mutex held
+  _frameBufferMutex.lock();
+  for (int i = 0; i <= _maxFrames; i++) {
+    _links(i)->lane = XBEE_NO_LANE;
+    _frame(i)->type = 0xFF; // Set frame type to generic 
+    _frame(i)->id = 0x00;
+    _frame(i)->length = 0;
+    if (i > 0) _free_block(i);
+  }
+  _frameBufferMutex.unlock();
+  _rxBlock = 0; // The parser starts out owning the first block
+  _partialFrame.frame = _frame(_rxBlock);
   _partialFrame.status = 0x00; // Set status to "all good"
   _time_out = 1000ms; // Sets baseline for communication timeouts
   _isAssociated = false; 
   _failedTransmits = 0;
   _maxFailedTransmits = 5;
   _frameAlertThreadId = NULL;
+  for (int i = 0; i < XBEE_MAX_PENDING; i++) _pending[i].active = false;
+  for (int i = 0; i < XBEE_MAX_SUBSCRIBERS; i++) _subscribers[i].active = false;
+  for (int i = 0; i < XBEE_MAX_TX_WINDOW; i++) {
+    _txSlots[i].parser = this;
+    _txSlots[i].active = false;
+  }
+  _txWindow = 4;
+  _txOutstanding = 0;
+  _disassociateRequested = false;
+  _lastFrameID = 0;
+  for (int i = 0; i < XBEE_ADDRESS_CACHE_SIZE; i++) _addressCache[i].valid = false;
+  _addressCacheTTL = 300s;
+  _addressCacheHits = 0;
+  _addressCacheMisses = 0;
+  for (int i = 0; i < XBEE_SHORT_ADDRESS_TABLE_SIZE; i++) _shortAddresses[i].valid = false;
+  _shortAddressClock = 0;
+  _shortAddressing = true;
+  _shortFramesSent = 0;
+  for (int i = 0; i < XBEE_NODE_TABLE_SIZE; i++) _nodes[i].valid = false;
+  for (int i = 0; i < XBEE_NODE_INDEX_BUCKETS; i++) {
+    _nodesByAddress[i] = XBEE_NO_NODE;
+    _nodesByName[i] = XBEE_NO_NODE;
+  }
+  _discoveryRun = 0;
+  _discoveryActive = false;
+  _discoveryFound = 0;
+  _discoveryStatus = XBEE_TXN_OK;
+  for (int i = 0; i < XBEE_RTT_DESTINATIONS; i++) _rttDestinations[i].valid = false;
+  memset(_atRTT, 0, sizeof(_atRTT));
+  _rttClock = 0;
+  _adaptiveTimeouts = true;
+  _apiMode = 1;
+  _rxEscapePending = false;
+  _rxPollInterval = 0ms; // Event-driven receive by default
+  _rxChunkSize = XBEE_RX_CHUNK_SIZE;
+  _rxSignalTime = 0;
+  _rxChunkTime = 0;
+  _capture = NULL;
+  _stopping = false;
+  memset(&_metrics, 0, sizeof(_metrics));
+  _rxClock.start();
+  reset_rx_stats();
+  reset_tx_stats();
+  // Reads are driven by the serial port's sigio notification, so the port
+  // must never block the receive thread
+  _modem->set_blocking(false);
+  _modem->sigio(callback(this, &XBeeAPIParser::_sigio));
   _updateBufferThread.start(callback(this, &XBeeAPIParser::_move_frame_to_buffer));
 }
 
@@ -58,26 +175,105 @@ bool XBeeAPIParser::associated() {
  * @returns true if match was found
  */
 bool XBeeAPIParser::find_frame(char frameType, char frameID, apiFrame_t* frame) {
-  if (_frameBufferMutex.trylock_for(_time_out)) { // Try to lock mutex for time given. true if the mutex was acquired, false otherwise.
-    if (_frameBuffer.length>0) {
-      for (int i = 0; i < _frameBuffer.length; i++) { // For each frame in the frame buffer 
-        if ((_frameBuffer.frame[i].type == frameType) && (_frameBuffer.frame[i].id == frameID)) { // If the frame matches the specifications requested 
-          // Set frame parameters 
-          frame->type = frameType;
-          frame->id = frameID;
-          frame->length = _frameBuffer.frame[i].length;
-          // Copy over frame data 
-          for (int j = 0; j < frame->length; j++)
-            frame->data[j] = _frameBuffer.frame[i].data[j];
-          _frameBufferMutex.unlock(); // Now that all data has been copied from the buffer, unlock the mutex 
-          _remove_frame_by_index(i); // Remove the frame from the buffer 
-          return true;
-        }
-      }
-    }
-    _frameBufferMutex.unlock(); // If the frame buffer is empty, unlock the mutex 
+  XBeeFrameHandle handle;
+  if (!find_frame(frameType, frameID, &handle)) return false;
+  // Copy over frame data 
+  frame->type = handle->type;
+  frame->id = handle->id;
+  frame->length = handle->length;
+  memcpy(frame->data, handle->data, handle->length);
+  return true; // The pool block is returned when the handle goes out of scope
+}
+
+/** 
+ * Hands over the frame with specified frame type and frame ID without 
+ * copying it. The frame is removed from the buffer and its pool block is 
+ * returned when the handle is released.
+ * 
+ * @returns true if match was found
+ */
+bool XBeeAPIParser::find_frame(char frameType, char frameID, XBeeFrameHandle* frame) {
+  frame->release(); // Give back whatever the handle was holding
+  // The receive thread never holds the lock while it waits, so this is short
+  _lock_frame_buffer();
+  int block = _match_frame(frameType, frameID);
+  if (block != XBEE_NO_FRAME) {
+    _unlink_frame(block); // Remove the frame from the buffer 
+    frame->_parser = this;
+    frame->_block = block;
   }
-  return false;
+  _unlock_frame_buffer();
+  return frame->valid();
+}
+
+/** 
+ * Hands over the oldest frame of specified frame type without copying it.
+ * 
+ * @returns true if match was found
+ */
+bool XBeeAPIParser::find_frame(char frameType, XBeeFrameHandle* frame) {
+  return find_frame(frameType, 0xFF, frame);
+}
+
+/** 
+ * @returns pool block of the oldest buffered frame matching type and ID,
+ * or XBEE_NO_FRAME. The frame buffer mutex must be held.
+ */
+int XBeeAPIParser::_match_frame(char frameType, char frameID) {
+  int block = _frameIndex[_frame_key_hash(frameType, frameID)];
+  while (block != XBEE_NO_FRAME) {
+    if ((_frame(block)->type == frameType) && (_frame(block)->id == frameID)) return block;
+    block = _links(block)->indexNext;
+  }
+  return XBEE_NO_FRAME;
+}
+
+/** 
+ * @returns index bucket for a (frame type, frame ID) pair
+ */
+int XBeeAPIParser::_frame_key_hash(char frameType, char frameID) {
+  return ((uint8_t) frameType ^ ((uint8_t) frameID * 7)) & (XBEE_FRAME_INDEX_BUCKETS - 1);
+}
+
+/** 
+ * Blocks until a frame with specified frame type and frame ID is buffered or
+ * the deadline passes. The frame is removed from the buffer and handed over 
+ * without copying.
+ * 
+ * @returns true if match was found before the deadline
+ */
+bool XBeeAPIParser::wait_for_frame(char frameType, char frameID, Kernel::Clock::time_point deadline, XBeeFrameHandle* frame) {
+  frame->release(); // Give back whatever the handle was holding
+  _lock_frame_buffer();
+  int block = _match_frame(frameType, frameID);
+  while ((block == XBEE_NO_FRAME) && (Kernel::Clock::now() < deadline)) {
+    _frameArrived.wait_until(deadline); // Woken whenever frames are linked into the buffer
+    _drain_rx_ring();
+    block = _match_frame(frameType, frameID);
+  }
+  if (block != XBEE_NO_FRAME) {
+    _unlink_frame(block);
+    frame->_parser = this;
+    frame->_block = block;
+  }
+  _unlock_frame_buffer();
+  return frame->valid();
+}
+
+/** 
+ * Blocks until a frame with specified frame type and frame ID is buffered or
+ * the deadline passes, then copies it out and removes it from the buffer.
+ * 
+ * @returns true if match was found before the deadline
+ */
+bool XBeeAPIParser::wait_for_frame(char frameType, char frameID, Kernel::Clock::time_point deadline, apiFrame_t* frame) {
+  XBeeFrameHandle handle;
+  if (!wait_for_frame(frameType, frameID, deadline, &handle)) return false;
+  frame->type = handle->type;
+  frame->id = handle->id;
+  frame->length = handle->length;
+  memcpy(frame->data, handle->data, handle->length);
+  return true;
 }
 
 /** 
@@ -94,79 +290,79 @@ bool XBeeAPIParser::find_frame(char frameType, apiFrame_t* frame) {
  * Clears all frames of a specified type and ID from the frame buffer 
  */
 void XBeeAPIParser::flush_old_frames(char frameType, char frameID) {
-  apiFrame_t frame;
+  XBeeFrameHandle frame;
   while (find_frame(frameType, frameID, &frame)); // Find all frames with the specified ID and type and clear them from the frame buffer 
 }
 
 
 /** 
+ * Looks up the 64-bit address of the node with the given node identifier, 
+ * answering from the address cache when possible. A cache miss costs three 
+ * AT round trips (DN, DH, DL); note that only a miss leaves DH/DL on the 
+ * local XBee pointing at the node.
+ * 
  * @returns 0 if response frame not found | 1 if response frame's status code is 1 (ERROR), 2 (INVALID CMD), or 3 (INVALID PARAMETER) 
  * | 64-bit address if successful
  */
 uint64_t XBeeAPIParser::get_address(string ni) {
   uint64_t address;
-  Timer t; // Initialize timer 
-  char frameID;
-  char status;
+  if (cached_address(ni, &address)) return address;
+  address = _resolve_address(ni);
+  if (address > 1) _cache_address(ni, address); // Only cache successful lookups
+  return address;
+}
+
+/** 
+ * Resolves a node identifier over the radio 
+ * 
+ * @returns same as get_address
+ */
+uint64_t XBeeAPIParser::_resolve_address(string ni) {
+  uint64_t address;
   apiFrame_t frame;
-  int len;
-  bool foundFrame;
+  XBeeFuture reply;
+  const apiFrame_t* response;
   _make_AT_frame("DN", ni, &frame); // Make local AT command frame and set command to destination node 
-  flush_old_frames(frame.type, frame.id); // Clear old DN frames 
-  frameID = frame.id; // Collect frame id (0x92 for DN)
-  send(&frame); // Send the DN frame 
-  ThisThread::sleep_for(5ms);
-  t.start(); // Start timer 
-  foundFrame = false;
-  // For 10 times longer than the single-step timeout or until one is found, search for local at command response frames in the frame buffer 
-  while ((t.elapsed_time() < 10*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x88, frameID, &frame); // Search for local AT command response frames (0x88)
-    if (!foundFrame) ThisThread::sleep_for(5ms);
-  }
-  if (!foundFrame) printf("Timed out after DN!\r\n"); // If not successful in finding the response frame
-  if ((!foundFrame) || (frame.length != 3)) return 0; // If the frame was not found or has insufficient data, return 0 
-  if (!((frame.data[0] = 'D') && (frame.data[1] == 'N') && (frame.data[2]==0))) return 1; // If the response frame command is incorrect or the status code is not 0 (OKAY), return 1
+  // DN searches the network, so it gets a longer timeout than other local AT commands
+  request(&frame, 0x88, request_timeout(&frame), &reply); // Send the DN frame 
+  if (reply.wait() != XBEE_TXN_OK) {
+    printf("Timed out after DN!\r\n"); // If not successful in finding the response frame
+    return 0;
+  }
+  response = reply.response();
+  if (response->length != 3) return 0; // If the frame has insufficient data, return 0 
+  if (!((response->data[0] == 'D') && (response->data[1] == 'N') && (response->data[2]==0))) return 1; // If the response frame command is incorrect or the status code is not 0 (OKAY), return 1
   // If everything is okay with the response frame, move on to collecting the 64-bit destination address 
   // Local AT command frames can be used to collect the address by combining the DH and DL AT commands 
 
   // Begin with DH, which is used to read the upper 32 bits of the 64-bit adress 
   // make local AT command frame and set command to Desitnation Address High
   _make_AT_frame("DH", &frame); 
-  flush_old_frames(frame.type, frame.id); // Clear old DH frames 
-  frameID = frame.id; // Collect frame id (0x8C for DH)
-  send(&frame); // Send DH frame 
-  t.reset(); // Reset timer 
-  foundFrame = false;
-  // For 2 times the single-step timeout or until it is found, attempt to find the response frame (0x88)
-  while ((t.elapsed_time() < 2*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x88, frameID, &frame);
-    if (!foundFrame) ThisThread::sleep_for(5ms);
-  }
-  if (!foundFrame) printf("Timed out after DH!\r\n"); // If not successful in finding the response frame in time
-  if ((!foundFrame) || (frame.length != 7)) return 0; // If the frame was not found or has insufficient data, return 0 
+  request(&frame, 0x88, request_timeout(&frame), &reply); // Send DH frame 
+  if (reply.wait() != XBEE_TXN_OK) {
+    printf("Timed out after DH!\r\n"); // If not successful in finding the response frame in time
+    return 0;
+  }
+  response = reply.response();
+  if (response->length != 7) return 0; // If the frame has insufficient data, return 0 
   // If nothing went wrong with getting the response frame 
   address = 0; // Clear address to prep for loading 
   // Collect data from response frame 
   for (int i = 0; i < 4; i++) {
-    address = (address << 8) | frame.data[3+i];
+    address = (address << 8) | (uint8_t) response->data[3+i];
   }
   // To get the second half of the address, send a DL command frame 
   _make_AT_frame("DL", &frame);
-  flush_old_frames(frame.type, frame.id); // Clear old DL frames 
-  frameID = frame.id; // Collect frame id (0x90 for DL)
-  send(&frame); // Send DL frame 
-  t.reset(); // Reset timer 
-  foundFrame = false;
-  // For 2 times the single-step timeout or until it is found, attempt to find the response frame (0x88)
-  while ((t.elapsed_time() <2*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x88, frameID, &frame);
-    if (!foundFrame) ThisThread::sleep_for(5ms);
-  }
-  if (!foundFrame) printf("Timed out after DL!\r\n"); // If not successful in finding the response frame in time 
-  if ((!foundFrame) || (frame.length != 7)) return 0; // If the frame was not found or has insufficient data, return 0 
+  request(&frame, 0x88, request_timeout(&frame), &reply); // Send DL frame 
+  if (reply.wait() != XBEE_TXN_OK) {
+    printf("Timed out after DL!\r\n"); // If not successful in finding the response frame in time 
+    return 0;
+  }
+  response = reply.response();
+  if (response->length != 7) return 0; // If the frame has insufficient data, return 0 
   // If nothing went wrong with getting the response frame, collect the lower 32 bits of the address 
   for (int i = 0; i < 4; i++) {
-    address = (address << 8) | frame.data[3+i];
+    address = (address << 8) | (uint8_t) response->data[3+i];
   }
   return address; // Return full 64-bit address 
 }
@@ -178,42 +374,28 @@ uint64_t XBeeAPIParser::get_address(string ni) {
  * does not come through 
  */
 char XBeeAPIParser::last_RSSI() {
-  Timer t;
-  char frameID;
   char rssi = 0xFF;
-  apiFrame_t frame;
-  bool foundFrame;
-  _make_AT_frame("DB", &frame); // Make DB frame 
-  frameID = frame.id; // Collect id 
-  send(&frame); // Send DB frame 
-  t.start(); // Start timer 
-  foundFrame = false;
-  // For 2 times the single-step timeout or until it is found (whichever is shorter), attempt to find the response frame  
-  while ((t.elapsed_time() <2*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x88, frameID, &frame);
-    if (!foundFrame) ThisThread::sleep_for(5ms);
-  }
-  if (!foundFrame) return 0xFF; // If the frame is not found, return 0xFF
-  if (frame.length == 6) { // If the frame has sufficient data and the command status is good, collect the RSSI
-    if ((frame.data[2]=='D') && (frame.data[3]=='B')&& (frame.data[4]==0)) {
-      rssi = frame.data[5];
+  XBeeFuture reply;
+  // Wait up to 2 times the single-step timeout for the response frame  
+  if (at_request("DB", "", &reply) < 0) return 0xFF;
+  if (reply.wait() != XBEE_TXN_OK) return 0xFF; // If the frame is not found, return 0xFF
+  const apiFrame_t* response = reply.response();
+  if (response->length == 6) { // If the frame has sufficient data and the command status is good, collect the RSSI
+    if ((response->data[2]=='D') && (response->data[3]=='B')&& (response->data[4]==0)) {
+      rssi = response->data[5];
     }
   }
   return rssi; // Return RSSI value 
 }
 
 /** 
- * Checks if there are any frames in the frame buffer 
+ * Checks if there are any frames in the frame buffer, including frames the
+ * receive thread has handed over but nobody has linked in yet. Takes no lock.
  * 
  * @returns true if there are frames in the frame buffer, false otherwise
  */
 bool XBeeAPIParser::readable() {
-  bool hasFrames = false;
-  if (_frameBufferMutex.trylock_for(_time_out)) {
-    hasFrames = _frameBuffer.length > 0;
-    _frameBufferMutex.unlock();
-  }
-  return hasFrames;
+  return (_frameCount > 0) || (core_util_atomic_load_u8(&_rxRingHead) != _rxRingTail);
 }
 
 /** 
@@ -222,23 +404,31 @@ bool XBeeAPIParser::readable() {
  * @returns true if successful
  */
 bool XBeeAPIParser::get_oldest_frame(apiFrame_t* frame) {
-  // Try to lock the frame buffer mutex for single-step timeout
-  if (_frameBufferMutex.trylock_for(_time_out)) {
-    if (_frameBuffer.length > 0) { // If the frame buffer has data
-      // Set frame parameters
-      frame->type = _frameBuffer.frame[0].type;
-      frame->id = _frameBuffer.frame[0].id;
-      frame->length = _frameBuffer.frame[0].length;
-      // Copy frame data 
-      for (int i = 0; i < frame->length; i++)
-        frame->data[i] = _frameBuffer.frame[0].data[i];
-      _frameBufferMutex.unlock(); // Free the mutex 
-      _remove_frame_by_index(0); // Remove the frame from the buffer 
-      return true; // Since successful, return true 
-    } 
-    _frameBufferMutex.unlock(); //  If the frame buffer has no data, free the mutex 
-  }
-  return false; // Return flase if mutex does not lock within the given window of time 
+  XBeeFrameHandle handle;
+  if (!get_oldest_frame(&handle)) return false;
+  // Copy frame data 
+  frame->type = handle->type;
+  frame->id = handle->id;
+  frame->length = handle->length;
+  memcpy(frame->data, handle->data, handle->length);
+  return true;
+}
+
+/** 
+ * Hands over the oldest frame in the frame buffer without copying it 
+ * 
+ * @returns true if successful
+ */
+bool XBeeAPIParser::get_oldest_frame(XBeeFrameHandle* frame) {
+  frame->release();
+  _lock_frame_buffer();
+  if (_frameHead != XBEE_NO_FRAME) { // If the frame buffer has data
+    frame->_parser = this;
+    frame->_block = _frameHead;
+    _unlink_frame(_frameHead); // Remove the frame from the buffer 
+  } 
+  _unlock_frame_buffer();
+  return frame->valid();
 }
 
 /** 
@@ -246,23 +436,143 @@ bool XBeeAPIParser::get_oldest_frame(apiFrame_t* frame) {
  * Note that 0x90 (receive packet frame type) is emitted when 
  * a device in standard API mode receives an RF data packet 
  * 
- * @returns unknown 
+ * @returns same as rxPacket with a short address
  */
 int XBeeAPIParser::rxPacket(char* payload, uint64_t* address) {
-  apiFrame_t frame; // Create a blank frames 
-  bool foundFrame; 
-  uint64_t who = 0;
-  foundFrame = find_frame(0x90, &frame); // Find a receive packet (0x90) frame in the frame buffer 
-  if (foundFrame) { // If the receive packet frame is found 
+  uint16_t shortAddress;
+  return rxPacket(payload, address, &shortAddress);
+}
+
+/** 
+ * Takes a received packet, either a 0x90 frame with the sender's 64-bit 
+ * address or a 0x81 frame sent from a 16-bit address. For a 0x81 frame the
+ * 64-bit address comes from the short address table and is 
+ * XBEE_ADDRESS_UNKNOWN if the sender is not in it; for a 0x90 frame the 
+ * short address is XBEE_SHORT_ADDRESS_NONE if the sender has none.
+ * Packets come back in arrival order whatever their type. A packet too 
+ * short for its header is dropped and counted in malformedPackets.
+ * 
+ * @returns payload length | 0 if no packet is waiting
+ */
+int XBeeAPIParser::rxPacket(char* payload, uint64_t* address, uint16_t* shortAddress) {
+  XBeeFrameHandle frame;
+  int header;
+  while (true) {
+    frame.release();
+    _lock_frame_buffer();
+    int block = _oldest_packet();
+    if (block != XBEE_NO_FRAME) {
+      _unlink_frame(block); // Remove the frame from the buffer 
+      frame._parser = this;
+      frame._block = block;
+    }
+    _unlock_frame_buffer();
+    if (!frame.valid()) return 0;
+    // 0x90: source address (8), 16-bit address (2), options (1)
+    // 0x81: source address (2), RSSI (1), options (1)
+    header = ((uint8_t) frame->type == 0x90) ? 11 : 4;
+    if (frame->length >= header) break;
+    core_util_atomic_incr_u32(&_metrics.malformedPackets, 1);
+  }
+  if ((uint8_t) frame->type == 0x90) { // Receive packet with the sender's 64-bit address
+    uint64_t who = 0;
     for (int i = 0; i < 8; i++) {
-      who = (who << 8) | frame.data[i]; // Copy over the 64-bit source address (the sender's address)
+      who = (who << 8) | (uint8_t) frame->data[i]; // Copy over the 64-bit source address (the sender's address)
     }
     *address = who; // Set address 
-    for (int i = 0; i < (frame.length-9); i++) {
-      payload[i] = frame.data[i+11]; // Copy over the received data 
-    }
-    return (frame.length-11); // Not sure why we are pulling from this particular index 
-  } else return 0;
+    *shortAddress = ((uint8_t) frame->data[8] << 8) | (uint8_t) frame->data[9];
+  } else { // 16-bit receive packet
+    *shortAddress = ((uint8_t) frame->data[0] << 8) | (uint8_t) frame->data[1];
+    *address = long_address(*shortAddress);
+  }
+  memcpy(payload, &frame->data[header], frame->length - header); // Copy over the received data 
+  return frame->length - header;
+}
+
+/** 
+ * @returns pool block of the oldest buffered 0x90 or 0x81 frame, or 
+ * XBEE_NO_FRAME. The frame buffer mutex must be held.
+ */
+int XBeeAPIParser::_oldest_packet() {
+  int packet = _match_frame(0x90, 0xFF);
+  int shortPacket = _match_frame(0x81, 0xFF);
+  if (packet == XBEE_NO_FRAME) return shortPacket;
+  if (shortPacket == XBEE_NO_FRAME) return packet;
+  for (int block = _frameHead; block != XBEE_NO_FRAME; block = _links(block)->next) {
+    if ((block == packet) || (block == shortPacket)) return block;
+  }
+  return XBEE_NO_FRAME;
+}
+
+/** 
+ * Takes the oldest buffered I/O sample frame (0x82, else 0x83) and decodes
+ * it into samples
+ * 
+ * @returns samples decoded | 0 if there is no I/O sample frame | -1 if the 
+ * frame was malformed (it is discarded)
+ */
+int XBeeAPIParser::rxIOSamples(xbeeIOSamples_t* samples) {
+  XBeeFrameHandle frame;
+  if (!find_frame(0x82, &frame) && !find_frame(0x83, &frame)) return 0;
+  if (!decode_io_samples(frame.get(), samples)) return -1;
+  return samples->count;
+}
+
+/** 
+ * Decodes an 802.15.4 I/O sample frame: source address (8 bytes for 0x82, 
+ * 2 for 0x83), RSSI, options, sample count and the channel indicator, then
+ * per sample the DIO word if any DIO line is enabled followed by one 
+ * big-endian reading per enabled ADC channel, A0 first. Each channel is 
+ * unpacked by its own strided loop, so the samples of a channel land in one
+ * contiguous array. Can be called from a subscriber.
+ * 
+ * @returns false if the frame is not an I/O sample frame, is truncated or 
+ * has more than XBEE_IO_MAX_SAMPLES samples
+ */
+bool XBeeAPIParser::decode_io_samples(const apiFrame_t* frame, xbeeIOSamples_t* samples) {
+  const uint8_t* data = (const uint8_t*) frame->data;
+  int header;
+  if (((uint8_t) frame->type == 0x82) && (frame->length >= 13)) {
+    samples->address = 0;
+    for (int i = 0; i < 8; i++) samples->address = (samples->address << 8) | data[i];
+    samples->shortAddress = XBEE_SHORT_ADDRESS_NONE;
+    header = 8;
+  } else if (((uint8_t) frame->type == 0x83) && (frame->length >= 7)) {
+    samples->shortAddress = (data[0] << 8) | data[1];
+    samples->address = long_address(samples->shortAddress);
+    header = 2;
+  } else {
+    return false;
+  }
+  samples->rssi = data[header];
+  samples->options = data[header + 1];
+  int count = data[header + 2];
+  uint16_t indicator = (data[header + 3] << 8) | data[header + 4];
+  samples->dioMask = indicator & 0x01FF;
+  samples->adcMask = (indicator >> 9) & 0x3F;
+  data += header + 5;
+  int len = frame->length - header - 5;
+  int words = (samples->dioMask != 0) ? 1 : 0;
+  for (int ch = 0; ch < XBEE_IO_ADC_CHANNELS; ch++) {
+    if (samples->adcMask & (1 << ch)) words++;
+  }
+  int stride = 2*words;
+  if ((count > XBEE_IO_MAX_SAMPLES) || (count*stride > len)) return false;
+  samples->count = count;
+  const uint8_t* in = data;
+  if (samples->dioMask != 0) {
+    uint16_t mask = samples->dioMask;
+    uint16_t* out = samples->dio;
+    for (int i = 0; i < count; i++) out[i] = ((in[i*stride] << 8) | in[i*stride + 1]) & mask;
+    in += 2;
+  }
+  for (int ch = 0; ch < XBEE_IO_ADC_CHANNELS; ch++) {
+    if (!(samples->adcMask & (1 << ch))) continue;
+    uint16_t* out = samples->adc[ch];
+    for (int i = 0; i < count; i++) out[i] = ((in[i*stride] << 8) | in[i*stride + 1]) & 0x03FF;
+    in += 2;
+  }
+  return true;
 }
 
 /** 
@@ -271,71 +581,76 @@ int XBeeAPIParser::rxPacket(char* payload, uint64_t* address) {
  * @returns true if successful, else false 
  */
 bool XBeeAPIParser::send(apiFrame_t* frame) {
-  bool success = true;
-  char c;
+  bool success = false;
+  // Entire send must complete before _time_out
+  Kernel::Clock::time_point deadline = Kernel::Clock::now() + _time_out;
+  if (_modemTxMutex.trylock_for(_time_out)) { 
+    uint32_t encodeStart = _rxClock.elapsed_time().count();
+    int len = _encode_frame(frame, _txBuffer);
+    char* buff = _txBuffer;
+    if (_apiMode == 2) { // Escape everything after the start delimiter
+      _txEscaped[0] = _txBuffer[0];
+      len = 1 + _escape(&_txBuffer[1], len - 1, &_txEscaped[1]);
+      buff = _txEscaped;
+    }
+    _txEncodeTime += (uint32_t) _rxClock.elapsed_time().count() - encodeStart;
+    _txEncodedBytes += len;
+    XBeeCapture* capture = _capture;
+    if (capture != NULL) capture->record(XBEE_CAPTURE_TX, buff, len);
+    success = _write_all(buff, len, deadline);
+    _modemTxMutex.unlock(); 
+  } else {
+    _count_mutex_timeout();
+  }
+  return success; // Return success boolean 
+}
 
+/** 
+ * Serializes a frame (start delimiter, length, type, ID, data and checksum)
+ * into one contiguous buffer of at least XBEE_TX_BUFFER_SIZE bytes
+ * 
+ * @returns number of bytes to write
+ */
+int XBeeAPIParser::_encode_frame(const apiFrame_t* frame, char* buff) {
   // To calculate the checksum of an API frame 
   // 1) Add all bytes of the packet except for the start delimiter 0x7E and the length
   // 2) Keep only the lowest 8 bits from the result 
   // 3) Subtract from 0xFF
-  uint32_t checksum = frame->type; // Start with frame type
-  checksum = checksum + frame->id; // Add the first two data bytes
+  uint8_t checksum = frame->type + frame->id; // Start with frame type and ID
+  buff[0] = 0x7E; // Start delimiter
+  buff[1] = (frame->length+2) >> 8; // Length MSB
+  buff[2] = (frame->length+2) & 0xFF; // Length LSB 
+  buff[3] = frame->type;
+  buff[4] = frame->id;
+  memcpy(&buff[5], frame->data, frame->length);
   for (int i = 0; i < frame->length; i++) { // Sum all other bytes 
-    checksum = checksum + frame->data[i];
+    checksum += (uint8_t) frame->data[i];
   }
-  checksum = checksum & 0xFF; // Keep only 8 lowest bits 
-  checksum = 0xFF - checksum; // Subtract from 0xFF
+  buff[5 + frame->length] = 0xFF - checksum;
+  return frame->length + 6;
+}
 
-  Timer t;
-  t.start(); // Start timer; entire send must complete before _time_out
-  if (_modemTxMutex.trylock_for(_time_out)) { 
-    while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {}
-    if (_modem->writable()) { // write the start delimiter (0x7E)
-      c = 0x7E;
-      _modem->write(&c, 1);
-    } else {success = false; goto unlockmutex;}
-
-    while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {} 
-    if (_modem->writable()) {
-      c = (frame->length+2) >> 8; // Write length MSB
-      _modem->write(&c, 1);
-    } else {success = false; goto unlockmutex;}
-    
-    while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {} 
-    if (_modem->writable()) {
-      c = (frame->length+2) & 0xFF; // Write length LSB 
-      _modem->write(&c, 1);
-    } else {success = false; goto unlockmutex;}
-    
-    while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {}
-    if (_modem->writable()) {
-      c = frame->type; // Write frame type 
-      _modem->write(&c, 1);
-    } else {success = false; goto unlockmutex;}
-
-    while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {} 
-    if (_modem->writable()) {
-      c = frame->id; // Write frame ID 
-      _modem->write(&c, 1);
-    } else {success = false; goto unlockmutex;}
-
-    for (int i = 0; i < frame->length; i++) {
-      while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {}  
-      if (_modem->writable()) {
-        c = frame->data[i]; // Write each byte of the data, one at a time 
-        _modem->write(&c, 1);
-      } else {success = false; goto unlockmutex;}
-    }
-
-    while ((t.elapsed_time() < _time_out) && (!_modem->writable())) {}
-    if (_modem->writable()) {
-      c = checksum; // Write the final byte (checksum) 
-      _modem->write(&c, 1);
-    } else success = false;
-  unlockmutex:
-    _modemTxMutex.unlock(); 
+/** 
+ * Hands a buffer to the serial port, sleeping on sigio while the port's 
+ * transmit buffer is full. The modem TX mutex must be held.
+ * 
+ * @returns true if everything was written before the deadline
+ */
+bool XBeeAPIParser::_write_all(const char* buff, int len, Kernel::Clock::time_point deadline) {
+  int sent = 0;
+  while (sent < len) {
+    // Clear before writing so space freed after a failed write still wakes us
+    _serialEvents.clear(XBEE_TX_SIGNAL_FLAG);
+    ssize_t n = _modem->write(buff + sent, len - sent);
+    if (n > 0) {
+      sent += n;
+    } else {
+      Kernel::Clock::time_point now = Kernel::Clock::now();
+      if (now >= deadline) return false;
+      _serialEvents.wait_any_for(XBEE_TX_SIGNAL_FLAG, deadline - now);
+    }
   }
-  return success; // Return success boolean 
+  return true;
 }
 
 void XBeeAPIParser::set_frame_alert_thread_id(osThreadId_t threadID) {
@@ -352,67 +667,268 @@ void XBeeAPIParser::set_timeout(std::chrono::milliseconds t) {
 
 // ???
 int XBeeAPIParser::txAddressed(uint64_t address, char* payload, int len) {
-  if (len>(MAX_FRAME_LENGTH)) return -1;
   apiFrame_t frame;
-  bool foundFrame;
-  char frameID = 0x00;
-  for (int i = 0; i < len; i++) {
-    frameID = frameID + payload[i];
+  if (!_make_TX_frame(address, payload, len, &frame)) return -1;
+  return _tx_and_wait(&frame);
+}
+
+/** 
+ * Sends a packet to a 16-bit (MY) address with a 0x01 TX request and waits 
+ * for its transmit status
+ * 
+ * @returns same as txAddressed
+ */
+int XBeeAPIParser::txShort(uint16_t shortAddress, char* payload, int len) {
+  apiFrame_t frame;
+  if (!_make_TX16_frame(shortAddress, payload, len, &frame)) return -1;
+  return _tx_and_wait(&frame);
+}
+
+/** 
+ * Sends a TX request and waits for its transmit status (0x89)
+ * 
+ * @returns same as txAddressed
+ */
+int XBeeAPIParser::_tx_and_wait(apiFrame_t* frame) {
+  XBeeFuture status;
+  _txMutex.lock();
+  _tx_begin();
+  _txMutex.unlock();
+  request(frame, 0x89, request_timeout(frame), &status); // Frame ID is assigned by the transaction engine
+  status.wait(); // Stop and wait for the transmit status (0x89)
+  _txMutex.lock();
+  int result = _tx_result(status.status(), status.response(), true);
+  _tx_end();
+  _txMutex.unlock();
+  if (result == -2) _disassociate();
+  return result;
+}
+
+/** 
+ * Queues a message for transmission without waiting for its transmit status.
+ * Up to the transmit window's worth of messages are in flight at once; this
+ * only blocks while the window is full. delivered(result) is called on the
+ * receive thread with the same codes txAddressed returns once the 0x89 
+ * status arrives, in whatever order the radio reports them. It is called 
+ * exactly once for every call that does not return -1; when the request 
+ * never gets out it is called with -3 before txStream returns. A caller 
+ * that retries failed messages itself can pass countFailures false so the
+ * attempts it will retry do not count towards disassociation.
+ * 
+ * @returns frame ID of the queued request | -1 if payload is too long 
+ * | -3 if the window did not open in time or the request could not be sent
+ */
+int XBeeAPIParser::txStream(uint64_t address, char* payload, int len, Callback<void(int)> delivered, bool countFailures) {
+  apiFrame_t frame;
+  _run_deferred_disassociate();
+  if (!_make_TX_frame(address, payload, len, &frame)) return -1;
+  txStreamSlot_t* slot = NULL;
+  // A slot frees up by the time the longest request times out
+  Kernel::Clock::time_point deadline = Kernel::Clock::now() + _longest_timeout();
+  _txMutex.lock();
+  while (slot == NULL) {
+    if (_txOutstanding < _txWindow) {
+      for (int i = 0; (i < XBEE_MAX_TX_WINDOW) && (slot == NULL); i++) {
+        if (!_txSlots[i].active) slot = &_txSlots[i];
+      }
+    }
+    if ((slot == NULL) && _txWindowOpen.wait_until(deadline)) { // Window stayed full
+      _txMutex.unlock();
+      if (delivered) delivered(-3);
+      return -3;
+    }
+  }
+  slot->active = true;
+  slot->countFailures = countFailures;
+  slot->delivered = delivered;
+  _tx_begin();
+  _txMutex.unlock();
+  // The status callback releases the slot, even if the request fails here
+  int frameID = request(&frame, 0x89, request_timeout(&frame), callback(&XBeeAPIParser::_tx_stream_status, slot));
+  return (frameID < 0) ? -3 : frameID;
+}
+
+/** 
+ * Blocks until every transmission in flight has reported its status or 
+ * timed out.
+ * 
+ * @returns true if nothing is left in flight
+ */
+bool XBeeAPIParser::txStreamFlush() {
+  // Every request times out by _longest_timeout(); allow the receive thread a little slack
+  Kernel::Clock::time_point deadline = Kernel::Clock::now() + _longest_timeout() + _time_out;
+  _txMutex.lock();
+  while ((_txOutstanding > 0) && !_txWindowOpen.wait_until(deadline)) {}
+  bool drained = (_txOutstanding == 0);
+  _txMutex.unlock();
+  _run_deferred_disassociate();
+  return drained;
+}
+
+/** 
+ * Sets how many streamed transmissions may await their status at once 
+ */
+void XBeeAPIParser::set_tx_window(int window) {
+  if ((window > 0) && (window <= XBEE_MAX_TX_WINDOW)) {
+    _txMutex.lock();
+    _txWindow = window;
+    _txWindowOpen.notify_all();
+    _txMutex.unlock();
+  }
+}
+
+/** 
+ * @returns successfully delivered frames per second of time during which at
+ * least one transmission was in flight, for either txAddressed or txStream
+ */
+float XBeeAPIParser::tx_frames_per_second() {
+  _txMutex.lock();
+  uint64_t busy = _txBusyTime;
+  if (_txOutstanding > 0) busy += (uint32_t) _rxClock.elapsed_time().count() - _txBusySince;
+  uint32_t delivered = _txDelivered;
+  _txMutex.unlock();
+  if (busy == 0) return 0.0f;
+  return delivered * 1.0e6f / busy;
+}
+
+void XBeeAPIParser::reset_tx_stats() {
+  _txMutex.lock();
+  _txDelivered = 0;
+  _txFailed = 0;
+  _txBusyTime = 0;
+  _txBusySince = _rxClock.elapsed_time().count();
+  _txMutex.unlock();
+  _modemTxMutex.lock();
+  _txEncodeTime = 0;
+  _txEncodedBytes = 0;
+  _modemTxMutex.unlock();
+}
+
+/** 
+ * Builds a TX request frame: the 16-bit form (0x01) if the destination's 
+ * short address is known, else the 64-bit form (0x00)
+ * 
+ * @returns false if the payload will not fit in a frame
+ */
+bool XBeeAPIParser::_make_TX_frame(uint64_t address, const char* payload, int len, apiFrame_t* frame) {
+  if ((len < 0) || (len > MAX_FRAME_LENGTH - 9)) return false;
+  uint16_t shortAddress;
+  if ((address != 0xFFFF) && short_address(address, &shortAddress)) { // Never for broadcasts
+    return _make_TX16_frame(shortAddress, payload, len, frame);
   }
-  frame.type = 0x00; // Tx Request Frame Type
-  frame.id = frameID;
+  frame->type = 0x00; // Tx Request Frame Type
+  frame->id = 0x01; // Replaced by the transaction engine
   for (int i = 0; i < 8; i++) {
-    frame.data[i] = (address >> ((7-i)*8)) & 0xFF;
-  }
-  frame.data[8] = 0x00;  // No options
-  for (int i = 0; i < len; i++) {
-    frame.data[9+i] = payload[i];
-  }
-  frame.length = len + 9;
-  send(&frame);
-  Timer t;
-  t.start();
-  foundFrame = false;
-  ThisThread::sleep_for(7ms);
-  while ((t.elapsed_time() < 2*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x89, frameID, &frame);
-    if (!foundFrame) ThisThread::sleep_for(7ms);
-  }
-  if (foundFrame) {
-    if (frame.data[0] == 0x00) {
+    frame->data[i] = (address >> ((7-i)*8)) & 0xFF;
+  }
+  frame->data[8] = 0x00;  // No options
+  memcpy(&frame->data[9], payload, len);
+  frame->length = len + 9;
+  return true;
+}
+
+/** 
+ * Builds a 16-bit addressed TX request frame (0x01), 6 bytes shorter than 
+ * the 64-bit form. The payload limit is the same for both so a packet never
+ * becomes too long because its destination's short address was forgotten.
+ * 
+ * @returns false if the payload will not fit in a frame
+ */
+bool XBeeAPIParser::_make_TX16_frame(uint16_t shortAddress, const char* payload, int len, apiFrame_t* frame) {
+  if ((len < 0) || (len > MAX_FRAME_LENGTH - 9)) return false;
+  frame->type = 0x01; // 16-bit Tx Request Frame Type
+  frame->id = 0x01; // Replaced by the transaction engine
+  frame->data[0] = shortAddress >> 8;
+  frame->data[1] = shortAddress & 0xFF;
+  frame->data[2] = 0x00; // No options
+  memcpy(&frame->data[3], payload, len);
+  frame->length = len + 3;
+  _shortFramesSent++;
+  return true;
+}
+
+/** 
+ * Applies the outcome of one transmission to the failure accounting. A 
+ * failure that is not counted still shows in the statistics but leaves the
+ * run of consecutive failures alone. The transmit mutex must be held.
+ * 
+ * @returns 0 if delivered | -2 if too many failures in a row call for 
+ * disassociation | -3 if failed or timed out
+ */
+int XBeeAPIParser::_tx_result(int txnStatus, const apiFrame_t* status, bool countFailures) {
+  if (txnStatus == XBEE_TXN_OK) {
+    if (status->data[0] == 0x00) {
       _failedTransmits = 0;
+      _txDelivered++;
       return 0;
-    } else {
-      _failedTransmits++;
-      if (_failedTransmits>= _maxFailedTransmits) {
-        _disassociate();
-        _failedTransmits = 0;
-        return -2;
-      }
     }
+    _txFailed++;
+    core_util_atomic_incr_u32(&_metrics.txFailures, 1);
+    if (!countFailures) return -3;
+    _failedTransmits++;
+    if (_failedTransmits >= _maxFailedTransmits) {
+      _failedTransmits = 0;
+      return -2;
+    }
+    return -3;
   }
+  _txFailed++; // No status received
+  core_util_atomic_incr_u32(&_metrics.txFailures, 1);
   return -3;
 }
 
+/** 
+ * Marks the start of a transmission for throughput accounting. The transmit 
+ * mutex must be held.
+ */
+void XBeeAPIParser::_tx_begin() {
+  if (_txOutstanding++ == 0) _txBusySince = _rxClock.elapsed_time().count();
+}
+
+/** 
+ * Marks the end of a transmission and opens the window. The transmit mutex
+ * must be held.
+ */
+void XBeeAPIParser::_tx_end() {
+  if (--_txOutstanding == 0) _txBusyTime += (uint32_t) _rxClock.elapsed_time().count() - _txBusySince;
+  _txWindowOpen.notify_all();
+}
+
+/** 
+ * Transaction callback for streamed transmissions. Runs on the receive 
+ * thread, so a disassociation it calls for is left to the next caller.
+ */
+void XBeeAPIParser::_tx_stream_status(txStreamSlot_t* slot, int txnStatus, const apiFrame_t* status) {
+  XBeeAPIParser* parser = slot->parser;
+  parser->_txMutex.lock();
+  int result = parser->_tx_result(txnStatus, status, slot->countFailures);
+  if (result == -2) parser->_disassociateRequested = true;
+  Callback<void(int)> delivered = slot->delivered;
+  slot->active = false;
+  parser->_tx_end();
+  parser->_txMutex.unlock();
+  if (delivered) delivered(result);
+}
+
+/** 
+ * Performs a disassociation requested from the receive thread
+ */
+void XBeeAPIParser::_run_deferred_disassociate() {
+  if (_disassociateRequested) {
+    _disassociateRequested = false;
+    _disassociate();
+  }
+}
+
 int XBeeAPIParser::txBroadcast(char* payload, int len) {
   return txAddressed(0xFFFF, payload, len);
 }
 
 void XBeeAPIParser::_disassociate() {
-  Timer t;
-  apiFrame_t frame;
-  bool foundFrame;
-  _make_AT_frame("DA", &frame);
-  char frameID = frame.id;
-  send(&frame);
-  t.start();
-  foundFrame = false;
-  while ((t.elapsed_time() < 2*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x88, frameID, &frame);
-    if (!foundFrame) ThisThread::sleep_for(5ms);
-  }
-  if (foundFrame) {
-    if ((frame.data[0]=='D') && (frame.data[1]=='A') && (frame.data[2]==0)) {
+  XBeeFuture reply;
+  if ((at_request("DA", "", &reply) >= 0) && (reply.wait() == XBEE_TXN_OK)) {
+    const apiFrame_t* response = reply.response();
+    if ((response->data[0]=='D') && (response->data[1]=='A') && (response->data[2]==0)) {
       _isAssociated = false;
     }
   }
@@ -433,8 +949,9 @@ void XBeeAPIParser::_make_AT_frame(string cmd, string param, apiFrame_t* frame)
     frame->data[0] = cmd[0]; 
     frame->data[1] = cmd[1]; 
   }
-  frame->id = cmd[0] + cmd[1]; // Set the frame id to the sum of the first two characters in the given string
-  // The frame id identifies the data frame for the host to correlate with a subsequent response 
+  // The frame id identifies the data frame for the host to correlate with a subsequent response.
+  // request() replaces it with a unique id; any nonzero id asks the XBee to respond.
+  frame->id = 0x01;
   if (param.length()>0) { // Only enter this if a parameter is explicitly given
     for (int i = 0; i < param.length(); i++)
       frame->data[2+i] = param[i];
@@ -442,83 +959,138 @@ void XBeeAPIParser::_make_AT_frame(string cmd, string param, apiFrame_t* frame)
   frame->length = 2 + param.length(); // Set the length of the data 
 }
 
-/** The NEW way forward
-while (true) {
-  while (_modem->readable() and other stuff) {
-    existing stuff happens;
-  }
-  if (frame ready to move) {
-    do the frame moving stuff
+/** 
+ * Builds a remote AT command request (0x17). The 16-bit destination is left
+ * at 0xFFFE so the 64-bit address is used.
+ * 
+ * @returns false if the command or parameter does not fit
+ */
+bool XBeeAPIParser::_make_remote_AT_frame(uint64_t address, string cmd, string param, char options, apiFrame_t* frame) {
+  if ((cmd.length() != 2) || (13 + param.length() > MAX_FRAME_LENGTH)) return false;
+  frame->type = 0x17;
+  frame->id = 0x01; // Replaced by request()
+  for (int i = 0; i < 8; i++) frame->data[i] = (address >> (56 - 8*i)) & 0xFF;
+  frame->data[8] = 0xFF;
+  frame->data[9] = 0xFE;
+  frame->data[10] = options;
+  frame->data[11] = cmd[0];
+  frame->data[12] = cmd[1];
+  memcpy(&frame->data[13], param.data(), param.length());
+  frame->length = 13 + param.length();
+  return true;
+}
+
+/** 
+ * Completion callback for a fan-out request; records the node's status and
+ * value and frees the slot
+ */
+void XBeeAPIParser::_remote_at_done(remoteATSlot_t* slot, int status, const apiFrame_t* response) {
+  remoteATResult_t* result = slot->result;
+  if (status != XBEE_TXN_OK) {
+    result->status = status;
+  } else if (response->length < 13) { // No room for a status
+    result->status = 0x01;
+  } else {
+    result->status = (uint8_t) response->data[12];
+    result->length = response->length - 13;
+    int kept = (result->length < XBEE_REMOTE_AT_MAX_VALUE) ? result->length : XBEE_REMOTE_AT_MAX_VALUE;
+    memcpy(result->value, &response->data[13], kept);
   }
-  ThisThread::sleep_for(10ms);
+  Semaphore* done = slot->done;
+  slot->active = false;
+  done->release();
 }
-*/
 
+/**
+ * @returns true if frames of this type carry a frame ID byte
+ */
+bool XBeeAPIParser::_has_frame_id(char frameType) {
+  switch ((uint8_t) frameType) {
+    case 0x00: case 0x08: case 0x17: case 0x88: case 0x89: case 0x97:
+      return true;
+    default:
+      return false;
+  }
+}
 
-void XBeeAPIParser::_pull_byte() {
-  char buff;
-  uint16_t len;
-  uint32_t checksum = 0;
-  while (_modem->readable() && (_partialFrame.status < 0x06)) {
-    _modem->read(&buff, 1);
+/**
+ * Runs a chunk of received bytes through the frame state machine. The 
+ * checksum is accumulated as bytes arrive and payload runs are block copied,
+ * so completed frames are handed to the frame buffer as soon as their 
+ * checksum byte is seen.
+ */
+void XBeeAPIParser::_parse_chunk(const char* buff, int n) {
+  const char* start;
+  int run;
+  int i = 0;
+  while (i < n) {
+    uint8_t c = buff[i]; // Unsigned, or length bytes sign-extend where char is signed
     switch (_partialFrame.status) {
       case 0x00:  // Waiting for start of new frame
-        if (buff == 0x7E) {  // Frame start byte should be 0x7E
-          _partialFrame.status = 0x01;
-        }
+        // In escaped mode frames only start at a raw 0x7E, which 
+        // _parse_escaped_chunk handles before the bytes get here
+        if (_apiMode == 2) return;
+        // Frame start byte should be 0x7E; skip anything in front of it
+        start = (const char*) memchr(buff + i, 0x7E, n - i);
+        if (start == NULL) return;
+        i = start - buff + 1;
+        _partialFrame.status = 0x01;
         break;
       case 0x01:  // First frame length byte
-        _partialFrame.frame.length = buff << 8;
+        _partialFrame.frame->length = c << 8;
         _partialFrame.status = 0x02;
+        i++;
         break;
       case 0x02: // Second frame length byte
-        _partialFrame.frame.length = (_partialFrame.frame.length | buff)-2;
+        _partialFrame.frame->length = (_partialFrame.frame->length | c)-2;
         _partialFrame.rcvd = 0;
         _partialFrame.status = 0x03;
+        i++;
         break;
       case 0x03: // Frame type
-        _partialFrame.frame.type = buff;
-        switch (buff) { // frame types with FrameID
-          case 0x00: _partialFrame.status = 0x04; break;
-          case 0x08: _partialFrame.status = 0x04; break;
-          case 0x17: _partialFrame.status = 0x04; break;
-          case 0x88: _partialFrame.status = 0x04; break;
-          case 0x89: _partialFrame.status = 0x04; break;
-          case 0x97: _partialFrame.status = 0x04; break;
-          default: // No Frame ID for this type
-            _partialFrame.frame.id = 0xFF;
-            _partialFrame.frame.length++;
-            _partialFrame.status = 0x05;
+        _partialFrame.frame->type = c;
+        _partialFrame.checksum = c;
+        if (_has_frame_id(c)) {
+          _partialFrame.status = 0x04;
+        } else { // No Frame ID for this type
+          _partialFrame.frame->id = 0xFF;
+          _partialFrame.frame->length++;
+          _partialFrame.status = 0x05;
+        }
+        // Incoming frame won't fit!
+        if (_partialFrame.frame->length > _frameLength) {
+          _metrics.oversizeFrames++;
+          _partialFrame.status = 0x00;
         }
+        i++;
         break;
       case 0x04: // Frame ID
-        _partialFrame.frame.id = buff;
+        _partialFrame.frame->id = c;
+        _partialFrame.checksum += c;
         _partialFrame.status = 0x05;
+        i++;
         break;
       case 0x05:
-        len = _partialFrame.frame.length;
-        if (len > MAX_FRAME_LENGTH) { // Incoming frame won't fit!
-          _partialFrame.status = 0x00;
-        } else if (_partialFrame.rcvd < len) {  // Waiting for rest of frame
-          _partialFrame.frame.data[_partialFrame.rcvd] = buff;
-          _partialFrame.rcvd++;
+        if (_partialFrame.rcvd < _partialFrame.frame->length) {  // Waiting for rest of frame
+          // Copy as much of the payload as this chunk holds in one go
+          run = _partialFrame.frame->length - _partialFrame.rcvd;
+          if (run > n - i) run = n - i;
+          memcpy(&_partialFrame.frame->data[_partialFrame.rcvd], buff + i, run);
+          uint8_t sum = _partialFrame.checksum;
+          for (int j = 0; j < run; j++)
+            sum += (uint8_t) buff[i+j];
+          _partialFrame.checksum = sum;
+          _partialFrame.rcvd += run;
+          i += run;
         } else { // This should be the checksum
-          switch (_partialFrame.frame.type) { // frame types with FrameID
-            case 0x00: checksum = _partialFrame.frame.type + _partialFrame.frame.id; break;
-            case 0x08: checksum = _partialFrame.frame.type + _partialFrame.frame.id; break;
-            case 0x17: checksum = _partialFrame.frame.type + _partialFrame.frame.id; break;
-            case 0x88: checksum = _partialFrame.frame.type + _partialFrame.frame.id; break;
-            case 0x89: checksum = _partialFrame.frame.type + _partialFrame.frame.id; break;
-            case 0x97: checksum = _partialFrame.frame.type + _partialFrame.frame.id; break;
-            default: // No Frame ID for this type
-              checksum = _partialFrame.frame.type;
-          }
-          for (int i = 0; i < len; i++)
-            checksum = checksum + _partialFrame.frame.data[i];
-          checksum = (checksum + buff) & 0xFF;
-          if (checksum == 0xFF) { // Frame is good!  Save to buffer.
-            if (_partialFrame.frame.type == 0x8A) { // Intercept modem status frames
-              switch (_partialFrame.frame.data[0]) {
+          i++;
+          if ((uint8_t)(_partialFrame.checksum + c) != 0xFF) { // Checksum doesn't match.  Bad frame!
+            _metrics.checksumErrors++;
+            _partialFrame.status = 0x00;
+          } else { // Frame is good!  Save to buffer.
+            _metrics.framesParsed++;
+            if ((uint8_t) _partialFrame.frame->type == 0x8A) { // Track association from modem status frames
+              switch (_partialFrame.frame->data[0]) {
                 case 0x02:
                   _isAssociated = true;
                   _failedTransmits = 0;
@@ -529,86 +1101,1919 @@ void XBeeAPIParser::_pull_byte() {
                   break;
                 default:
                   _isAssociated = false;
+                  flush_address_cache(); // Addresses must be resolved again after rejoining
               }
-              _partialFrame.status = 0x00;
-            } else {
-              _partialFrame.status = 0x06;
             }
-          } else { // Checksum doesn't match.  Bad frame!
-            _partialFrame.status = 0x00; // There should be some error signaling
+            // Modem status then goes to its subscriber or the buffer like any other frame
+            _partialFrame.status = 0x06;
+            _buffer_partial_frame();
           }
         }
         break;
-      case 0x06:
-        break;
+      default:
+        _partialFrame.status = 0x00;
     }
   }
 }
 
+/**
+ * Called from the serial port (interrupt context) whenever it becomes 
+ * readable or writable. Only records the time and sets the event flags.
+ */
+void XBeeAPIParser::_sigio() {
+  _rxSignalTime = _rxClock.elapsed_time().count();
+  // sigio does not say which way, so wake both the receive thread and any sender
+  _serialEvents.set(XBEE_RX_SIGNAL_FLAG | XBEE_TX_SIGNAL_FLAG);
+}
+
+/**
+ * Receive thread. Sleeps until the serial port signals that bytes have 
+ * arrived (or, in polling mode, for the polling interval), then drains 
+ * everything that is available into the frame buffer.
+ */
 void XBeeAPIParser::_move_frame_to_buffer() {
-  while (true) {
-    while (_partialFrame.status != 0x06) {
-      _pull_byte();
-      ThisThread::sleep_for(10ms);
+  while (!_stopping) {
+    // Time out overdue requests and find when the next one is due
+    Kernel::Clock::time_point nextDeadline = _expire_transactions();
+    if (_rxPollInterval > 0ms) {
+      ThisThread::sleep_for(_rxPollInterval);
+    } else {
+      // Also wake for the next request deadline, or after _time_out as a 
+      // safety net in case a sigio edge is ever missed
+      Kernel::Clock::time_point now = Kernel::Clock::now();
+      std::chrono::milliseconds wait = (nextDeadline > now) ? nextDeadline - now : 0ms;
+      _serialEvents.wait_any_for(XBEE_RX_SIGNAL_FLAG | XBEE_TXN_SIGNAL_FLAG, wait);
     }
-    if (_frameBufferMutex.trylock_for(5*_time_out)) {
-      if (_frameBuffer.length == MAX_INCOMING_FRAMES) {  // Buffer full, drop oldest frame
-        _remove_frame_by_index(0);
-      }
-      int n = _frameBuffer.length; // Save current length for ease of copying to buffer
-      _frameBuffer.frame[n].id = _partialFrame.frame.id;
-      _frameBuffer.frame[n].type = _partialFrame.frame.type;
-      _frameBuffer.frame[n].length = _partialFrame.frame.length;
-      for (int i = 0; i < _partialFrame.frame.length; i++)
-        _frameBuffer.frame[n].data[i] = _partialFrame.frame.data[i];
-      _frameBuffer.length++;
-      _frameBufferMutex.unlock();
-      _partialFrame.status = 0x00;
-      if (_frameAlertThreadId) osSignalSet(_frameAlertThreadId, 0x01); 
+    _rxWakeups++;
+    ssize_t n;
+    // Non-blocking reads return -EAGAIN once the port has been drained
+    while ((n = _modem->read(_rxChunk, _rxChunkSize)) > 0) {
+      uint32_t parseStart = _rxClock.elapsed_time().count();
+      _rxChunkTime = parseStart; // Closest we get to when the last byte arrived
+      _metrics.bytesReceived += n;
+      XBeeCapture* capture = _capture;
+      if (capture != NULL) capture->record(XBEE_CAPTURE_RX, _rxChunk, n);
+      if (_apiMode == 2) _parse_escaped_chunk(_rxChunk, n);
+      else _parse_chunk(_rxChunk, n);
+      _rxParseTime += (uint32_t) _rxClock.elapsed_time().count() - parseStart;
+      _rxBytes += n;
     }
   }
 }
 
-
-/** 
- * Remove the frame at the given index from the frame buffer 
+/**
+ * Copies a completed (checksum verified) partial frame into the frame buffer
  */
-void XBeeAPIParser::_remove_frame_by_index(int n) {
-  if (n< _frameBuffer.length) { // Only proceed if the given index is valid 
-    for (int i = n + 1; i < _frameBuffer.length; i++) {
-      for (int j = 0; j < _frameBuffer.frame[i].length; j++) {
-        _frameBuffer.frame[i-1].data[j] = _frameBuffer.frame[i].data[j];
-      }
-      _frameBuffer.frame[i-1].type = _frameBuffer.frame[i].type;
-      _frameBuffer.frame[i-1].id = _frameBuffer.frame[i].id;
-      _frameBuffer.frame[i-1].length = _frameBuffer.frame[i].length;
-    }
+void XBeeAPIParser::_buffer_partial_frame() {
+  if ((uint8_t) _partialFrame.frame->type == 0x90) _learn_short_address(_partialFrame.frame);
+  // Responses to outstanding requests go straight to their requester
+  // and frame types with a subscriber to their owner
+  if (_complete_transaction() || _dispatch_frame()) {
+    _record_latency(&_metrics.deliveryLatency, (uint32_t) _rxClock.elapsed_time().count() - _rxChunkTime);
+    _partialFrame.status = 0x00;
+    return;
+  }
+  // Hand the block the parser just filled to the buffer and continue in a fresh one
+  int block = _take_rx_block();
+  if (block != XBEE_NO_FRAME) {
+    _record_latency(&_metrics.deliveryLatency, (uint32_t) _rxClock.elapsed_time().count() - _rxChunkTime);
+    _buffer_block(block);
   }
-  if (_frameBuffer.length>0) _frameBuffer.length--;
+  _partialFrame.status = 0x00;
 }
 
-void XBeeAPIParser::_verify_association() {
-  Timer t; // Create timer object 
-  apiFrame_t frame; // Create frame object 
-  bool foundFrame;
-  char status = 0xFE; // Set the status
-  _make_AT_frame("AI", &frame);  // Make local AT command frame and set command to association indication  
-  char frameID = frame.id; // Collect the frame id (0x8A for AI)
-  _isAssociated = false; // Set default value to false 
-  foundFrame = false; // Set default value to false 
-  send(&frame); // Write out the frame 
-  t.start(); // Start the timer 
-  while ((t.elapsed_time() < 2*_time_out) && (!foundFrame)) {
-    foundFrame = find_frame(0x88, frameID, &frame);
-    if (!foundFrame) ThisThread::sleep_for(5ms);
-  }
-  if (foundFrame) { // If the frame is found 
-    if ((frame.data[0]=='A') && (frame.data[1]=='I') && (frame.data[2]==0)) {
-      status = frame.data[3]; // Collect the modem status from the fourth index of the frame
-    }
+/**
+ * Passes a block taken from the parser to the frame buffer and wakes anyone
+ * waiting for frames. Only called by the receive thread.
+ */
+void XBeeAPIParser::_buffer_block(int block) {
+  _publish_frame(block);
+  _rxFrames++;
+  // Latency from the serial port signalling data to the frame being available
+  uint32_t latency = (uint32_t) _rxClock.elapsed_time().count() - _rxSignalTime;
+  _rxLatencyTotal += latency;
+  if (latency > _rxLatencyMax) _rxLatencyMax = latency;
+  if (_frameAlertThreadId) osSignalSet(_frameAlertThreadId, 0x01); 
+}
+
+/**
+ * Selects how the receive thread waits for incoming bytes. An interval of 0ms
+ * (the default) sleeps until the serial port signals data. Any other interval
+ * polls the port at that rate, which is only useful for comparison.
+ */
+void XBeeAPIParser::set_rx_polling(std::chrono::milliseconds interval) {
+  if ((interval >= 0ms) && (interval < 1s)) {
+    _rxPollInterval = interval;
+    _serialEvents.set(XBEE_RX_SIGNAL_FLAG); // Let the receive thread pick up the change
   }
-  if (status == 0x00) _isAssociated = true; // If status is 0x00 (end device successfully associated), return true 
 }
 
+/** 
+ * @returns average number of times per second the receive thread woke up
+ * since the statistics were last reset
+ */
+float XBeeAPIParser::rx_wakeups_per_second() {
+  uint32_t elapsed = (uint32_t) _rxClock.elapsed_time().count() - _rxStatsStart;
+  if (elapsed == 0) return 0.0f;
+  return _rxWakeups * 1.0e6f / elapsed;
+}
+
+/** 
+ * @returns mean time from the serial port signalling data to a frame being 
+ * available in the frame buffer
+ */
+std::chrono::microseconds XBeeAPIParser::rx_latency_mean() {
+  if (_rxFrames == 0) return 0us;
+  return std::chrono::microseconds(_rxLatencyTotal / _rxFrames);
+}
 
+/** 
+ * @returns worst case time from the serial port signalling data to a frame 
+ * being available in the frame buffer
+ */
+std::chrono::microseconds XBeeAPIParser::rx_latency_max() {
+  return std::chrono::microseconds(_rxLatencyMax);
+}
 
+void XBeeAPIParser::reset_rx_stats() {
+  _rxWakeups = 0;
+  _rxLatencyTotal = 0;
+  _rxLatencyMax = 0;
+  _rxBytes = 0;
+  _rxFrames = 0;
+  _rxParseTime = 0;
+  _rxStatsStart = _rxClock.elapsed_time().count();
+}
+
+/** 
+ * Hands the block the parser just filled over and gives the parser an unused
+ * one from the free ring, without taking any lock. Only called by the 
+ * receive thread, after checking the free ring is not empty.
+ * 
+ * @returns the filled block
+ */
+int XBeeAPIParser::_swap_rx_block(int lane) {
+  int filled = _rxBlock;
+  _links(filled)->lane = lane;
+  core_util_atomic_incr_u32(&_laneUsed[lane], 1);
+  uint8_t tail = _freeRingTail;
+  _rxBlock = _freeRing[tail];
+  core_util_atomic_store_u8(&_freeRingTail, tail + 1);
+  _partialFrame.frame = _frame(_rxBlock);
+  return filled;
+}
+
+/** 
+ * Puts a block back in the free ring. The frame buffer mutex must be held,
+ * which makes the holder the ring's only producer.
+ */
+void XBeeAPIParser::_free_block(int block) {
+  frameLinks_t* links = _links(block);
+  if (links->lane != XBEE_NO_LANE) core_util_atomic_decr_u32(&_laneUsed[links->lane], 1);
+  links->lane = XBEE_NO_LANE;
+  uint8_t head = _freeRingHead;
+  _freeRing[head] = block;
+  core_util_atomic_store_u8(&_freeRingHead, head + 1);
+  _frameFreed.notify_all(); // A producer may be waiting for space
+}
+
+/** 
+ * Passes a filled block to the frame buffer. Only called by the receive 
+ * thread, which never waits for the lock here: if a consumer holds it, the 
+ * block stays in the ring and the consumer links it before unlocking.
+ */
+void XBeeAPIParser::_publish_frame(int block) {
+  uint8_t head = _rxRingHead;
+  _rxRing[head] = block;
+  core_util_atomic_store_u8(&_rxRingHead, head + 1);
+  if (_frameBufferMutex.trylock()) {
+    _unlock_frame_buffer();
+  } else {
+    _metrics.deferredHandoffs++;
+  }
+}
+
+/** 
+ * Locks the frame buffer and links in any frames the receive thread has 
+ * handed over
+ */
+void XBeeAPIParser::_lock_frame_buffer() {
+  _frameBufferMutex.lock();
+  _drain_rx_ring();
+}
+
+/** 
+ * Unlocks the frame buffer without stranding frames handed over while it 
+ * was held. If the receive thread published after the last drain, its 
+ * trylock failed, so the frame is linked here, unless another thread has 
+ * taken the lock by then and will do it instead.
+ */
+void XBeeAPIParser::_unlock_frame_buffer() {
+  while (true) {
+    _drain_rx_ring();
+    _frameBufferMutex.unlock();
+    if (core_util_atomic_load_u8(&_rxRingHead) == _rxRingTail) return;
+    if (!_frameBufferMutex.trylock()) return;
+  }
+}
+
+/** 
+ * Links handed over frames into the buffer, waking anyone blocked in 
+ * wait_for_frame. The frame buffer mutex must be held, which makes the 
+ * holder the ring's only consumer.
+ * 
+ * @returns true if any frames were linked
+ */
+bool XBeeAPIParser::_drain_rx_ring() {
+  uint8_t tail = _rxRingTail;
+  uint8_t head = core_util_atomic_load_u8(&_rxRingHead);
+  if (tail == head) return false;
+  while (tail != head) _link_frame(_rxRing[tail++]);
+  core_util_atomic_store_u8(&_rxRingTail, tail);
+  _frameArrived.notify_all();
+  return true;
+}
+
+/** 
+ * Appends a block to the end of the frame buffer 
+ */
+void XBeeAPIParser::_link_frame(int block) {
+  _links(block)->prev = _frameTail;
+  _links(block)->next = XBEE_NO_FRAME;
+  if (_frameTail != XBEE_NO_FRAME) _links(_frameTail)->next = block;
+  else _frameHead = block;
+  _frameTail = block;
+  _frameCount++;
+  // Add to the end of its (type, ID) index chain so lookups stay oldest-first
+  uint8_t* link = &_frameIndex[_frame_key_hash(_frame(block)->type, _frame(block)->id)];
+  while (*link != XBEE_NO_FRAME) link = &_links(*link)->indexNext;
+  *link = block;
+  _links(block)->indexNext = XBEE_NO_FRAME;
+}
+
+/** 
+ * Removes a block from anywhere in the frame buffer in constant time 
+ */
+void XBeeAPIParser::_unlink_frame(int block) {
+  frameLinks_t* links = _links(block);
+  if (links->prev != XBEE_NO_FRAME) _links(links->prev)->next = links->next;
+  else _frameHead = links->next;
+  if (links->next != XBEE_NO_FRAME) _links(links->next)->prev = links->prev;
+  else _frameTail = links->prev;
+  _frameCount--;
+  uint8_t* link = &_frameIndex[_frame_key_hash(_frame(block)->type, _frame(block)->id)];
+  while (*link != block) link = &_links(*link)->indexNext;
+  *link = links->indexNext;
+}
+
+/** 
+ * Returns a block handed out through an XBeeFrameHandle to the pool 
+ */
+void XBeeAPIParser::_release_block(int block) {
+  _frameBufferMutex.lock();
+  _free_block(block);
+  _unlock_frame_buffer();
+}
+
+XBeeFrameHandle::XBeeFrameHandle() {
+  _parser = NULL;
+  _block = XBEE_NO_FRAME;
+}
+
+XBeeFrameHandle::~XBeeFrameHandle() {
+  release();
+}
+
+bool XBeeFrameHandle::valid() const {
+  return _parser != NULL;
+}
+
+const apiFrame_t* XBeeFrameHandle::get() const {
+  return valid() ? _parser->_frame(_block) : NULL;
+}
+
+const apiFrame_t* XBeeFrameHandle::operator->() const {
+  return get();
+}
+
+/** 
+ * Returns the frame's pool block to the parser. Safe to call more than once.
+ */
+void XBeeFrameHandle::release() {
+  if (_parser != NULL) {
+    _parser->_release_block(_block);
+    _parser = NULL;
+    _block = XBEE_NO_FRAME;
+  }
+}
+
+void XBeeAPIParser::_verify_association() {
+  XBeeFuture reply;
+  char status = 0xFE; // Set the status
+  _isAssociated = false; // Set default value to false 
+  // Send local AT command frame for association indication and wait for its response
+  if ((at_request("AI", "", &reply) >= 0) && (reply.wait() == XBEE_TXN_OK)) { // If the frame is found 
+    const apiFrame_t* response = reply.response();
+    if ((response->data[0]=='A') && (response->data[1]=='I') && (response->data[2]==0)) {
+      status = response->data[3]; // Collect the modem status from the fourth index of the frame
+    }
+  }
+  if (status == 0x00) _isAssociated = true; // If status is 0x00 (end device successfully associated), return true 
+}
+
+
+
+
+/**
+ * Sets how many bytes the receive thread asks the serial port for per read.
+ * A chunk size of 1 reproduces byte-at-a-time reads for comparison.
+ */
+void XBeeAPIParser::set_rx_chunk_size(int n) {
+  if ((n > 0) && (n <= XBEE_RX_CHUNK_SIZE)) _rxChunkSize = n;
+}
+
+/** 
+ * @returns parser throughput in megabytes per second of time spent parsing
+ */
+float XBeeAPIParser::rx_parse_mbytes_per_second() {
+  if (_rxParseTime == 0) return 0.0f;
+  return (float) _rxBytes / _rxParseTime; // bytes per microsecond = MB/s
+}
+
+/** 
+ * @returns parser throughput in frames per second of time spent parsing
+ */
+float XBeeAPIParser::rx_parse_frames_per_second() {
+  if (_rxParseTime == 0) return 0.0f;
+  return _rxFrames * 1.0e6f / _rxParseTime;
+}
+
+/** 
+ * Sends a request frame and completes the future when the response of the 
+ * given type with the same frame ID arrives, or after the timeout. The frame
+ * ID is assigned here, so many requests may be outstanding at once.
+ * 
+ * @returns assigned frame ID (1-255) | negative XBEE_TXN_ code on failure
+ */
+int XBeeAPIParser::request(apiFrame_t* frame, char responseType, std::chrono::milliseconds timeout, XBeeFuture* future) {
+  return _submit(frame, responseType, timeout, nullptr, future, false);
+}
+
+/** 
+ * Sends a request frame and calls done(status, response) exactly once: on the
+ * receive thread when the matching response arrives, or with a NULL response
+ * on timeout, cancellation or send failure. The response frame is only valid
+ * for the duration of the callback.
+ * 
+ * @returns assigned frame ID (1-255) | negative XBEE_TXN_ code on failure
+ */
+int XBeeAPIParser::request(apiFrame_t* frame, char responseType, std::chrono::milliseconds timeout, Callback<void(int, const apiFrame_t*)> done) {
+  return _submit(frame, responseType, timeout, done, NULL, false);
+}
+
+/** 
+ * Sends a local AT command (0x08) and completes the future with its 0x88 
+ * response
+ * 
+ * @returns assigned frame ID (1-255) | negative XBEE_TXN_ code on failure
+ */
+int XBeeAPIParser::at_request(string cmd, string param, XBeeFuture* future) {
+  apiFrame_t frame;
+  _make_AT_frame(cmd, param, &frame);
+  return request(&frame, 0x88, request_timeout(&frame), future);
+}
+
+/** 
+ * Sends an AT command to a remote node (0x17) and completes the future with
+ * the node's 0x97 response: source address (8 bytes), source short address
+ * (2), command (2), status (1) and any value. Without apply the node queues
+ * the change until a later command applies it, as AC does.
+ * 
+ * @returns assigned frame ID (1-255) | negative XBEE_TXN_ code on failure
+ */
+int XBeeAPIParser::remote_at_request(uint64_t address, string cmd, string param, XBeeFuture* future, bool apply) {
+  apiFrame_t frame;
+  if (!_make_remote_AT_frame(address, cmd, param, apply ? XBEE_REMOTE_AT_APPLY : 0x00, &frame)) {
+    if (future != NULL) future->_status = XBEE_TXN_SEND_FAILED;
+    return XBEE_TXN_SEND_FAILED;
+  }
+  return request(&frame, 0x97, request_timeout(&frame), future);
+}
+
+/** 
+ * Sends the same commands to many nodes with up to XBEE_REMOTE_AT_WINDOW
+ * requests in flight, so configuring a fleet takes about as many round 
+ * trips as there are commands rather than commands times nodes. Each node 
+ * gets its commands in order and only the last one applies them, so a 
+ * channel or PAN ID change takes effect once the whole set has arrived. 
+ * Blocks until every request has its response or has timed out.
+ * 
+ * @param results nodes*count entries; the result of command c for node n is
+ * results[n*count + c]
+ * @returns nodes that answered every command with status 0 (OK)
+ */
+int XBeeAPIParser::remote_at_fanout(const uint64_t* addresses, int nodes, const remoteATCommand_t* commands, int count, remoteATResult_t* results) {
+  if ((nodes <= 0) || (count <= 0)) return 0;
+  remoteATSlot_t slots[XBEE_REMOTE_AT_WINDOW];
+  Semaphore done(0);
+  for (int i = 0; i < XBEE_REMOTE_AT_WINDOW; i++) {
+    slots[i].active = false;
+    slots[i].done = &done;
+  }
+  int outstanding = 0;
+  apiFrame_t frame;
+  // Command by command across the fleet, so every node has a request in
+  // flight while each one still sees its own commands in order
+  for (int c = 0; c < count; c++) {
+    char options = (c == count - 1) ? XBEE_REMOTE_AT_APPLY : 0x00;
+    for (int n = 0; n < nodes; n++) {
+      remoteATResult_t* result = &results[n*count + c];
+      result->length = 0;
+      if (!_make_remote_AT_frame(addresses[n], commands[c].command, commands[c].parameter, options, &frame)) {
+        result->status = XBEE_TXN_SEND_FAILED;
+        continue;
+      }
+      while (true) {
+        if (outstanding == XBEE_REMOTE_AT_WINDOW) {
+          done.acquire();
+          outstanding--;
+        }
+        remoteATSlot_t* slot = slots;
+        while (slot->active) slot++;
+        slot->active = true;
+        slot->result = result;
+        result->status = XBEE_TXN_PENDING;
+        outstanding++;
+        // The callback finishes the slot whatever happens, even here
+        int frameID = request(&frame, 0x97, request_timeout(&frame), callback(&XBeeAPIParser::_remote_at_done, slot));
+        if ((frameID != XBEE_TXN_BUSY) || (outstanding == 1)) break;
+        // Other requests fill the pending table. Collect the busy one, wait
+        // for one of ours to finish and try again.
+        done.acquire();
+        done.acquire();
+        outstanding -= 2;
+      }
+    }
+  }
+  while (outstanding > 0) {
+    done.acquire();
+    outstanding--;
+  }
+  int configured = 0;
+  for (int n = 0; n < nodes; n++) {
+    bool ok = true;
+    for (int c = 0; c < count; c++) {
+      if (results[n*count + c].status != 0) ok = false;
+    }
+    if (ok) configured++;
+  }
+  return configured;
+}
+
+/** 
+ * Cancels an outstanding request. Its future or callback completes with 
+ * XBEE_TXN_CANCELLED.
+ * 
+ * @returns true if the request was still outstanding
+ */
+bool XBeeAPIParser::cancel_request(char frameID) {
+  return _abort(frameID, NULL, XBEE_TXN_CANCELLED);
+}
+
+/** 
+ * Registers and sends a request. A streaming request stays outstanding 
+ * across responses: done gets XBEE_TXN_PENDING with each one until a 
+ * response without data (after the command and status) ends it with 
+ * XBEE_TXN_OK. Only callbacks can stream.
+ */
+int XBeeAPIParser::_submit(apiFrame_t* request, char responseType, std::chrono::milliseconds timeout, Callback<void(int, const apiFrame_t*)> done, XBeeFuture* future, bool streaming) {
+  if (future != NULL) { // Reset the future for its new request
+    future->cancel();
+    future->_response.release();
+    while (future->_done.try_acquire()) {}
+    future->_status = XBEE_TXN_PENDING;
+  }
+  uint64_t rttKey;
+  int rttKind = _rtt_kind(request, &rttKey);
+  _pendingMutex.lock();
+  transaction_t* txn = NULL;
+  for (int i = 0; (i < XBEE_MAX_PENDING) && (txn == NULL); i++) {
+    if (!_pending[i].active) txn = &_pending[i];
+  }
+  if (txn == NULL) { // Too many requests outstanding
+    _pendingMutex.unlock();
+    if (future != NULL) future->_status = XBEE_TXN_BUSY;
+    if (done) done(XBEE_TXN_BUSY, NULL);
+    return XBEE_TXN_BUSY;
+  }
+  char frameID = _next_frame_id();
+  txn->active = true;
+  txn->frameID = frameID;
+  txn->responseType = responseType;
+  txn->started = _rxClock.elapsed_time().count();
+  txn->deadline = Kernel::Clock::now() + timeout;
+  txn->done = done;
+  txn->future = future;
+  txn->streaming = streaming && (future == NULL);
+  // Responses spread over a search say nothing about the round trip
+  txn->rttKind = txn->streaming ? XBEE_RTT_NONE : rttKind;
+  txn->rttKey = rttKey;
+  if (future != NULL) {
+    future->_parser = this;
+    future->_frameID = frameID;
+  }
+  _pendingMutex.unlock();
+  _serialEvents.set(XBEE_TXN_SIGNAL_FLAG); // Let the receive thread pick up the new deadline
+  request->id = frameID;
+  // Registered before sending so even an immediate response finds its request
+  if (!send(request)) {
+    _abort(frameID, future, XBEE_TXN_SEND_FAILED);
+    return XBEE_TXN_SEND_FAILED;
+  }
+  return (uint8_t) frameID;
+}
+
+/** 
+ * Rotates through frame IDs 1-255, skipping any still outstanding. 0 is 
+ * never used since it tells the XBee not to send a response. The pending 
+ * mutex must be held.
+ */
+char XBeeAPIParser::_next_frame_id() {
+  bool inUse;
+  do {
+    _lastFrameID = (_lastFrameID % 255) + 1;
+    inUse = false;
+    for (int i = 0; i < XBEE_MAX_PENDING; i++) {
+      if (_pending[i].active && (_pending[i].frameID == (char) _lastFrameID)) inUse = true;
+    }
+  } while (inUse);
+  return _lastFrameID;
+}
+
+/** 
+ * Finishes an outstanding request without a response. If owner is given, 
+ * only a request belonging to that future is affected.
+ * 
+ * @returns true if the request was still outstanding
+ */
+bool XBeeAPIParser::_abort(char frameID, XBeeFuture* owner, int status) {
+  Callback<void(int, const apiFrame_t*)> done;
+  bool found = false;
+  _pendingMutex.lock();
+  for (int i = 0; (i < XBEE_MAX_PENDING) && !found; i++) {
+    transaction_t* txn = &_pending[i];
+    if (txn->active && (txn->frameID == frameID) && ((owner == NULL) || (txn->future == owner))) {
+      found = true;
+      txn->active = false;
+      if (txn->future != NULL) _complete_future(txn->future, status);
+      else done = txn->done;
+    }
+  }
+  _pendingMutex.unlock();
+  if (done) done(status, NULL);
+  return found;
+}
+
+/** 
+ * Records the result on a future and wakes its waiter. The pending mutex 
+ * must be held.
+ */
+void XBeeAPIParser::_complete_future(XBeeFuture* future, int status) {
+  future->_status = status;
+  future->_parser = NULL;
+  future->_done.release();
+}
+
+/** 
+ * Runs on the receive thread for every good frame. If it answers an 
+ * outstanding request the frame is delivered to the requester instead of the
+ * frame buffer: a future takes over the pool block, a callback is run with 
+ * the frame in place.
+ * 
+ * @returns true if the frame was consumed by a request
+ */
+bool XBeeAPIParser::_complete_transaction() {
+  apiFrame_t* frame = _partialFrame.frame;
+  if (!_has_frame_id(frame->type)) return false;
+  _pendingMutex.lock();
+  transaction_t* txn = _find_transaction(frame);
+  if (txn == NULL) {
+    _pendingMutex.unlock();
+    return false;
+  }
+  XBeeFuture* future = txn->future;
+  int block = XBEE_NO_FRAME;
+  if (future != NULL) {
+    // Claim the block for the future with the lock released. Under 
+    // XBEE_BLOCK_PRODUCER that waits for a consumer, which may itself be in
+    // request() or cancel() and must not find the pending mutex held.
+    _pendingMutex.unlock();
+    block = _take_rx_block();
+    _pendingMutex.lock();
+    txn = _find_transaction(frame);
+    if ((txn == NULL) || (txn->future != future)) {
+      // Cancelled or timed out meanwhile, so buffer the frame like any other
+      _pendingMutex.unlock();
+      if (block != XBEE_NO_FRAME) _buffer_block(block);
+      return true;
+    }
+  }
+  // A streamed AT request (ND) ends with a response carrying no data
+  bool last = !txn->streaming || (frame->length <= 3);
+  if (last) txn->active = false;
+  uint32_t latency = (uint32_t) _rxClock.elapsed_time().count() - txn->started;
+  uint8_t type = frame->type;
+  if (type == 0x89) _record_latency(&_metrics.txStatusLatency, latency);
+  else if ((type == 0x88) || (type == 0x97)) _record_latency(&_metrics.atResponseLatency, latency);
+  // Measured before the requester hears back, so its next request already
+  // gets a timeout that includes this round trip
+  if (txn->rttKind != XBEE_RTT_NONE) _rtt_sample(txn->rttKind, txn->rttKey, latency);
+  if (future != NULL) {
+    // Hand the pool block straight to the future; the parser is in a fresh one
+    if (block != XBEE_NO_FRAME) {
+      future->_response._parser = this;
+      future->_response._block = block;
+    }
+    _complete_future(future, (block != XBEE_NO_FRAME) ? XBEE_TXN_OK : XBEE_TXN_NO_BUFFER);
+    _pendingMutex.unlock();
+  } else {
+    Callback<void(int, const apiFrame_t*)> done = txn->done;
+    _pendingMutex.unlock();
+    if (done) done(last ? XBEE_TXN_OK : XBEE_TXN_PENDING, frame);
+  }
+  return true;
+}
+
+/** 
+ * Finds the outstanding request a response frame answers. The pending mutex
+ * must be held.
+ * 
+ * @returns the request, or NULL if none is waiting for this frame
+ */
+transaction_t* XBeeAPIParser::_find_transaction(const apiFrame_t* frame) {
+  for (int i = 0; i < XBEE_MAX_PENDING; i++) {
+    if (_pending[i].active && (_pending[i].frameID == frame->id) && (_pending[i].responseType == frame->type)) {
+      return &_pending[i];
+    }
+  }
+  return NULL;
+}
+
+/** 
+ * Completes every request whose deadline has passed with XBEE_TXN_TIMEOUT
+ * 
+ * @returns time of the next request deadline, or _time_out from now if none
+ */
+Kernel::Clock::time_point XBeeAPIParser::_expire_transactions() {
+  Callback<void(int, const apiFrame_t*)> expired[XBEE_MAX_PENDING];
+  int n = 0;
+  Kernel::Clock::time_point now = Kernel::Clock::now();
+  Kernel::Clock::time_point next = now + _time_out;
+  _pendingMutex.lock();
+  for (int i = 0; i < XBEE_MAX_PENDING; i++) {
+    transaction_t* txn = &_pending[i];
+    if (!txn->active) continue;
+    if (txn->deadline <= now) {
+      txn->active = false;
+      if (txn->rttKind != XBEE_RTT_NONE) _rtt_timeout(txn->rttKind, txn->rttKey);
+      if (txn->future != NULL) _complete_future(txn->future, XBEE_TXN_TIMEOUT);
+      else expired[n++] = txn->done;
+    } else if (txn->deadline < next) {
+      next = txn->deadline;
+    }
+  }
+  _pendingMutex.unlock();
+  // Callbacks run without any parser lock held
+  for (int i = 0; i < n; i++) {
+    if (expired[i]) expired[i](XBEE_TXN_TIMEOUT, NULL);
+  }
+  return next;
+}
+
+/** 
+ * Timeout for a request frame. TX requests and remote AT commands get one
+ * from the round trip times measured to their destination, local AT 
+ * commands from those of their command class: smoothed mean plus four 
+ * times the smoothed deviation, doubled for every timeout in a row and kept
+ * between XBEE_RTO_MIN and XBEE_RTO_MAX_FACTOR*_time_out. Until something 
+ * has been measured it is the fixed default, 10*_time_out for DN and ND and
+ * 2*_time_out for anything else, doubled the same way, so a node slower 
+ * than the default still gets through. With adaptive timeouts off it is 
+ * always the fixed default.
+ */
+std::chrono::milliseconds XBeeAPIParser::request_timeout(const apiFrame_t* frame) {
+  uint64_t key;
+  int kind = _rtt_kind(frame, &key);
+  _rttMutex.lock();
+  std::chrono::milliseconds timeout = _rto(_rtt_estimator(kind, key, false), _default_timeout(kind, key));
+  _rttMutex.unlock();
+  return timeout;
+}
+
+/** 
+ * Turns timeouts from measured round trip times on (the default) or off. 
+ * The estimates keep learning either way.
+ */
+void XBeeAPIParser::set_adaptive_timeouts(bool enabled) {
+  _rttMutex.lock();
+  _adaptiveTimeouts = enabled;
+  _rttMutex.unlock();
+}
+
+/** 
+ * Reports the round trip estimate from TX requests to a destination to 
+ * their 0x89 status
+ * 
+ * @returns true if any response has been measured
+ */
+bool XBeeAPIParser::tx_rtt(uint64_t address, xbeeRTT_t* rtt) {
+  return _rtt_snapshot(XBEE_RTT_TX, address, rtt);
+}
+
+/** 
+ * Reports the round trip estimate from remote AT commands to a node to its
+ * 0x97 responses
+ * 
+ * @returns true if any response has been measured
+ */
+bool XBeeAPIParser::remote_at_rtt(uint64_t address, xbeeRTT_t* rtt) {
+  return _rtt_snapshot(XBEE_RTT_REMOTE_AT, address, rtt);
+}
+
+/** 
+ * Reports the round trip estimate for the class of local AT commands cmd 
+ * belongs to
+ * 
+ * @returns true if any response has been measured
+ */
+bool XBeeAPIParser::at_rtt(string cmd, xbeeRTT_t* rtt) {
+  int atClass = (cmd.length() == 2) ? _at_class(cmd.c_str()) : XBEE_AT_CLASS_REGISTER;
+  return _rtt_snapshot(XBEE_RTT_AT, atClass, rtt);
+}
+
+/** 
+ * Forgets every round trip estimate, so timeouts start again from the 
+ * fixed defaults
+ */
+void XBeeAPIParser::reset_rtt() {
+  _rttMutex.lock();
+  for (int i = 0; i < XBEE_RTT_DESTINATIONS; i++) _rttDestinations[i].valid = false;
+  memset(_atRTT, 0, sizeof(_atRTT));
+  _rttMutex.unlock();
+}
+
+/** 
+ * Works out which estimate a request's round trip belongs to: its 
+ * destination for TX requests and remote AT commands, its command class for
+ * local AT commands. A 16-bit TX request counts against the node's 64-bit 
+ * address, if known.
+ * 
+ * @returns XBEE_RTT_ kind, with the address or command class in *key
+ */
+int XBeeAPIParser::_rtt_kind(const apiFrame_t* frame, uint64_t* key) {
+  *key = 0;
+  switch ((uint8_t) frame->type) {
+    case 0x00: // TX request
+    case 0x17: // Remote AT command
+      if (frame->length < 8) return XBEE_RTT_NONE;
+      for (int i = 0; i < 8; i++) *key = (*key << 8) | (uint8_t) frame->data[i];
+      return (frame->type == 0x17) ? XBEE_RTT_REMOTE_AT : XBEE_RTT_TX;
+    case 0x01: // 16-bit TX request
+      if (frame->length < 2) return XBEE_RTT_NONE;
+      *key = long_address(((uint8_t) frame->data[0] << 8) | (uint8_t) frame->data[1]);
+      return (*key == XBEE_ADDRESS_UNKNOWN) ? XBEE_RTT_NONE : XBEE_RTT_TX;
+    case 0x08: // Local AT command
+      if (frame->length < 2) return XBEE_RTT_NONE;
+      *key = _at_class(frame->data);
+      return XBEE_RTT_AT;
+  }
+  return XBEE_RTT_NONE;
+}
+
+/** 
+ * @returns XBEE_AT_CLASS_ of a two letter AT command
+ */
+int XBeeAPIParser::_at_class(const char* cmd) {
+  static const char searches[] = "DNND";
+  static const char writes[] = "WRACREFRNR";
+  for (int i = 0; i < (int) sizeof(searches) - 1; i += 2) {
+    if ((cmd[0] == searches[i]) && (cmd[1] == searches[i+1])) return XBEE_AT_CLASS_SEARCH;
+  }
+  for (int i = 0; i < (int) sizeof(writes) - 1; i += 2) {
+    if ((cmd[0] == writes[i]) && (cmd[1] == writes[i+1])) return XBEE_AT_CLASS_WRITE;
+  }
+  return XBEE_AT_CLASS_REGISTER;
+}
+
+/** 
+ * Finds the estimator for a kind and key. With create, a destination not 
+ * in the table takes the least recently used entry. The RTT mutex must be 
+ * held.
+ * 
+ * @returns the estimator | NULL if there is none
+ */
+rttEstimator_t* XBeeAPIParser::_rtt_estimator(int kind, uint64_t key, bool create) {
+  if (kind == XBEE_RTT_AT) return (key < XBEE_AT_CLASSES) ? &_atRTT[key] : NULL;
+  if ((kind != XBEE_RTT_TX) && (kind != XBEE_RTT_REMOTE_AT)) return NULL;
+  rttDestination_t* slot = NULL;
+  rttDestination_t* victim = &_rttDestinations[0];
+  for (int i = 0; (i < XBEE_RTT_DESTINATIONS) && (slot == NULL); i++) {
+    rttDestination_t* entry = &_rttDestinations[i];
+    if (entry->valid && (entry->address == key)) {
+      slot = entry;
+    } else if (!entry->valid) {
+      if (victim->valid) victim = entry;
+    } else if (victim->valid && (entry->lastUsed < victim->lastUsed)) {
+      victim = entry;
+    }
+  }
+  if (slot == NULL) {
+    if (!create) return NULL;
+    slot = victim;
+    slot->valid = true;
+    slot->address = key;
+    memset(&slot->tx, 0, sizeof(slot->tx));
+    memset(&slot->remoteAT, 0, sizeof(slot->remoteAT));
+  }
+  if (create) slot->lastUsed = ++_rttClock;
+  return (kind == XBEE_RTT_REMOTE_AT) ? &slot->remoteAT : &slot->tx;
+}
+
+/** 
+ * Folds a measured round trip into its estimate as RFC 6298 does: the 
+ * first sets the mean and half of it as the deviation, later ones move the
+ * deviation 1/4 and the mean 1/8 of the way towards the new sample. Runs on
+ * the receive thread.
+ */
+void XBeeAPIParser::_rtt_sample(int kind, uint64_t key, uint32_t us) {
+  int32_t r = (us > INT32_MAX) ? INT32_MAX : (int32_t) us;
+  _rttMutex.lock();
+  rttEstimator_t* estimator = _rtt_estimator(kind, key, true);
+  if (estimator != NULL) {
+    if (estimator->samples == 0) {
+      estimator->srtt = r;
+      estimator->rttvar = r / 2;
+    } else {
+      int32_t delta = r - estimator->srtt;
+      estimator->rttvar += ((delta < 0) ? -delta : delta) / 4 - estimator->rttvar / 4;
+      estimator->srtt += delta / 8;
+    }
+    estimator->samples++;
+    estimator->backoff = 0;
+  }
+  _rttMutex.unlock();
+}
+
+/** 
+ * Backs off the timeout of a request that expired, so a link that has got 
+ * slower stops timing out before its estimate catches up. A destination 
+ * that has never answered in time gets an estimator too, backing off the
+ * fixed default until a response can be measured. Runs on the receive 
+ * thread.
+ */
+void XBeeAPIParser::_rtt_timeout(int kind, uint64_t key) {
+  _rttMutex.lock();
+  rttEstimator_t* estimator = _rtt_estimator(kind, key, true);
+  if ((estimator != NULL) && (estimator->backoff < XBEE_RTO_MAX_BACKOFF)) {
+    estimator->backoff++;
+  }
+  _rttMutex.unlock();
+}
+
+/** 
+ * Derives a timeout from an estimate, or from fallback until a response has
+ * been measured; either is doubled for every timeout in a row. The RTT 
+ * mutex must be held.
+ */
+std::chrono::milliseconds XBeeAPIParser::_rto(const rttEstimator_t* estimator, std::chrono::milliseconds fallback) {
+  if (!_adaptiveTimeouts || (estimator == NULL)) return fallback;
+  std::chrono::milliseconds longest = XBEE_RTO_MAX_FACTOR*_time_out;
+  if (longest < fallback) longest = fallback;
+  if (estimator->samples == 0) {
+    std::chrono::milliseconds rto = fallback * (1 << estimator->backoff);
+    return (rto > longest) ? longest : rto;
+  }
+  int64_t deviation = 4 * (int64_t) estimator->rttvar;
+  int64_t us = estimator->srtt + ((deviation > XBEE_RTO_GRANULARITY_US) ? deviation : XBEE_RTO_GRANULARITY_US);
+  us <<= estimator->backoff;
+  std::chrono::milliseconds rto((us + 999) / 1000);
+  if (rto < XBEE_RTO_MIN) return XBEE_RTO_MIN;
+  if (rto > longest) return longest;
+  return rto;
+}
+
+/** 
+ * @returns the fixed timeout for requests nothing has been measured for
+ */
+std::chrono::milliseconds XBeeAPIParser::_default_timeout(int kind, uint64_t key) {
+  if ((kind == XBEE_RTT_AT) && (key == XBEE_AT_CLASS_SEARCH)) return 10*_time_out;
+  return 2*_time_out;
+}
+
+/** 
+ * @returns the longest timeout a TX request can currently get
+ */
+std::chrono::milliseconds XBeeAPIParser::_longest_timeout() {
+  return _adaptiveTimeouts ? XBEE_RTO_MAX_FACTOR*_time_out : 2*_time_out;
+}
+
+/** 
+ * Copies an estimate and the timeout it gives
+ * 
+ * @returns true if any response has been measured
+ */
+bool XBeeAPIParser::_rtt_snapshot(int kind, uint64_t key, xbeeRTT_t* rtt) {
+  _rttMutex.lock();
+  rttEstimator_t* estimator = _rtt_estimator(kind, key, false);
+  bool measured = (estimator != NULL) && (estimator->samples > 0);
+  rtt->srtt = measured ? estimator->srtt : 0;
+  rtt->rttvar = measured ? estimator->rttvar : 0;
+  rtt->samples = measured ? estimator->samples : 0;
+  rtt->backoff = (estimator != NULL) ? estimator->backoff : 0;
+  rtt->rto = std::chrono::microseconds(_rto(estimator, _default_timeout(kind, key))).count();
+  _rttMutex.unlock();
+  return measured;
+}
+
+XBeeFuture::XBeeFuture() {
+  _parser = NULL;
+  _frameID = 0;
+  _status = XBEE_TXN_CANCELLED; // Nothing has been requested yet
+}
+
+XBeeFuture::~XBeeFuture() {
+  cancel();
+}
+
+/** 
+ * @returns true once the request has completed, successfully or not
+ */
+bool XBeeFuture::ready() const {
+  return _status != XBEE_TXN_PENDING;
+}
+
+/** 
+ * @returns XBEE_TXN_PENDING while outstanding, then the XBEE_TXN_ result
+ */
+int XBeeFuture::status() const {
+  return _status;
+}
+
+/** 
+ * Blocks until the request completes. Requests always complete by their 
+ * timeout, so this never waits forever.
+ * 
+ * @returns XBEE_TXN_ result
+ */
+int XBeeFuture::wait() {
+  if (_status == XBEE_TXN_PENDING) _done.acquire();
+  return _status;
+}
+
+/** 
+ * @returns the response frame if the request completed with XBEE_TXN_OK,
+ * else NULL
+ */
+const apiFrame_t* XBeeFuture::response() const {
+  return _response.get();
+}
+
+void XBeeFuture::cancel() {
+  XBeeAPIParser* parser = _parser;
+  if (parser != NULL) parser->_abort(_frameID, this, XBEE_TXN_CANCELLED);
+}
+
+/** 
+ * Checks the address cache without touching the radio. Counts as a cache 
+ * hit or miss.
+ * 
+ * @returns true and sets address if a fresh entry for ni exists
+ */
+bool XBeeAPIParser::cached_address(string ni, uint64_t* address) {
+  bool found = false;
+  Kernel::Clock::time_point now = Kernel::Clock::now();
+  _addressCacheMutex.lock();
+  for (int i = 0; (i < XBEE_ADDRESS_CACHE_SIZE) && !found; i++) {
+    addressCacheEntry_t* entry = &_addressCache[i];
+    if (entry->valid && (entry->expires > now) && (ni.compare(entry->ni) == 0)) {
+      *address = entry->address;
+      found = true;
+    }
+  }
+  if (found) _addressCacheHits++;
+  else _addressCacheMisses++;
+  _addressCacheMutex.unlock();
+  return found;
+}
+
+/** 
+ * Sets how long a resolved address is trusted before get_address asks the 
+ * radio again. Existing entries keep their original expiry.
+ */
+void XBeeAPIParser::set_address_cache_ttl(std::chrono::milliseconds ttl) {
+  if (ttl >= 0ms) _addressCacheTTL = ttl;
+}
+
+/** 
+ * @returns number of lookups answered from the cache; each one saved three 
+ * AT round trips
+ */
+uint32_t XBeeAPIParser::address_cache_hits() {
+  return _addressCacheHits;
+}
+
+/** 
+ * @returns number of lookups the cache could not answer
+ */
+uint32_t XBeeAPIParser::address_cache_misses() {
+  return _addressCacheMisses;
+}
+
+/** 
+ * Stores a resolved address, replacing the entry for the same name, else an
+ * empty entry, else the one closest to expiring
+ */
+void XBeeAPIParser::_cache_address(string ni, uint64_t address) {
+  if ((ni.length() > XBEE_MAX_NI_LENGTH) || (_addressCacheTTL == 0ms)) return;
+  _addressCacheMutex.lock();
+  addressCacheEntry_t* slot = &_addressCache[0];
+  for (int i = 0; i < XBEE_ADDRESS_CACHE_SIZE; i++) {
+    addressCacheEntry_t* entry = &_addressCache[i];
+    if (entry->valid && (ni.compare(entry->ni) == 0)) {
+      slot = entry;
+      break;
+    }
+    if (!entry->valid) slot = entry;
+    else if (slot->valid && (entry->expires < slot->expires)) slot = entry;
+  }
+  strcpy(slot->ni, ni.c_str());
+  slot->address = address;
+  slot->expires = Kernel::Clock::now() + _addressCacheTTL;
+  slot->valid = true;
+  _addressCacheMutex.unlock();
+}
+
+void XBeeAPIParser::flush_address_cache() {
+  _addressCacheMutex.lock();
+  for (int i = 0; i < XBEE_ADDRESS_CACHE_SIZE; i++) _addressCache[i].valid = false;
+  _addressCacheMutex.unlock();
+}
+
+/** 
+ * Runs node discovery (ND) and waits for it to finish. Nodes are added to 
+ * the node table as their responses arrive; see start_node_discovery.
+ * 
+ * @returns nodes that answered | negative XBEE_TXN_ code if ND could not 
+ * be sent or a discovery is already running
+ */
+int XBeeAPIParser::discover_nodes(std::chrono::milliseconds timeout) {
+  while (_discoveryDone.try_acquire()) {} // Left by a discovery nobody waited for
+  int frameID = start_node_discovery(timeout);
+  if (frameID < 0) return frameID;
+  _discoveryDone.acquire();
+  int status = _discoveryStatus;
+  // Without the closing empty response the timeout ends discovery instead
+  if ((status == XBEE_TXN_OK) || (status == XBEE_TXN_TIMEOUT)) return _discoveryFound;
+  return status;
+}
+
+/** 
+ * Starts node discovery (ND) without waiting. Each 0x88 ND response updates
+ * the node table on the receive thread as it arrives, and also fills the 
+ * address cache and short address table. Entries are updated in place, so 
+ * lookups keep working while a discovery runs. The timeout should exceed 
+ * the radio's NT setting (2.5 s by default).
+ * 
+ * @returns assigned frame ID (1-255) | negative XBEE_TXN_ code on failure
+ */
+int XBeeAPIParser::start_node_discovery(std::chrono::milliseconds timeout) {
+  _nodeTableMutex.lock();
+  if (_discoveryActive) {
+    _nodeTableMutex.unlock();
+    return XBEE_TXN_BUSY;
+  }
+  _discoveryActive = true;
+  _discoveryFound = 0;
+  _discoveryRun++;
+  _nodeTableMutex.unlock();
+  apiFrame_t frame;
+  _make_AT_frame("ND", &frame);
+  // The callback ends the discovery whatever happens, even here
+  return _submit(&frame, 0x88, timeout, callback(this, &XBeeAPIParser::_node_discovered), NULL, true);
+}
+
+bool XBeeAPIParser::node_discovery_running() {
+  return _discoveryActive;
+}
+
+/** 
+ * Looks a node up in the node table by its 64-bit address
+ * 
+ * @returns true and copies the entry if the node is known
+ */
+bool XBeeAPIParser::find_node(uint64_t address, xbeeNode_t* node) {
+  _nodeTableMutex.lock();
+  int i = _find_node(address);
+  if (i != XBEE_NO_NODE) *node = _nodes[i].node;
+  _nodeTableMutex.unlock();
+  return i != XBEE_NO_NODE;
+}
+
+/** 
+ * Looks a node up in the node table by its node identifier
+ * 
+ * @returns true and copies the entry if the node is known
+ */
+bool XBeeAPIParser::find_node(string ni, xbeeNode_t* node) {
+  _nodeTableMutex.lock();
+  int i = _find_node(ni.c_str());
+  if (i != XBEE_NO_NODE) *node = _nodes[i].node;
+  _nodeTableMutex.unlock();
+  return i != XBEE_NO_NODE;
+}
+
+/** 
+ * Copies up to max entries of the node table
+ * 
+ * @returns entries copied
+ */
+int XBeeAPIParser::get_nodes(xbeeNode_t* nodes, int max) {
+  int n = 0;
+  _nodeTableMutex.lock();
+  for (int i = 0; (i < XBEE_NODE_TABLE_SIZE) && (n < max); i++) {
+    if (_nodes[i].valid) nodes[n++] = _nodes[i].node;
+  }
+  _nodeTableMutex.unlock();
+  return n;
+}
+
+/** 
+ * Removes nodes that did not answer any of the last missedRuns discoveries
+ * 
+ * @returns nodes removed
+ */
+int XBeeAPIParser::prune_nodes(int missedRuns) {
+  if (missedRuns < 1) return 0;
+  int removed = 0;
+  _nodeTableMutex.lock();
+  for (int i = 0; i < XBEE_NODE_TABLE_SIZE; i++) {
+    if (_nodes[i].valid && (_nodes[i].node.lastSeen + missedRuns <= _discoveryRun)) {
+      _unlink_node(i);
+      removed++;
+    }
+  }
+  _nodeTableMutex.unlock();
+  return removed;
+}
+
+void XBeeAPIParser::flush_nodes() {
+  _nodeTableMutex.lock();
+  for (int i = 0; i < XBEE_NODE_TABLE_SIZE; i++) _nodes[i].valid = false;
+  for (int i = 0; i < XBEE_NODE_INDEX_BUCKETS; i++) {
+    _nodesByAddress[i] = XBEE_NO_NODE;
+    _nodesByName[i] = XBEE_NO_NODE;
+  }
+  _nodeTableMutex.unlock();
+}
+
+/** 
+ * ND response callback; runs on the receive thread. A node's response 
+ * carries MY (2 bytes), SH (4), SL (4), DB (1) and the NI string.
+ */
+void XBeeAPIParser::_node_discovered(int status, const apiFrame_t* response) {
+  if ((response != NULL) && (response->length >= 14) && (response->data[2] == 0x00)) {
+    const char* data = &response->data[3];
+    int len = response->length - 3;
+    xbeeNode_t node;
+    node.shortAddress = ((uint8_t) data[0] << 8) | (uint8_t) data[1];
+    node.address = 0;
+    for (int i = 2; i < 10; i++) node.address = (node.address << 8) | (uint8_t) data[i];
+    node.rssi = data[10];
+    int n = 0;
+    while ((11 + n < len) && (data[11 + n] != 0) && (n < XBEE_MAX_NI_LENGTH)) {
+      node.ni[n] = data[11 + n];
+      n++;
+    }
+    node.ni[n] = 0;
+    _update_node(&node);
+    _discoveryFound++;
+    if (node.shortAddress != XBEE_SHORT_ADDRESS_NONE) set_short_address(node.address, node.shortAddress);
+    if (n > 0) _cache_address(node.ni, node.address);
+  }
+  if (status != XBEE_TXN_PENDING) { // Last response, timeout or failure
+    _discoveryStatus = status;
+    _discoveryActive = false;
+    _discoveryDone.release();
+  }
+}
+
+/** 
+ * Adds or refreshes a node table entry in place, replacing the node heard 
+ * from longest ago when the table is full
+ */
+void XBeeAPIParser::_update_node(const xbeeNode_t* node) {
+  _nodeTableMutex.lock();
+  int i = _find_node(node->address);
+  if ((i != XBEE_NO_NODE) && (strcmp(_nodes[i].node.ni, node->ni) != 0)) {
+    _unlink_node(i); // Renamed; relinked below under its new name
+    i = XBEE_NO_NODE;
+  }
+  if (i == XBEE_NO_NODE) {
+    int victim = 0;
+    for (int j = 0; j < XBEE_NODE_TABLE_SIZE; j++) {
+      if (!_nodes[j].valid) {
+        victim = j;
+        break;
+      }
+      if (_nodes[j].node.lastSeen < _nodes[victim].node.lastSeen) victim = j;
+    }
+    i = victim;
+    if (_nodes[i].valid) _unlink_node(i);
+    _nodes[i].valid = true;
+    _nodes[i].node = *node;
+    uint8_t* head = &_nodesByAddress[_address_hash(node->address)];
+    _nodes[i].nextByAddress = *head;
+    *head = i;
+    head = &_nodesByName[_name_hash(node->ni)];
+    _nodes[i].nextByName = *head;
+    *head = i;
+  }
+  _nodes[i].node.shortAddress = node->shortAddress;
+  _nodes[i].node.rssi = node->rssi;
+  _nodes[i].node.lastSeen = _discoveryRun;
+  _nodeTableMutex.unlock();
+}
+
+/** 
+ * Takes an entry out of both index chains and frees it. The node table 
+ * mutex must be held.
+ */
+void XBeeAPIParser::_unlink_node(int index) {
+  uint8_t* link = &_nodesByAddress[_address_hash(_nodes[index].node.address)];
+  while (*link != index) link = &_nodes[*link].nextByAddress;
+  *link = _nodes[index].nextByAddress;
+  link = &_nodesByName[_name_hash(_nodes[index].node.ni)];
+  while (*link != index) link = &_nodes[*link].nextByName;
+  *link = _nodes[index].nextByName;
+  _nodes[index].valid = false;
+}
+
+/** 
+ * The node table mutex must be held.
+ * 
+ * @returns index of the node's entry | XBEE_NO_NODE
+ */
+int XBeeAPIParser::_find_node(uint64_t address) {
+  int i = _nodesByAddress[_address_hash(address)];
+  while ((i != XBEE_NO_NODE) && (_nodes[i].node.address != address)) i = _nodes[i].nextByAddress;
+  return i;
+}
+
+/** 
+ * The node table mutex must be held.
+ * 
+ * @returns index of the node's entry | XBEE_NO_NODE
+ */
+int XBeeAPIParser::_find_node(const char* ni) {
+  int i = _nodesByName[_name_hash(ni)];
+  while ((i != XBEE_NO_NODE) && (strcmp(_nodes[i].node.ni, ni) != 0)) i = _nodes[i].nextByName;
+  return i;
+}
+
+int XBeeAPIParser::_address_hash(uint64_t address) {
+  uint32_t folded = (uint32_t) address ^ (uint32_t) (address >> 32);
+  return (folded ^ (folded >> 8) ^ (folded >> 16)) & (XBEE_NODE_INDEX_BUCKETS - 1);
+}
+
+int XBeeAPIParser::_name_hash(const char* ni) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  while (*ni != 0) hash = (hash ^ (uint8_t) *ni++) * 16777619u;
+  return hash & (XBEE_NODE_INDEX_BUCKETS - 1);
+}
+
+/** 
+ * Records a node's 16-bit (MY) address so packets to it go out in the short
+ * form. XBEE_SHORT_ADDRESS_NONE (or the 0xFFFF broadcast address) forgets 
+ * the node. The least recently used entry makes way when the table is full.
+ * Received 0x90 packets fill the table in automatically.
+ */
+void XBeeAPIParser::set_short_address(uint64_t address, uint16_t shortAddress) {
+  bool forget = (shortAddress == XBEE_SHORT_ADDRESS_NONE) || (shortAddress == 0xFFFF);
+  _addressCacheMutex.lock();
+  shortAddressEntry_t* slot = NULL; // The node's existing entry
+  shortAddressEntry_t* victim = &_shortAddresses[0];
+  for (int i = 0; i < XBEE_SHORT_ADDRESS_TABLE_SIZE; i++) {
+    shortAddressEntry_t* entry = &_shortAddresses[i];
+    if (entry->valid && (entry->address == address)) {
+      slot = entry;
+    } else if (entry->valid && (entry->shortAddress == shortAddress)) {
+      entry->valid = false; // A short address belongs to one node at a time
+    }
+    if (!entry->valid) {
+      if (victim->valid) victim = entry;
+    } else if (victim->valid && (entry->lastUsed < victim->lastUsed)) {
+      victim = entry;
+    }
+  }
+  if (forget) {
+    if (slot != NULL) slot->valid = false;
+  } else {
+    if (slot == NULL) slot = victim;
+    slot->valid = true;
+    slot->address = address;
+    slot->shortAddress = shortAddress;
+    slot->lastUsed = ++_shortAddressClock;
+  }
+  _addressCacheMutex.unlock();
+}
+
+/** 
+ * @returns true and sets shortAddress if the node's 16-bit address is known
+ * and short addressing is on
+ */
+bool XBeeAPIParser::short_address(uint64_t address, uint16_t* shortAddress) {
+  bool found = false;
+  _addressCacheMutex.lock();
+  for (int i = 0; (i < XBEE_SHORT_ADDRESS_TABLE_SIZE) && !found && _shortAddressing; i++) {
+    shortAddressEntry_t* entry = &_shortAddresses[i];
+    if (entry->valid && (entry->address == address)) {
+      *shortAddress = entry->shortAddress;
+      entry->lastUsed = ++_shortAddressClock;
+      found = true;
+    }
+  }
+  _addressCacheMutex.unlock();
+  return found;
+}
+
+/** 
+ * @returns 64-bit address of the node using a 16-bit address | 
+ * XBEE_ADDRESS_UNKNOWN if it is not in the table
+ */
+uint64_t XBeeAPIParser::long_address(uint16_t shortAddress) {
+  uint64_t address = XBEE_ADDRESS_UNKNOWN;
+  _addressCacheMutex.lock();
+  for (int i = 0; i < XBEE_SHORT_ADDRESS_TABLE_SIZE; i++) {
+    if (_shortAddresses[i].valid && (_shortAddresses[i].shortAddress == shortAddress)) {
+      address = _shortAddresses[i].address;
+      break;
+    }
+  }
+  _addressCacheMutex.unlock();
+  return address;
+}
+
+/** 
+ * Turns automatic use of 16-bit TX requests on (the default) or off. The 
+ * table keeps learning either way.
+ */
+void XBeeAPIParser::set_short_addressing(bool enabled) {
+  _addressCacheMutex.lock();
+  _shortAddressing = enabled;
+  _addressCacheMutex.unlock();
+}
+
+void XBeeAPIParser::flush_short_addresses() {
+  _addressCacheMutex.lock();
+  for (int i = 0; i < XBEE_SHORT_ADDRESS_TABLE_SIZE; i++) _shortAddresses[i].valid = false;
+  _addressCacheMutex.unlock();
+}
+
+/** 
+ * @returns TX requests built in the 16-bit form, each 6 bytes shorter
+ */
+uint32_t XBeeAPIParser::short_frames_sent() {
+  return _shortFramesSent;
+}
+
+/** 
+ * Learns the sender's short address from a 0x90 packet. Runs on the receive
+ * thread.
+ */
+void XBeeAPIParser::_learn_short_address(const apiFrame_t* frame) {
+  if (frame->length < 11) return;
+  uint16_t shortAddress = ((uint8_t) frame->data[8] << 8) | (uint8_t) frame->data[9];
+  if ((shortAddress == XBEE_SHORT_ADDRESS_NONE) || (shortAddress == 0xFFFF)) return;
+  uint64_t address = 0;
+  for (int i = 0; i < 8; i++) address = (address << 8) | (uint8_t) frame->data[i];
+  set_short_address(address, shortAddress);
+}
+
+/** 
+ * Selects unescaped (AP=1) or escaped (AP=2) API operation. This must match
+ * the AP setting on the XBee. In escaped mode 0x7E, 0x7D, 0x11 and 0x13 are
+ * escaped on the wire, so an unescaped 0x7E always marks a frame start and
+ * the parser resynchronizes on it even in the middle of a damaged frame.
+ */
+void XBeeAPIParser::set_api_mode(int mode) {
+  if ((mode == 1) || (mode == 2)) _apiMode = mode;
+}
+
+int XBeeAPIParser::api_mode() {
+  return _apiMode;
+}
+
+/** 
+ * @returns frame encoding (and escaping) throughput in megabytes per second
+ * of time spent encoding
+ */
+float XBeeAPIParser::tx_encode_mbytes_per_second() {
+  _modemTxMutex.lock();
+  float rate = (_txEncodeTime == 0) ? 0.0f : (float) _txEncodedBytes / _txEncodeTime;
+  _modemTxMutex.unlock();
+  return rate;
+}
+
+/** 
+ * Parses a chunk received in escaped mode. The chunk is split at every raw 
+ * 0x7E; each piece is unescaped in place and run through _parse_chunk, and 
+ * each 0x7E starts a new frame, abandoning any frame still in progress.
+ */
+void XBeeAPIParser::_parse_escaped_chunk(char* buff, int n) {
+  int i = 0;
+  while (i < n) {
+    char* start = (char*) memchr(buff + i, 0x7E, n - i);
+    int end = (start == NULL) ? n : start - buff;
+    if (end > i) {
+      int len = _unescape(buff + i, end - i, &_rxEscapePending);
+      _parse_chunk(buff + i, len);
+    }
+    if (start == NULL) break;
+    _partialFrame.status = 0x01; // Frame start, whatever state we were in
+    _rxEscapePending = false;
+    i = end + 1;
+  }
+}
+
+/** 
+ * Removes escapes from a buffer in place. Scans for 0x7D with memchr and 
+ * moves whole runs, so unescaped stretches cost no per-byte work. An escape
+ * byte at the very end of the buffer is carried over in pending.
+ * 
+ * @returns unescaped length
+ */
+int XBeeAPIParser::_unescape(char* buff, int n, bool* pending) {
+  int in = 0;
+  int out = 0;
+  if (*pending && (n > 0)) {
+    buff[out++] = buff[in++] ^ 0x20;
+    *pending = false;
+  }
+  while (in < n) {
+    char* esc = (char*) memchr(buff + in, 0x7D, n - in);
+    int run = ((esc == NULL) ? n : esc - buff) - in;
+    if (out != in) memmove(buff + out, buff + in, run);
+    out += run;
+    in += run;
+    if (esc != NULL) {
+      if (in + 1 < n) {
+        buff[out++] = buff[in + 1] ^ 0x20;
+        in += 2;
+      } else { // Escaped byte arrives with the next chunk
+        *pending = true;
+        in = n;
+      }
+    }
+  }
+  return out;
+}
+
+// Nonzero if any byte of the 32-bit word v is zero
+#define XBEE_HAS_ZERO_BYTE(v) (((v) - 0x01010101UL) & ~(v) & 0x80808080UL)
+
+/** 
+ * Escapes 0x7E, 0x7D, 0x11 and 0x13 while copying a buffer. Checks a 32-bit
+ * word at a time for any byte that needs escaping, so clean words are copied
+ * without examining individual bytes. out must hold 2*n bytes.
+ * 
+ * @returns escaped length
+ */
+int XBeeAPIParser::_escape(const char* in, int n, char* out) {
+  int i = 0;
+  int o = 0;
+  uint32_t w;
+  while (i < n) {
+    if (i + 4 <= n) {
+      memcpy(&w, in + i, 4);
+      if (!(XBEE_HAS_ZERO_BYTE(w ^ 0x7E7E7E7EUL) | XBEE_HAS_ZERO_BYTE(w ^ 0x7D7D7D7DUL) |
+            XBEE_HAS_ZERO_BYTE(w ^ 0x11111111UL) | XBEE_HAS_ZERO_BYTE(w ^ 0x13131313UL))) {
+        memcpy(out + o, &w, 4);
+        i += 4;
+        o += 4;
+        continue;
+      }
+    }
+    // This word (or the tail) holds a byte to escape; handle up to 4 bytes singly
+    int stop = (i + 4 < n) ? i + 4 : n;
+    for (; i < stop; i++) {
+      char c = in[i];
+      if ((c == 0x7E) || (c == 0x7D) || (c == 0x11) || (c == 0x13)) {
+        out[o++] = 0x7D;
+        out[o++] = c ^ 0x20;
+      } else {
+        out[o++] = c;
+      }
+    }
+  }
+  return o;
+}
+
+/** 
+ * Takes the block the parser just filled away from it and gives the parser a
+ * fresh one. While the frame's lane has room this takes no lock; otherwise 
+ * the lane's overflow policy applies, which for XBEE_DROP_OLDEST and 
+ * XBEE_BLOCK_PRODUCER means waiting for the frame buffer.
+ * 
+ * @returns the filled block, or XBEE_NO_FRAME if the frame was dropped (the
+ * parser then keeps its block)
+ */
+int XBeeAPIParser::_take_rx_block() {
+  int lane = _lane_of(_partialFrame.frame->type);
+  bool room = ((int) _laneUsed[lane] < _laneLimit[lane]) && (core_util_atomic_load_u8(&_freeRingHead) != _freeRingTail);
+  if (room) return _swap_rx_block(lane);
+  if (_lanePolicy[lane] == XBEE_DROP_NEWEST) {
+    _laneDrops[lane]++;
+    return XBEE_NO_FRAME;
+  }
+  _lock_frame_buffer(); // Evictions must see every buffered frame
+  int filled = _claim_rx_block();
+  _unlock_frame_buffer();
+  return filled;
+}
+
+/** 
+ * Makes room for the frame the parser just filled in its lane, applying the
+ * lane's overflow policy, then swaps a fresh block in for the parser. The 
+ * frame buffer mutex must be held.
+ * 
+ * @returns the filled block, or XBEE_NO_FRAME if the frame was dropped
+ */
+int XBeeAPIParser::_claim_rx_block() {
+  int lane = _lane_of(_partialFrame.frame->type);
+  Kernel::Clock::time_point deadline = Kernel::Clock::now() + 5*_time_out;
+  while (((int) _laneUsed[lane] >= _laneLimit[lane]) || (_freeRingHead == _freeRingTail)) {
+    if (_lanePolicy[lane] == XBEE_DROP_OLDEST) {
+      // Evict from this lane if it is at its limit, otherwise the pool is
+      // exhausted and bulk data gives way
+      int victimLane = ((int) _laneUsed[lane] >= _laneLimit[lane]) ? lane : XBEE_LANE_DATA;
+      int oldest = _oldest_in_lane(victimLane);
+      if (oldest != XBEE_NO_FRAME) {
+        _unlink_frame(oldest);
+        _free_block(oldest);
+        _laneDrops[victimLane]++;
+        _metrics.evictions++;
+        continue;
+      }
+    } else if ((_lanePolicy[lane] == XBEE_BLOCK_PRODUCER) && (Kernel::Clock::now() < deadline)) {
+      // Stop reading until a consumer releases a frame; the serial port 
+      // buffers (and eventually flow controls) whatever arrives meanwhile
+      _frameFreed.wait_until(deadline);
+      _drain_rx_ring();
+      continue;
+    }
+    _laneDrops[lane]++; // Drop the new frame
+    return XBEE_NO_FRAME;
+  }
+  return _swap_rx_block(lane);
+}
+
+/** 
+ * @returns XBEE_LANE_CONTROL for responses and status frames that request 
+ * helpers wait on, XBEE_LANE_DATA for everything else
+ */
+int XBeeAPIParser::_lane_of(char frameType) {
+  switch ((uint8_t) frameType) {
+    case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x97:
+      return XBEE_LANE_CONTROL;
+    default:
+      return XBEE_LANE_DATA;
+  }
+}
+
+/** 
+ * @returns oldest frame of the lane in the shared buffer, or XBEE_NO_FRAME
+ */
+int XBeeAPIParser::_oldest_in_lane(int lane) {
+  for (int block = _frameHead; block != XBEE_NO_FRAME; block = _links(block)->next) {
+    if (_links(block)->lane == lane) return block;
+  }
+  return XBEE_NO_FRAME;
+}
+
+/** 
+ * Sets what happens when a frame arrives for a full lane: XBEE_DROP_OLDEST
+ * evicts the lane's oldest buffered frame, XBEE_DROP_NEWEST discards the 
+ * arriving frame and XBEE_BLOCK_PRODUCER stops reading the serial port until
+ * a consumer releases a frame (for at most 5 timeouts, then drops it).
+ */
+void XBeeAPIParser::set_overflow_policy(int lane, int policy) {
+  if ((lane < 0) || (lane >= XBEE_LANES)) return;
+  if ((policy < XBEE_DROP_OLDEST) || (policy > XBEE_BLOCK_PRODUCER)) return;
+  _lock_frame_buffer();
+  _lanePolicy[lane] = policy;
+  _unlock_frame_buffer();
+}
+
+/** 
+ * Reserves frames of capacity for the control lane. Bulk data may then 
+ * never hold more than the remaining frames, so a burst of received packets
+ * cannot push out the responses that requests are waiting for.
+ */
+void XBeeAPIParser::set_control_reserve(int frames) {
+  if ((frames < 0) || (frames >= _maxFrames)) return;
+  _lock_frame_buffer();
+  _laneLimit[XBEE_LANE_DATA] = _maxFrames - frames;
+  _unlock_frame_buffer();
+}
+
+/** 
+ * @returns number of frames the lane has dropped for lack of space
+ */
+uint32_t XBeeAPIParser::dropped_frames(int lane) {
+  if ((lane < 0) || (lane >= XBEE_LANES)) return 0;
+  return _laneDrops[lane];
+}
+
+/** 
+ * Routes every future frame of one type to a queue owned by the caller 
+ * instead of the shared frame buffer. Only one subscriber is allowed per 
+ * frame type.
+ * 
+ * @returns false if the type already has a subscriber or the table is full
+ */
+bool XBeeAPIParser::subscribe(char frameType, XBeeFrameQueue* queue) {
+  return _subscribe(frameType, nullptr, queue);
+}
+
+/** 
+ * Calls handler on the receive thread for every future frame of one type 
+ * instead of buffering it. The frame is only valid during the call, and the 
+ * handler must not block waiting on the parser.
+ * 
+ * @returns false if the type already has a subscriber or the table is full
+ */
+bool XBeeAPIParser::subscribe(char frameType, Callback<void(const apiFrame_t*)> handler) {
+  return _subscribe(frameType, handler, NULL);
+}
+
+/** 
+ * Returns a frame type to the shared frame buffer 
+ */
+void XBeeAPIParser::unsubscribe(char frameType) {
+  _subscriberMutex.lock();
+  for (int i = 0; i < XBEE_MAX_SUBSCRIBERS; i++) {
+    if (_subscribers[i].active && (_subscribers[i].frameType == frameType)) {
+      _subscribers[i].active = false; // A queue keeps any frames it already holds
+    }
+  }
+  _subscriberMutex.unlock();
+}
+
+/** 
+ * Subscribes one handler to both receive packet types, 0x90 and 0x81 (from
+ * senders using a short address), for layers that take over received 
+ * packets. Either both subscriptions are made or neither.
+ * 
+ * @returns false if either type already has a subscriber or the table is 
+ * full
+ */
+bool XBeeAPIParser::subscribe_packets(Callback<void(const apiFrame_t*)> handler) {
+  if (!_subscribe(0x90, handler, NULL)) return false;
+  if (_subscribe(0x81, handler, NULL)) return true;
+  unsubscribe(0x90);
+  return false;
+}
+
+/** 
+ * Ends a subscription made with subscribe_packets. Only its owner should 
+ * call this.
+ */
+void XBeeAPIParser::unsubscribe_packets() {
+  unsubscribe(0x90);
+  unsubscribe(0x81);
+}
+
+/** 
+ * Finds the sender and payload of a 0x90 or 0x81 receive packet, for 
+ * subscribers. The 64-bit address of a 0x81 sender comes from the short 
+ * address table and is XBEE_ADDRESS_UNKNOWN if the sender is not in it.
+ * 
+ * @returns payload length, with *payload pointing into the frame | -1 if 
+ * the frame is not a receive packet or is truncated
+ */
+int XBeeAPIParser::packet_source(const apiFrame_t* frame, uint64_t* address, const char** payload) {
+  int header;
+  if ((uint8_t) frame->type == 0x90) {
+    header = 11; // Source address (8), 16-bit address (2), options (1)
+    if (frame->length < header) return -1;
+    *address = 0;
+    for (int i = 0; i < 8; i++) *address = (*address << 8) | (uint8_t) frame->data[i];
+  } else if ((uint8_t) frame->type == 0x81) {
+    header = 4; // Source address (2), RSSI (1), options (1)
+    if (frame->length < header) return -1;
+    *address = long_address(((uint8_t) frame->data[0] << 8) | (uint8_t) frame->data[1]);
+  } else {
+    return -1;
+  }
+  *payload = &frame->data[header];
+  return frame->length - header;
+}
+
+bool XBeeAPIParser::_subscribe(char frameType, Callback<void(const apiFrame_t*)> handler, XBeeFrameQueue* queue) {
+  subscription_t* slot = NULL;
+  _subscriberMutex.lock();
+  for (int i = 0; i < XBEE_MAX_SUBSCRIBERS; i++) {
+    if (_subscribers[i].active) {
+      if (_subscribers[i].frameType == frameType) { // Already owned
+        _subscriberMutex.unlock();
+        return false;
+      }
+    } else if (slot == NULL) {
+      slot = &_subscribers[i];
+    }
+  }
+  if (slot != NULL) {
+    slot->frameType = frameType;
+    slot->handler = handler;
+    slot->queue = queue;
+    slot->active = true;
+    if (queue != NULL) queue->_parser = this;
+  }
+  _subscriberMutex.unlock();
+  return slot != NULL;
+}
+
+/** 
+ * Runs on the receive thread for every good frame that was not a response to
+ * a request. Hands it to the subscriber for its type, if there is one.
+ * 
+ * @returns true if the frame was consumed by a subscriber
+ */
+bool XBeeAPIParser::_dispatch_frame() {
+  apiFrame_t* frame = _partialFrame.frame;
+  _subscriberMutex.lock();
+  subscription_t* sub = _find_subscriber(frame->type);
+  if (sub == NULL) {
+    _subscriberMutex.unlock();
+    return false;
+  }
+  if (sub->queue == NULL) {
+    Callback<void(const apiFrame_t*)> handler = sub->handler;
+    _subscriberMutex.unlock();
+    if (handler) handler(frame);
+    return true;
+  }
+  XBeeFrameQueue* queue = sub->queue;
+  bool full = queue->_full(); // Only this thread fills a queue
+  _subscriberMutex.unlock();
+  if (full) { // The queue's owner is not keeping up
+    _laneDrops[_lane_of(frame->type)]++;
+    return true;
+  }
+  // Claim the block before locking again. Under XBEE_BLOCK_PRODUCER that 
+  // waits for a consumer, which may itself be subscribing or unsubscribing.
+  int block = _take_rx_block();
+  if (block == XBEE_NO_FRAME) return true;
+  // Held across the hand-off so the queue cannot unsubscribe underneath us
+  _subscriberMutex.lock();
+  sub = _find_subscriber(frame->type);
+  bool subscribed = (sub != NULL) && (sub->queue == queue);
+  if (subscribed) queue->_push(block);
+  _subscriberMutex.unlock();
+  if (!subscribed) _buffer_block(block); // Unsubscribed meanwhile
+  return true;
+}
+
+/** 
+ * @returns the active subscription for a frame type, or NULL. The subscriber
+ * mutex must be held.
+ */
+subscription_t* XBeeAPIParser::_find_subscriber(char frameType) {
+  for (int i = 0; i < XBEE_MAX_SUBSCRIBERS; i++) {
+    if (_subscribers[i].active && (_subscribers[i].frameType == frameType)) return &_subscribers[i];
+  }
+  return NULL;
+}
+
+XBeeFrameQueue::XBeeFrameQueue() : _available(0, XBEE_QUEUE_DEPTH) {
+  _parser = NULL;
+  _head = 0;
+  _count = 0;
+}
+
+/** 
+ * Unsubscribes and returns any frames still queued to the pool 
+ */
+XBeeFrameQueue::~XBeeFrameQueue() {
+  XBeeAPIParser* parser = _parser;
+  if (parser != NULL) {
+    parser->_subscriberMutex.lock();
+    for (int i = 0; i < XBEE_MAX_SUBSCRIBERS; i++) {
+      if (parser->_subscribers[i].active && (parser->_subscribers[i].queue == this)) {
+        parser->_subscribers[i].active = false;
+      }
+    }
+    parser->_subscriberMutex.unlock();
+    XBeeFrameHandle frame;
+    while (try_get(&frame)) frame.release();
+  }
+}
+
+/** 
+ * Takes the oldest queued frame without waiting 
+ * 
+ * @returns true if a frame was available
+ */
+bool XBeeFrameQueue::try_get(XBeeFrameHandle* frame) {
+  frame->release();
+  if (!_available.try_acquire()) return false;
+  _pop(frame);
+  return true;
+}
+
+/** 
+ * Takes the oldest queued frame, waiting until the deadline for one to arrive 
+ * 
+ * @returns true if a frame was available
+ */
+bool XBeeFrameQueue::get(XBeeFrameHandle* frame, Kernel::Clock::time_point deadline) {
+  frame->release();
+  if (!_available.try_acquire_until(deadline)) return false;
+  _pop(frame);
+  return true;
+}
+
+bool XBeeFrameQueue::_full() {
+  _mutex.lock();
+  bool full = (_count == XBEE_QUEUE_DEPTH);
+  _mutex.unlock();
+  return full;
+}
+
+void XBeeFrameQueue::_push(int block) {
+  _mutex.lock();
+  _blocks[(_head + _count) % XBEE_QUEUE_DEPTH] = block;
+  _count++;
+  _mutex.unlock();
+  _available.release();
+}
+
+void XBeeFrameQueue::_pop(XBeeFrameHandle* frame) {
+  _mutex.lock();
+  frame->_parser = _parser;
+  frame->_block = _blocks[_head];
+  _head = (_head + 1) % XBEE_QUEUE_DEPTH;
+  _count--;
+  _mutex.unlock();
+}
+
+/** 
+ * Adds a latency to a histogram. Histograms are only written by the receive
+ * thread.
+ */
+void XBeeAPIParser::_record_latency(xbeeHistogram_t* histogram, uint32_t us) {
+  int bucket = 0;
+  if (us >= 64) bucket = (31 - __builtin_clz(us)) - 5; // Index of the top bit, less 2^5
+  if (bucket >= XBEE_HIST_BUCKETS) bucket = XBEE_HIST_BUCKETS - 1;
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  if (us > histogram->max) histogram->max = us;
+}
+
+void XBeeAPIParser::_count_mutex_timeout() {
+  core_util_atomic_incr_u32(&_metrics.mutexTimeouts, 1);
+}
+
+/** 
+ * Copies the counters and latency histograms without taking any lock, so it
+ * is cheap enough to call from a monitoring loop. Each value is read in one 
+ * word access and only ever increases, but values recorded while the copy 
+ * is in progress may appear in some fields and not yet in others.
+ */
+void XBeeAPIParser::metrics(xbeeMetrics_t* snapshot) {
+  const volatile uint32_t* src = (const volatile uint32_t*) &_metrics;
+  uint32_t* dst = (uint32_t*) snapshot;
+  for (size_t i = 0; i < sizeof(xbeeMetrics_t) / sizeof(uint32_t); i++) {
+    dst[i] = src[i];
+  }
+}
+
+/** 
+ * Zeros the counters and histograms. Anything recorded concurrently may 
+ * survive the reset.
+ */
+void XBeeAPIParser::reset_metrics() {
+  volatile uint32_t* dst = (volatile uint32_t*) &_metrics;
+  for (size_t i = 0; i < sizeof(xbeeMetrics_t) / sizeof(uint32_t); i++) {
+    dst[i] = 0;
+  }
+}
+
+/** 
+ * Starts logging every byte read from and written to the XBee, as sent on
+ * the wire, to the capture (NULL stops). A capture can be played back into
+ * a parser with XBeeReplaySource.
+ */
+void XBeeAPIParser::set_capture(XBeeCapture* capture) {
+  _capture = capture;
+}
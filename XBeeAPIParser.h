@@ -10,15 +10,33 @@
 #ifndef XBEE_API_PARSER_H
 #define XBEE_API_PARSER_H
 
-#include "mbed.h"
+#include "XBeePlatform.h"
+#include "XBeeCapture.h"
 #include <string> 
+#include <cstddef>
 using namespace std;
 
+// Defaults for parsers that do not size themselves (see XBeeAPIParserStatic)
+#ifndef MAX_INCOMING_FRAMES
 #define MAX_INCOMING_FRAMES 5
-#define MAX_FRAME_LENGTH 70
+#endif
+// Largest frame data: 802.15.4 RX (0x80) is 8 address + RSSI + options + 100 payload bytes
+#ifndef MAX_FRAME_LENGTH
+#define MAX_FRAME_LENGTH 110
+#endif
+#ifndef XBEE_RX_STACK_SIZE
+#define XBEE_RX_STACK_SIZE 4096
+#endif
 
 #define XBEE_MIN_ADDRESS 0x0013A20000000000
 
+#define XBEE_RX_SIGNAL_FLAG 0x01
+#define XBEE_TXN_SIGNAL_FLAG 0x02
+#define XBEE_TX_SIGNAL_FLAG 0x04
+#define XBEE_RX_CHUNK_SIZE 64
+// Start delimiter, length, type, ID and checksum around the frame data
+#define XBEE_TX_BUFFER_SIZE (MAX_FRAME_LENGTH + 6)
+
 typedef struct {
     char type;
     char id;
@@ -26,64 +44,685 @@ typedef struct {
     char data[MAX_FRAME_LENGTH];
 } apiFrame_t;
 
+#define XBEE_NO_FRAME 0xFF
+// Most frames a parser can buffer; block indices 0 to frames must stay below
+// XBEE_NO_FRAME
+#define XBEE_MAX_FRAMES (XBEE_NO_FRAME - 1)
+
+// List links kept in front of each frame in a pool block
 typedef struct {
-    uint16_t length;
-    apiFrame_t frame[MAX_INCOMING_FRAMES];
-} frameBuffer_t;
+    uint8_t next;
+    uint8_t prev;
+    uint8_t indexNext;
+    uint8_t lane;
+} frameLinks_t;
+
+// Buffer lanes. Control frames (responses and status) get reserved capacity
+// so bulk data cannot crowd them out.
+#define XBEE_LANE_CONTROL 0
+#define XBEE_LANE_DATA 1
+#define XBEE_LANES 2
+#define XBEE_NO_LANE 0xFF
+
+// Lane overflow policies
+#define XBEE_DROP_OLDEST 0
+#define XBEE_DROP_NEWEST 1
+#define XBEE_BLOCK_PRODUCER 2
+
+// Pool blocks hold the links and an apiFrame_t truncated to frameLength data 
+// bytes. One extra block is always owned by the parser for the frame being received.
+#define XBEE_FRAME_BLOCK_SIZE(frameLength) ((sizeof(frameLinks_t) + offsetof(apiFrame_t, data) + (frameLength) + 3) & ~3)
+#define XBEE_FRAME_POOL_BYTES(frames, frameLength) (((frames) + 1) * XBEE_FRAME_BLOCK_SIZE(frameLength))
+// Entries in each receive thread handoff ring. Ring positions are free 
+// running uint8_t counters, so this must stay 256.
+#define XBEE_HANDOFF_RING_SIZE 256
+// Buckets in the (frame type, frame ID) index; must be a power of two
+#define XBEE_FRAME_INDEX_BUCKETS 16
+
+// Requests awaiting a response frame
+#define XBEE_MAX_PENDING 16
+
+// Frame types that can be routed to their own subscriber, and the depth of
+// each subscriber's queue
+#define XBEE_MAX_SUBSCRIBERS 8
+#define XBEE_QUEUE_DEPTH 4
+
+// Node identifier to address cache
+#define XBEE_ADDRESS_CACHE_SIZE 8
+#define XBEE_MAX_NI_LENGTH 20
+
+// 64-bit to 16-bit (MY) address table, used to send the shorter 0x01 TX
+// request whenever a destination's short address is known
+#define XBEE_SHORT_ADDRESS_TABLE_SIZE 16
+#define XBEE_SHORT_ADDRESS_NONE 0xFFFE
+#define XBEE_ADDRESS_UNKNOWN 0xFFFFFFFFFFFFFFFFULL
+
+// I/O sample frames (0x82, 0x83) carry up to nine digital lines (D0-D8)
+// and six analog inputs (A0-A5); each sample takes at least two bytes
+#define XBEE_IO_DIO_CHANNELS 9
+#define XBEE_IO_ADC_CHANNELS 6
+#ifndef XBEE_IO_MAX_SAMPLES
+#define XBEE_IO_MAX_SAMPLES ((MAX_FRAME_LENGTH - 7) / 2)
+#endif
+
+// Nodes kept from node discovery (ND), chained by address and by name
+// through hash buckets; buckets must be a power of two
+#define XBEE_NODE_TABLE_SIZE 16
+#define XBEE_NODE_INDEX_BUCKETS 16
+#define XBEE_NO_NODE 0xFF
+
+// Streamed transmissions that may await their status at once
+#define XBEE_MAX_TX_WINDOW 8
+
+// Remote AT requests a fan-out keeps outstanding at once, leaving the rest
+// of the pending table to other requests
+#ifndef XBEE_REMOTE_AT_WINDOW
+#define XBEE_REMOTE_AT_WINDOW 12
+#endif
+// Response data kept per remote AT result
+#define XBEE_REMOTE_AT_MAX_VALUE 8
+// Remote command option: apply the queued changes on the remote node
+#define XBEE_REMOTE_AT_APPLY 0x02
+
+// Round trip time estimates that size request timeouts the way TCP sizes
+// its RTO: per destination for TX status and remote AT responses, per 
+// command class for local AT responses. The least recently used destination
+// makes way.
+#ifndef XBEE_RTT_DESTINATIONS
+#define XBEE_RTT_DESTINATIONS 16
+#endif
+// Bounds on a measured timeout; the upper one is a multiple of set_timeout
+#ifndef XBEE_RTO_MIN
+#define XBEE_RTO_MIN 50ms
+#endif
+#define XBEE_RTO_MAX_FACTOR 10
+// Clock granularity: the least headroom a timeout keeps over the mean
+#define XBEE_RTO_GRANULARITY_US 1000
+// Timeouts in a row that each double the next timeout
+#define XBEE_RTO_MAX_BACKOFF 4
+
+// What a request's round trip is measured against
+#define XBEE_RTT_NONE 0
+#define XBEE_RTT_TX 1 // TX request to its 0x89 status, per destination
+#define XBEE_RTT_REMOTE_AT 2 // 0x17 to its 0x97 response, per destination
+#define XBEE_RTT_AT 3 // 0x08 to its 0x88 response, per command class
+
+// Local AT command classes
+#define XBEE_AT_CLASS_REGISTER 0 // Reads and sets a setting
+#define XBEE_AT_CLASS_SEARCH 1 // DN and ND search the network
+#define XBEE_AT_CLASS_WRITE 2 // WR, AC, RE, FR and NR write flash, apply or reset
+#define XBEE_AT_CLASSES 3
+
+// Transaction results
+#define XBEE_TXN_PENDING 1
+#define XBEE_TXN_OK 0
+#define XBEE_TXN_TIMEOUT -1
+#define XBEE_TXN_CANCELLED -2
+#define XBEE_TXN_NO_BUFFER -3
+#define XBEE_TXN_SEND_FAILED -4
+#define XBEE_TXN_BUSY -5
 
 typedef struct {
-    apiFrame_t frame;
+    apiFrame_t* frame; // Pool block the parser is writing into
     // Tracks the status of the frame (the byte location) when pulling a byte 
     char status; 
     int rcvd;
+    // Running sum of the frame data bytes, updated as they arrive
+    uint8_t checksum;
 } partialFrame_t;
 
+class XBeeAPIParser;
+
+/** Zero-copy handle to a frame held in the parser's frame pool.
+ *  The pool block is returned to the parser when the handle is released
+ *  or goes out of scope.
+ */
+class XBeeFrameHandle
+{
+private:
+    XBeeAPIParser* _parser;
+    int _block;
+    friend class XBeeAPIParser;
+    friend class XBeeFrameQueue;
+
+public:
+    XBeeFrameHandle();
+    ~XBeeFrameHandle();
+    XBeeFrameHandle(const XBeeFrameHandle&) = delete;
+    XBeeFrameHandle& operator=(const XBeeFrameHandle&) = delete;
+    bool valid() const;
+    const apiFrame_t* get() const;
+    const apiFrame_t* operator->() const;
+    void release();
+};
+
+/** Result of an asynchronous request. Owned by the caller and completed by
+ *  the receive thread when the response arrives, the request times out or
+ *  it is cancelled. Destroying a pending future cancels its request.
+ */
+class XBeeFuture
+{
+private:
+    XBeeAPIParser* _parser;
+    char _frameID;
+    volatile int _status;
+    XBeeFrameHandle _response;
+    Semaphore _done;
+    friend class XBeeAPIParser;
+
+public:
+    XBeeFuture();
+    ~XBeeFuture();
+    XBeeFuture(const XBeeFuture&) = delete;
+    XBeeFuture& operator=(const XBeeFuture&) = delete;
+    bool ready() const;
+    int status() const;
+    int wait();
+    const apiFrame_t* response() const;
+    void cancel();
+};
+
+/** Caller-owned queue that receives every frame of a subscribed type. Frames
+ *  are handed over in their pool blocks, so a queue holding frames keeps 
+ *  those blocks out of the shared frame buffer until they are taken and 
+ *  released. Destroying the queue unsubscribes it.
+ */
+class XBeeFrameQueue
+{
+private:
+    XBeeAPIParser* _parser;
+    uint8_t _blocks[XBEE_QUEUE_DEPTH];
+    int _head;
+    int _count;
+    Mutex _mutex;
+    Semaphore _available;
+    friend class XBeeAPIParser;
+
+    bool _full();
+    void _push(int block);
+    void _pop(XBeeFrameHandle* frame);
+
+public:
+    XBeeFrameQueue();
+    ~XBeeFrameQueue();
+    XBeeFrameQueue(const XBeeFrameQueue&) = delete;
+    XBeeFrameQueue& operator=(const XBeeFrameQueue&) = delete;
+    bool try_get(XBeeFrameHandle* frame);
+    bool get(XBeeFrameHandle* frame, Kernel::Clock::time_point deadline);
+};
+
+typedef struct {
+    bool active;
+    char frameType;
+    Callback<void(const apiFrame_t*)> handler;
+    XBeeFrameQueue* queue;
+} subscription_t;
+
+typedef struct {
+    bool active;
+    char frameID;
+    char responseType;
+    uint32_t started; // us on the parser clock, for latency histograms
+    Kernel::Clock::time_point deadline;
+    Callback<void(int, const apiFrame_t*)> done;
+    XBeeFuture* future;
+    bool streaming; // Several responses, the last one without data
+    uint8_t rttKind; // XBEE_RTT_ estimate the response time feeds
+    uint64_t rttKey; // Destination address or AT command class
+} transaction_t;
+
+typedef struct {
+    int32_t srtt; // us
+    int32_t rttvar; // us
+    uint32_t samples;
+    uint8_t backoff; // Timeouts since the last response
+} rttEstimator_t;
+
+typedef struct {
+    bool valid;
+    uint64_t address;
+    uint32_t lastUsed; // Table clock, for least recently used replacement
+    rttEstimator_t tx;
+    rttEstimator_t remoteAT;
+} rttDestination_t;
+
+typedef struct {
+    uint32_t srtt; // Smoothed round trip time, us
+    uint32_t rttvar; // Smoothed mean deviation, us
+    uint32_t rto; // Timeout the next request gets, us
+    uint32_t samples; // Responses measured; with none, rto is the backed off fixed default
+    uint8_t backoff; // Timeouts in a row, each doubling rto
+} xbeeRTT_t;
+
+typedef struct {
+    bool valid;
+    char ni[XBEE_MAX_NI_LENGTH + 1];
+    uint64_t address;
+    Kernel::Clock::time_point expires;
+} addressCacheEntry_t;
+
+typedef struct {
+    bool valid;
+    uint16_t shortAddress;
+    uint64_t address;
+    uint32_t lastUsed; // Table clock, for least recently used replacement
+} shortAddressEntry_t;
+
+typedef struct {
+    uint64_t address;
+    uint16_t shortAddress; // MY, or XBEE_SHORT_ADDRESS_NONE
+    uint8_t rssi; // -dBm of the node's ND response, as DB reports it
+    char ni[XBEE_MAX_NI_LENGTH + 1];
+    uint32_t lastSeen; // Discovery run that last heard from the node
+} xbeeNode_t;
+
+/** Samples of one I/O sample frame, one contiguous array per channel */
+typedef struct {
+    uint64_t address; // XBEE_ADDRESS_UNKNOWN for a 0x83 frame from an unknown short address
+    uint16_t shortAddress; // XBEE_SHORT_ADDRESS_NONE for 0x82 frames
+    uint8_t rssi; // -dBm
+    uint8_t options;
+    uint16_t dioMask; // Bit n set if Dn was sampled
+    uint8_t adcMask; // Bit n set if An was sampled
+    int count;
+    uint16_t dio[XBEE_IO_MAX_SAMPLES]; // Bit n is the level of Dn; only if dioMask is set
+    uint16_t adc[XBEE_IO_ADC_CHANNELS][XBEE_IO_MAX_SAMPLES]; // 10-bit readings of the channels in adcMask
+} xbeeIOSamples_t;
+
+typedef struct {
+    bool valid;
+    uint8_t nextByAddress; // Index chains, XBEE_NO_NODE terminated
+    uint8_t nextByName;
+    xbeeNode_t node;
+} nodeTableEntry_t;
+
+typedef struct {
+    XBeeAPIParser* parser;
+    bool active;
+    bool countFailures;
+    Callback<void(int)> delivered;
+} txStreamSlot_t;
+
+typedef struct {
+    string command; // Two characters, e.g. "CH"
+    string parameter; // Raw value bytes, big endian for numbers; empty to query
+} remoteATCommand_t;
+
+typedef struct {
+    // AT command status from the node's 0x97 response (0 OK, 1 ERROR,
+    // 2 invalid command, 3 invalid parameter, 4 no response from the node),
+    // or a negative XBEE_TXN_ code if no response came back from the local
+    // radio
+    int status;
+    int length; // Response data bytes, at most XBEE_REMOTE_AT_MAX_VALUE kept
+    char value[XBEE_REMOTE_AT_MAX_VALUE];
+} remoteATResult_t;
+
+typedef struct {
+    volatile bool active;
+    remoteATResult_t* result;
+    Semaphore* done;
+} remoteATSlot_t;
+
+// Latency histogram buckets. Bucket 0 counts latencies under 64us and 
+// bucket i those from 2^(i+5) to 2^(i+6) us; the last is open ended (>1s).
+#define XBEE_HIST_BUCKETS 16
+
+typedef struct {
+    uint32_t count;
+    uint32_t max; // us
+    uint32_t buckets[XBEE_HIST_BUCKETS];
+} xbeeHistogram_t;
+
+typedef struct {
+    uint32_t bytesReceived;
+    uint32_t framesParsed;
+    uint32_t checksumErrors;
+    uint32_t oversizeFrames;
+    uint32_t evictions;
+    uint32_t mutexTimeouts;
+    uint32_t deferredHandoffs; // Frames left for a consumer holding the buffer to link
+    uint32_t txFailures;
+    uint32_t malformedPackets; // Receive packets too short for their header, dropped by rxPacket
+    xbeeHistogram_t txStatusLatency; // TX request to 0x89 status
+    xbeeHistogram_t atResponseLatency; // AT request to 0x88/0x97 response
+    xbeeHistogram_t deliveryLatency; // Last byte read to frame delivered
+} xbeeMetrics_t;
+
 class XBeeAPIParser
 {
 private:
-    BufferedSerial* _modem;
-    volatile partialFrame_t _partialFrame;
-    volatile frameBuffer_t _frameBuffer;
+    FileHandle* _modem; // BufferedSerial on mbed, XBeePosixSerial on a host
+    partialFrame_t _partialFrame; // Only touched by the receive thread
+    // Frame pool. Buffered frames form a doubly linked list in arrival order,
+    // threaded through the block links, so frames are never copied or 
+    // shifted inside the buffer.
+    char* _pool;
+    bool _ownsPool;
+    int _maxFrames;
+    int _frameLength;
+    int _blockSize;
+    uint8_t _frameHead;
+    uint8_t _frameTail;
+    uint8_t _rxBlock;
+    int _frameCount;
+    // Buffered frames are also chained per (type, ID) hash bucket for O(1) lookup
+    uint8_t _frameIndex[XBEE_FRAME_INDEX_BUCKETS];
+    // Lock-free handoff between the receive thread and whichever thread holds
+    // _frameBufferMutex. Filled blocks wait in _rxRing until a holder links 
+    // them into the buffer; unused blocks wait in _freeRing for the receive 
+    // thread. Each ring has one producer and one consumer at a time.
+    uint8_t _rxRing[XBEE_HANDOFF_RING_SIZE];
+    volatile uint8_t _rxRingHead; // Written by the receive thread
+    volatile uint8_t _rxRingTail; // Written under _frameBufferMutex
+    uint8_t _freeRing[XBEE_HANDOFF_RING_SIZE];
+    volatile uint8_t _freeRingHead; // Written under _frameBufferMutex
+    volatile uint8_t _freeRingTail; // Written by the receive thread
+    // Pool blocks in use per lane (waiting in _rxRing, buffered or out with a
+    // consumer). Changed atomically since the receive thread claims blocks 
+    // without the lock.
+    volatile uint32_t _laneUsed[XBEE_LANES];
+    int _laneLimit[XBEE_LANES];
+    int _lanePolicy[XBEE_LANES];
+    volatile uint32_t _laneDrops[XBEE_LANES];
     std::chrono::milliseconds _time_out;
     int _failedTransmits;
     int _maxFailedTransmits;
 
     volatile bool _isAssociated; 
 
+    // Receive thread instrumentation
+    Timer _rxClock;
+    volatile uint32_t _rxSignalTime;
+    uint32_t _rxWakeups;
+    uint64_t _rxLatencyTotal;
+    uint32_t _rxLatencyMax;
+    uint32_t _rxStatsStart;
+    std::chrono::milliseconds _rxPollInterval;
+    char _rxChunk[XBEE_RX_CHUNK_SIZE];
+    int _rxChunkSize;
+    uint64_t _rxBytes;
+    uint32_t _rxFrames;
+    uint64_t _rxParseTime;
+    uint32_t _rxChunkTime;
+    volatile int _apiMode; // AP=1 unescaped or AP=2 escaped
+    XBeeCapture* volatile _capture; // Raw serial log, or NULL
+    volatile bool _stopping;
+    bool _rxEscapePending;
+
+    // Only ever written a word at a time so metrics() can copy it unlocked
+    xbeeMetrics_t _metrics;
+
+    // Transaction engine
+    transaction_t _pending[XBEE_MAX_PENDING];
+    uint8_t _lastFrameID;
+
+    subscription_t _subscribers[XBEE_MAX_SUBSCRIBERS];
+
+    // Transmit window and throughput accounting, guarded by _txMutex
+    txStreamSlot_t _txSlots[XBEE_MAX_TX_WINDOW];
+    int _txWindow;
+    int _txOutstanding;
+    uint32_t _txDelivered;
+    uint32_t _txFailed;
+    uint64_t _txBusyTime;
+    uint32_t _txBusySince;
+    volatile bool _disassociateRequested;
+
+    // Address cache, guarded by _addressCacheMutex
+    addressCacheEntry_t _addressCache[XBEE_ADDRESS_CACHE_SIZE];
+    std::chrono::milliseconds _addressCacheTTL;
+    uint32_t _addressCacheHits;
+    uint32_t _addressCacheMisses;
+    // Short address table, also guarded by _addressCacheMutex
+    shortAddressEntry_t _shortAddresses[XBEE_SHORT_ADDRESS_TABLE_SIZE];
+    uint32_t _shortAddressClock;
+    bool _shortAddressing;
+    uint32_t _shortFramesSent;
+    // Node table, guarded by _nodeTableMutex
+    nodeTableEntry_t _nodes[XBEE_NODE_TABLE_SIZE];
+    uint8_t _nodesByAddress[XBEE_NODE_INDEX_BUCKETS];
+    uint8_t _nodesByName[XBEE_NODE_INDEX_BUCKETS];
+    uint32_t _discoveryRun;
+    // Node discovery in progress, one at a time
+    volatile bool _discoveryActive;
+    volatile int _discoveryFound;
+    volatile int _discoveryStatus;
+    Semaphore _discoveryDone;
+    // Round trip time estimates, guarded by _rttMutex
+    rttDestination_t _rttDestinations[XBEE_RTT_DESTINATIONS];
+    rttEstimator_t _atRTT[XBEE_AT_CLASSES];
+    uint32_t _rttClock;
+    bool _adaptiveTimeouts;
+
     // RTOS management
     // Mutex _partialFrameMutex;
     Mutex _frameBufferMutex;
+    ConditionVariable _frameArrived;
+    ConditionVariable _frameFreed;
     Mutex _modemTxMutex;
+    // Guarded by _modemTxMutex
+    char _txBuffer[XBEE_TX_BUFFER_SIZE];
+    char _txEscaped[2*XBEE_TX_BUFFER_SIZE];
+    uint64_t _txEncodeTime;
+    uint64_t _txEncodedBytes;
+    Mutex _pendingMutex;
+    Mutex _txMutex;
+    Mutex _addressCacheMutex;
+    Mutex _nodeTableMutex;
+    Mutex _rttMutex;
+    Mutex _subscriberMutex;
+    ConditionVariable _txWindowOpen;
     Thread _updateBufferThread;
+    EventFlags _serialEvents;
     osThreadId_t _frameAlertThreadId;
 
-    void _pull_byte();
+    void _parse_chunk(const char* buff, int n);
+    void _parse_escaped_chunk(char* buff, int n);
+    static int _unescape(char* buff, int n, bool* pending);
+    static int _escape(const char* in, int n, char* out);
+    static bool _has_frame_id(char frameType);
     void _verify_association();
     void _disassociate();
-    void _remove_frame_by_index(int n);
+    frameLinks_t* _links(int block) { return (frameLinks_t*) (_pool + block*_blockSize); }
+    apiFrame_t* _frame(int block) { return (apiFrame_t*) (_pool + block*_blockSize + sizeof(frameLinks_t)); }
+    void _free_block(int block);
+    void _lock_frame_buffer();
+    void _unlock_frame_buffer();
+    bool _drain_rx_ring();
+    void _publish_frame(int block);
+    int _swap_rx_block(int lane);
+    void _link_frame(int block);
+    void _unlink_frame(int block);
+    int _match_frame(char frameType, char frameID);
+    int _oldest_packet();
+    static int _frame_key_hash(char frameType, char frameID);
+    void _release_block(int block);
     void _move_frame_to_buffer();
+    void _buffer_partial_frame();
+    void _buffer_block(int block);
+    void _sigio();
+    char _next_frame_id();
+    int _submit(apiFrame_t* request, char responseType, std::chrono::milliseconds timeout, Callback<void(int, const apiFrame_t*)> done, XBeeFuture* future, bool streaming);
+    bool _abort(char frameID, XBeeFuture* owner, int status);
+    void _complete_future(XBeeFuture* future, int status);
+    bool _complete_transaction();
+    transaction_t* _find_transaction(const apiFrame_t* frame);
+    Kernel::Clock::time_point _expire_transactions();
+    int _take_rx_block();
+    int _claim_rx_block();
+    static int _lane_of(char frameType);
+    int _oldest_in_lane(int lane);
+    static void _record_latency(xbeeHistogram_t* histogram, uint32_t us);
+    void _count_mutex_timeout();
+    bool _subscribe(char frameType, Callback<void(const apiFrame_t*)> handler, XBeeFrameQueue* queue);
+    bool _dispatch_frame();
+    subscription_t* _find_subscriber(char frameType);
+    bool _make_TX_frame(uint64_t address, const char* payload, int len, apiFrame_t* frame);
+    bool _make_TX16_frame(uint16_t shortAddress, const char* payload, int len, apiFrame_t* frame);
+    int _tx_and_wait(apiFrame_t* frame);
+    void _learn_short_address(const apiFrame_t* frame);
+    int _tx_result(int txnStatus, const apiFrame_t* status, bool countFailures);
+    void _tx_begin();
+    void _tx_end();
+    static void _tx_stream_status(txStreamSlot_t* slot, int txnStatus, const apiFrame_t* status);
+    void _run_deferred_disassociate();
+    static int _encode_frame(const apiFrame_t* frame, char* buff);
+    bool _write_all(const char* buff, int len, Kernel::Clock::time_point deadline);
+    uint64_t _resolve_address(string ni);
+    void _cache_address(string ni, uint64_t address);
+    void _node_discovered(int status, const apiFrame_t* response);
+    void _update_node(const xbeeNode_t* node);
+    void _unlink_node(int index);
+    int _find_node(uint64_t address);
+    int _find_node(const char* ni);
+    static int _address_hash(uint64_t address);
+    static int _name_hash(const char* ni);
+    int _rtt_kind(const apiFrame_t* frame, uint64_t* key);
+    static int _at_class(const char* cmd);
+    rttEstimator_t* _rtt_estimator(int kind, uint64_t key, bool create);
+    void _rtt_sample(int kind, uint64_t key, uint32_t us);
+    void _rtt_timeout(int kind, uint64_t key);
+    std::chrono::milliseconds _rto(const rttEstimator_t* estimator, std::chrono::milliseconds fallback);
+    std::chrono::milliseconds _default_timeout(int kind, uint64_t key);
+    std::chrono::milliseconds _longest_timeout();
+    bool _rtt_snapshot(int kind, uint64_t key, xbeeRTT_t* rtt);
     void _make_AT_frame(string cmd, apiFrame_t* frame);
     void _make_AT_frame(string cmd, string param, apiFrame_t* frame);
+    bool _make_remote_AT_frame(uint64_t address, string cmd, string param, char options, apiFrame_t* frame);
+    static void _remote_at_done(remoteATSlot_t* slot, int status, const apiFrame_t* response);
     void _init();
 
+    friend class XBeeFrameHandle;
+    friend class XBeeFuture;
+    friend class XBeeFrameQueue;
+
 public:
-    XBeeAPIParser(BufferedSerial* modem);
+    XBeeAPIParser(FileHandle* modem);
+#if XBEE_PLATFORM_MBED
     XBeeAPIParser(PinName tx, PinName rx, int baud = 921600);
+#endif
+    XBeeAPIParser(FileHandle* modem, char* pool, int frames, int frameLength, unsigned char* stack, uint32_t stackSize);
+    ~XBeeAPIParser();
+    XBeeAPIParser(const XBeeAPIParser&) = delete;
+    XBeeAPIParser& operator=(const XBeeAPIParser&) = delete;
     bool readable();
     bool associated();
     bool send(apiFrame_t* frame);
     bool get_oldest_frame(apiFrame_t* frame);
     bool find_frame(char frameType, char frameID, apiFrame_t* frame);
     bool find_frame(char frameType, apiFrame_t* frame);
+    bool get_oldest_frame(XBeeFrameHandle* frame);
+    bool find_frame(char frameType, char frameID, XBeeFrameHandle* frame);
+    bool find_frame(char frameType, XBeeFrameHandle* frame);
+    bool wait_for_frame(char frameType, char frameID, Kernel::Clock::time_point deadline, XBeeFrameHandle* frame);
+    bool wait_for_frame(char frameType, char frameID, Kernel::Clock::time_point deadline, apiFrame_t* frame);
     void flush_old_frames(char frameType, char frameID);
+    int request(apiFrame_t* frame, char responseType, std::chrono::milliseconds timeout, XBeeFuture* future);
+    int request(apiFrame_t* frame, char responseType, std::chrono::milliseconds timeout, Callback<void(int, const apiFrame_t*)> done);
+    int at_request(string cmd, string param, XBeeFuture* future);
+    int remote_at_request(uint64_t address, string cmd, string param, XBeeFuture* future, bool apply = true);
+    int remote_at_fanout(const uint64_t* addresses, int nodes, const remoteATCommand_t* commands, int count, remoteATResult_t* results);
+    bool cancel_request(char frameID);
+    std::chrono::milliseconds request_timeout(const apiFrame_t* frame);
+    void set_adaptive_timeouts(bool enabled);
+    bool tx_rtt(uint64_t address, xbeeRTT_t* rtt);
+    bool remote_at_rtt(uint64_t address, xbeeRTT_t* rtt);
+    bool at_rtt(string cmd, xbeeRTT_t* rtt);
+    void reset_rtt();
+    bool subscribe(char frameType, XBeeFrameQueue* queue);
+    bool subscribe(char frameType, Callback<void(const apiFrame_t*)> handler);
+    void unsubscribe(char frameType);
+    bool subscribe_packets(Callback<void(const apiFrame_t*)> handler);
+    void unsubscribe_packets();
+    int packet_source(const apiFrame_t* frame, uint64_t* address, const char** payload);
+    void set_overflow_policy(int lane, int policy);
+    void set_control_reserve(int frames);
+    uint32_t dropped_frames(int lane);
     int txAddressed(uint64_t address, char* payload, int len);
     int txBroadcast(char* payload, int len);
+    int txShort(uint16_t shortAddress, char* payload, int len);
+    int txStream(uint64_t address, char* payload, int len, Callback<void(int)> delivered = nullptr, bool countFailures = true);
+    bool txStreamFlush();
+    void set_tx_window(int window);
+    float tx_frames_per_second();
+    void reset_tx_stats();
     int rxPacket(char* payload, uint64_t* address);
+    int rxPacket(char* payload, uint64_t* address, uint16_t* shortAddress);
+    int rxIOSamples(xbeeIOSamples_t* samples);
+    bool decode_io_samples(const apiFrame_t* frame, xbeeIOSamples_t* samples);
     void set_timeout(std::chrono::milliseconds t);
     void set_max_failed_transmits(int maxFails);
     char last_RSSI();
     uint64_t get_address(string ni);
+    bool cached_address(string ni, uint64_t* address);
+    void set_address_cache_ttl(std::chrono::milliseconds ttl);
+    void flush_address_cache();
+    void set_short_address(uint64_t address, uint16_t shortAddress);
+    bool short_address(uint64_t address, uint16_t* shortAddress);
+    uint64_t long_address(uint16_t shortAddress);
+    void set_short_addressing(bool enabled);
+    void flush_short_addresses();
+    uint32_t short_frames_sent();
+    uint32_t address_cache_hits();
+    uint32_t address_cache_misses();
+    int discover_nodes(std::chrono::milliseconds timeout = 3000ms);
+    int start_node_discovery(std::chrono::milliseconds timeout = 3000ms);
+    bool node_discovery_running();
+    bool find_node(uint64_t address, xbeeNode_t* node);
+    bool find_node(string ni, xbeeNode_t* node);
+    int get_nodes(xbeeNode_t* nodes, int max);
+    int prune_nodes(int missedRuns);
+    void flush_nodes();
     void set_frame_alert_thread_id(osThreadId_t threadID);
+    void set_rx_polling(std::chrono::milliseconds interval);
+    float rx_wakeups_per_second();
+    std::chrono::microseconds rx_latency_mean();
+    std::chrono::microseconds rx_latency_max();
+    void reset_rx_stats();
+    void set_rx_chunk_size(int n);
+    float rx_parse_mbytes_per_second();
+    float rx_parse_frames_per_second();
+    void set_api_mode(int mode);
+    int api_mode();
+    float tx_encode_mbytes_per_second();
+    void metrics(xbeeMetrics_t* snapshot);
+    void set_capture(XBeeCapture* capture);
+    void reset_metrics();
+};
+
+/** Statically allocated buffers for XBeeAPIParserStatic. Kept in a separate
+ *  base class so they exist before the parser's receive thread starts.
+ */
+template <int Frames, int FrameLength, uint32_t StackSize>
+class XBeeParserStorage
+{
+protected:
+    alignas(4) char _staticPool[XBEE_FRAME_POOL_BYTES(Frames, FrameLength)];
+    alignas(8) unsigned char _staticStack[StackSize];
+};
+
+/** XBeeAPIParser sized at compile time. Frame buffer and receive thread stack
+ *  are members, so a global or static instance needs no heap at all.
+ * 
+ *  @tparam Frames received frames to buffer
+ *  @tparam FrameLength largest received frame data to accept
+ *  @tparam StackSize receive thread stack size in bytes
+ * 
+ *  footprint is the RAM the instance occupies, for example
+ *  static_assert(XBeeAPIParserStatic<3, 40>::footprint < 6*1024, "too big");
+ */
+template <int Frames, int FrameLength = MAX_FRAME_LENGTH, uint32_t StackSize = XBEE_RX_STACK_SIZE>
+class XBeeAPIParserStatic : private XBeeParserStorage<Frames, FrameLength, StackSize>, public XBeeAPIParser
+{
+    static_assert((Frames > 0) && (Frames <= XBEE_MAX_FRAMES), "Frames must be between 1 and XBEE_MAX_FRAMES");
+    static_assert((FrameLength > 0) && (FrameLength <= MAX_FRAME_LENGTH), "FrameLength must be between 1 and MAX_FRAME_LENGTH");
+
+public:
+    static constexpr size_t footprint = sizeof(XBeeAPIParser) + sizeof(XBeeParserStorage<Frames, FrameLength, StackSize>);
+
+    XBeeAPIParserStatic(FileHandle* modem) : 
+        XBeeAPIParser(modem, this->_staticPool, Frames, FrameLength, this->_staticStack, StackSize) {}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,353 @@
+#include "XBeeBatcher.h"
+
+/**
+ * @brief Construct a new batcher sending through the given parser
+ *
+ * @param deadline longest a message waits in an open batch
+ */
+XBeeBatcher::XBeeBatcher(XBeeAPIParser* parser, std::chrono::milliseconds deadline) :
+  _idle(_mutex),
+  _thread(osPriorityNormal, XBEE_BATCH_STACK_SIZE, NULL, "XBeeBatcher") {
+  _parser = parser;
+  for (int i = 0; i < XBEE_BATCH_DESTINATIONS; i++) _batches[i].active = false;
+  _deadline = deadline;
+  _messagesSent = 0;
+  _framesSent = 0;
+  _failedFrames = 0;
+  _outstanding = 0;
+  _subscribed = false;
+  _stop = false;
+  _thread.start(callback(this, &XBeeBatcher::_run));
+}
+
+/**
+ * Stops the deadline thread, sends whatever is still batched and waits for
+ * the status of every batch, since _batch_sent still refers to the batcher
+ */
+XBeeBatcher::~XBeeBatcher() {
+  _stop = true;
+  _events.set(XBEE_BATCH_WAKE_FLAG);
+  _thread.join();
+  flush();
+  _mutex.lock();
+  while (_outstanding > 0) _idle.wait();
+  _mutex.unlock();
+  if (_subscribed) _parser->unsubscribe_packets();
+}
+
+/**
+ * Adds a message to the destination's batch. Sending a full batch, or the
+ * oldest one when every destination slot is taken, happens in the caller's
+ * thread through txStream, so this can block while the transmit window is
+ * full. Other senders and the deadline thread carry on meanwhile.
+ *
+ * @returns 0 if queued | -1 if the message is longer than
+ * XBEE_BATCH_MAX_MESSAGE | -3 if a batch sent to make room could not be
+ * queued (its messages are lost; the new message is still queued)
+ */
+int XBeeBatcher::send(uint64_t address, const char* data, int len) {
+  if ((len < 0) || (len > XBEE_BATCH_MAX_MESSAGE)) return -1;
+  // Up to two batches leave: one to make room and the new one if it fills
+  batch_t taken[2];
+  int count = 0;
+  _mutex.lock();
+  batch_t* batch = NULL;
+  batch_t* free = NULL;
+  batch_t* oldest = NULL;
+  for (int i = 0; i < XBEE_BATCH_DESTINATIONS; i++) {
+    batch_t* b = &_batches[i];
+    if (!b->active) {
+      if (free == NULL) free = b;
+    } else if (b->address == address) {
+      batch = b;
+    } else if ((oldest == NULL) || (b->deadline < oldest->deadline)) {
+      oldest = b;
+    }
+  }
+  if ((batch != NULL) && (batch->used + 1 + len > XBEE_BATCH_MAX_PAYLOAD)) { // Would overflow
+    if (_take(batch, &taken[count])) count++;
+    batch = NULL;
+    free = &_batches[0];
+    while (free->active) free++; // The batch just sent left a slot
+  }
+  if (batch == NULL) {
+    if (free == NULL) { // Out of destination slots
+      if (_take(oldest, &taken[count])) count++;
+      free = oldest;
+    }
+    batch = free;
+    batch->active = true;
+    batch->address = address;
+    batch->data[0] = XBEE_BATCH_MARKER;
+    batch->used = 1;
+    batch->messages = 0;
+    batch->deadline = Kernel::Clock::now() + _deadline;
+    _events.set(XBEE_BATCH_WAKE_FLAG); // It may now be the first batch due
+  }
+  batch->data[batch->used] = len;
+  memcpy(&batch->data[batch->used + 1], data, len);
+  batch->used += 1 + len;
+  batch->messages++;
+  if (batch->used + 1 >= XBEE_BATCH_MAX_PAYLOAD) { // Full; not even an empty message fits
+    if (_take(batch, &taken[count])) count++;
+  }
+  _mutex.unlock();
+  int result = 0;
+  for (int i = 0; i < count; i++) {
+    if (_send(&taken[i]) != 0) result = -3;
+  }
+  return result;
+}
+
+/**
+ * Sends every open batch now
+ *
+ * @returns 0 | -3 if any batch could not be queued
+ */
+int XBeeBatcher::flush() {
+  batch_t taken[XBEE_BATCH_DESTINATIONS];
+  int count = 0;
+  _mutex.lock();
+  for (int i = 0; i < XBEE_BATCH_DESTINATIONS; i++) {
+    if (_take(&_batches[i], &taken[count])) count++;
+  }
+  _mutex.unlock();
+  int result = 0;
+  for (int i = 0; i < count; i++) {
+    if (_send(&taken[i]) != 0) result = -3;
+  }
+  return result;
+}
+
+/**
+ * Sends the destination's open batch now
+ *
+ * @returns 0 | -3 if the batch could not be queued
+ */
+int XBeeBatcher::flush(uint64_t address) {
+  batch_t taken;
+  bool sending = false;
+  _mutex.lock();
+  for (int i = 0; i < XBEE_BATCH_DESTINATIONS; i++) {
+    if (_batches[i].active && (_batches[i].address == address)) sending = _take(&_batches[i], &taken);
+  }
+  _mutex.unlock();
+  return sending ? _send(&taken) : 0;
+}
+
+/**
+ * Sets the longest a message waits in an open batch. Batches already open
+ * keep their deadline.
+ */
+void XBeeBatcher::set_flush_deadline(std::chrono::milliseconds deadline) {
+  _mutex.lock();
+  _deadline = deadline;
+  _mutex.unlock();
+}
+
+/**
+ * Subscribes to 0x90 and 0x81 packets and passes each message in them to
+ * handler(address, message, length) on the receive thread: every message of
+ * a batch in turn, or the whole payload of a packet that is not a batch.
+ * A null handler unsubscribes.
+ *
+ * @returns false if another layer or subscriber already receives 0x90 or
+ * 0x81 packets; the handler is then never called
+ */
+bool XBeeBatcher::set_receive_handler(Callback<void(uint64_t, const char*, int)> handler) {
+  _mutex.lock();
+  _receiveHandler = handler;
+  _mutex.unlock();
+  if (handler && !_subscribed) {
+    _subscribed = _parser->subscribe_packets(callback(this, &XBeeBatcher::_on_packet));
+  } else if (!handler && _subscribed) {
+    _parser->unsubscribe_packets();
+    _subscribed = false;
+  }
+  return _subscribed || !handler;
+}
+
+/**
+ * @returns true if the payload is a well formed batch
+ */
+bool XBeeBatcher::is_batch(const char* payload, int len) {
+  if ((len < 1) || ((uint8_t) payload[0] != XBEE_BATCH_MARKER)) return false;
+  int offset = 1;
+  while (offset < len) offset += 1 + (uint8_t) payload[offset];
+  return offset == len; // Records must end exactly at the end of the payload
+}
+
+/**
+ * Steps through the messages of a batch checked with is_batch. Start with
+ * *offset = 0.
+ *
+ * @returns length of the next message, with *message pointing at it inside
+ * payload | -1 after the last one
+ */
+int XBeeBatcher::next_message(const char* payload, int len, int* offset, const char** message) {
+  if (*offset == 0) *offset = 1; // Skip the marker
+  if (*offset >= len) return -1;
+  int n = (uint8_t) payload[*offset];
+  *message = &payload[*offset + 1];
+  *offset += 1 + n;
+  return n;
+}
+
+/**
+ * @returns messages sent in batches so far
+ */
+uint32_t XBeeBatcher::messages_sent() {
+  return _messagesSent;
+}
+
+/**
+ * @returns batch frames sent so far
+ */
+uint32_t XBeeBatcher::frames_sent() {
+  return _framesSent;
+}
+
+/**
+ * @returns frames (and with them radio ACKs and 0x89 statuses) that sending
+ * every message on its own would have taken on top of frames_sent
+ */
+uint32_t XBeeBatcher::frames_saved() {
+  _mutex.lock();
+  uint32_t saved = _messagesSent - _framesSent;
+  _mutex.unlock();
+  return saved;
+}
+
+/**
+ * @returns batch frames whose status reported a failure; all their messages
+ * were lost
+ */
+uint32_t XBeeBatcher::failed_frames() {
+  _mutex.lock();
+  uint32_t failed = _failedFrames;
+  _mutex.unlock();
+  return failed;
+}
+
+/**
+ * @returns serial port bytes saved: the TX request overhead of every frame
+ * saved, less the marker and length bytes batching adds
+ */
+int32_t XBeeBatcher::serial_bytes_saved() {
+  _mutex.lock();
+  int32_t saved = (int32_t) (_messagesSent - _framesSent) * XBEE_BATCH_SERIAL_OVERHEAD
+                  - (int32_t) (_messagesSent + _framesSent);
+  _mutex.unlock();
+  return saved;
+}
+
+/**
+ * @returns estimated airtime saved in us, from XBEE_BATCH_AIRTIME_OVERHEAD_US
+ * per frame saved less the airtime of the bytes batching adds
+ */
+int32_t XBeeBatcher::airtime_saved_us() {
+  _mutex.lock();
+  int32_t saved = (int32_t) (_messagesSent - _framesSent) * XBEE_BATCH_AIRTIME_OVERHEAD_US
+                  - (int32_t) (_messagesSent + _framesSent) * XBEE_BATCH_US_PER_BYTE;
+  _mutex.unlock();
+  return saved;
+}
+
+/**
+ * Deadline thread. Sends batches whose deadline has passed and sleeps until
+ * the next one is due or a new batch opens.
+ */
+void XBeeBatcher::_run() {
+  batch_t taken[XBEE_BATCH_DESTINATIONS];
+  while (!_stop) {
+    bool open = false;
+    int count = 0;
+    Kernel::Clock::time_point next = Kernel::Clock::now();
+    _mutex.lock();
+    Kernel::Clock::time_point now = Kernel::Clock::now();
+    for (int i = 0; i < XBEE_BATCH_DESTINATIONS; i++) {
+      batch_t* batch = &_batches[i];
+      if (!batch->active) continue;
+      if (batch->deadline <= now) {
+        if (_take(batch, &taken[count])) count++;
+      } else if (!open || (batch->deadline < next)) {
+        next = batch->deadline;
+        open = true;
+      }
+    }
+    _mutex.unlock();
+    for (int i = 0; i < count; i++) _send(&taken[i]);
+    if (open) _events.wait_any_until(XBEE_BATCH_WAKE_FLAG, next);
+    else _events.wait_any(XBEE_BATCH_WAKE_FLAG);
+  }
+}
+
+/**
+ * Closes a batch and copies it out of its slot, so it can be sent once the
+ * mutex is released and the slot reused meanwhile. The mutex must be held.
+ *
+ * @returns true if the batch has messages to send
+ */
+bool XBeeBatcher::_take(batch_t* batch, batch_t* taken) {
+  if (!batch->active) return false;
+  batch->active = false;
+  if (batch->messages == 0) return false;
+  _messagesSent += batch->messages;
+  _framesSent++;
+  _outstanding++;
+  taken->address = batch->address;
+  taken->used = batch->used;
+  memcpy(taken->data, batch->data, batch->used);
+  return true;
+}
+
+/**
+ * Sends a batch taken out of its slot. The mutex must not be held, since
+ * txStream blocks while the transmit window is full.
+ *
+ * @returns 0 | -3 if it could not be queued
+ */
+int XBeeBatcher::_send(batch_t* taken) {
+  int frameID = _parser->txStream(taken->address, taken->data, taken->used, callback(&XBeeBatcher::_batch_sent, this));
+  if (frameID == -1) { // Rejected before queueing, so _batch_sent never runs
+    _mutex.lock();
+    _outstanding--;
+    _idle.notify_all();
+    _mutex.unlock();
+  }
+  return (frameID < 0) ? -3 : 0;
+}
+
+/**
+ * txStream delivery callback; runs on the receive thread. The batcher may be
+ * destroyed as soon as the mutex is released.
+ */
+void XBeeBatcher::_batch_sent(XBeeBatcher* batcher, int result) {
+  batcher->_mutex.lock();
+  if (result != 0) batcher->_failedFrames++;
+  batcher->_outstanding--;
+  batcher->_idle.notify_all();
+  batcher->_mutex.unlock();
+}
+
+/**
+ * Subscriber for 0x90 and 0x81 frames; runs on the receive thread
+ */
+void XBeeBatcher::_on_packet(const apiFrame_t* frame) {
+  uint64_t address;
+  const char* payload;
+  int len = _parser->packet_source(frame, &address, &payload);
+  if (len < 0) return;
+  _mutex.lock();
+  Callback<void(uint64_t, const char*, int)> handler = _receiveHandler;
+  _mutex.unlock();
+  if (!handler) return;
+  if (!is_batch(payload, len)) {
+    handler(address, payload, len);
+    return;
+  }
+  int offset = 0;
+  const char* message;
+  int n;
+  while ((n = next_message(payload, len, &offset, &message)) >= 0) handler(address, message, n);
+}
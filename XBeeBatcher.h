@@ -0,0 +1,95 @@
+/** Transmit batching for XBeeAPIParser
+ *
+ *  Packs small messages for the same destination into one TX request, so a
+ *  stream of tiny readings costs one frame header, radio ACK and 0x89
+ *  status per batch instead of per message. A batch goes out when the next
+ *  message would not fit, when its flush deadline passes or on flush().
+ *
+ *  A batch payload is XBEE_BATCH_MARKER followed by one record per message:
+ *  a length byte and the message bytes. is_batch() and next_message() split
+ *  it again on the receiving side.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_BATCHER_H
+#define XBEE_BATCHER_H
+
+#include "XBeeAPIParser.h"
+
+#define XBEE_BATCH_MARKER 0xB5
+// Largest batch; it has to fit a 0x90 frame after its 11 byte header
+#define XBEE_BATCH_MAX_PAYLOAD (MAX_FRAME_LENGTH - 11)
+// Largest message: the batch marker and the record's length byte come first
+#define XBEE_BATCH_MAX_MESSAGE (XBEE_BATCH_MAX_PAYLOAD - 2)
+// Destinations that may have a batch open at once
+#ifndef XBEE_BATCH_DESTINATIONS
+#define XBEE_BATCH_DESTINATIONS 4
+#endif
+#define XBEE_BATCH_STACK_SIZE 2048
+// Bytes a 64-bit TX request adds to its payload on the serial port: start
+// delimiter, length, type, frame ID, address, options and checksum
+#define XBEE_BATCH_SERIAL_OVERHEAD 15
+// Estimated airtime of one 802.15.4 frame beyond its payload at 250 kbps:
+// PHY and MAC headers with 64-bit addresses (29 bytes), mean CSMA backoff,
+// RX/TX turnaround and the ACK frame
+#define XBEE_BATCH_AIRTIME_OVERHEAD_US 2600
+#define XBEE_BATCH_US_PER_BYTE 32
+
+#define XBEE_BATCH_WAKE_FLAG 0x01
+
+typedef struct {
+    bool active;
+    uint64_t address;
+    int used;
+    int messages;
+    Kernel::Clock::time_point deadline;
+    char data[XBEE_BATCH_MAX_PAYLOAD];
+} batch_t;
+
+class XBeeBatcher
+{
+private:
+    XBeeAPIParser* _parser;
+    Mutex _mutex;
+    ConditionVariable _idle;
+    batch_t _batches[XBEE_BATCH_DESTINATIONS];
+    std::chrono::milliseconds _deadline;
+    // Counters and _receiveHandler, guarded by _mutex
+    uint32_t _messagesSent;
+    uint32_t _framesSent;
+    uint32_t _failedFrames;
+    uint32_t _outstanding; // Batches whose status _batch_sent has yet to see
+    bool _subscribed; // Owns the parser's 0x90 and 0x81 subscriptions
+    Callback<void(uint64_t, const char*, int)> _receiveHandler;
+    EventFlags _events;
+    volatile bool _stop;
+    Thread _thread;
+
+    void _run();
+    bool _take(batch_t* batch, batch_t* taken);
+    int _send(batch_t* taken);
+    static void _batch_sent(XBeeBatcher* batcher, int result);
+    void _on_packet(const apiFrame_t* frame);
+
+public:
+    XBeeBatcher(XBeeAPIParser* parser, std::chrono::milliseconds deadline = 20ms);
+    ~XBeeBatcher();
+    XBeeBatcher(const XBeeBatcher&) = delete;
+    XBeeBatcher& operator=(const XBeeBatcher&) = delete;
+    int send(uint64_t address, const char* data, int len);
+    int flush();
+    int flush(uint64_t address);
+    void set_flush_deadline(std::chrono::milliseconds deadline);
+    bool set_receive_handler(Callback<void(uint64_t, const char*, int)> handler);
+    static bool is_batch(const char* payload, int len);
+    static int next_message(const char* payload, int len, int* offset, const char** message);
+    uint32_t messages_sent();
+    uint32_t frames_sent();
+    uint32_t frames_saved();
+    uint32_t failed_frames();
+    int32_t serial_bytes_saved();
+    int32_t airtime_saved_us();
+};
+
+#endif
@@ -0,0 +1,554 @@
+#include "XBeeBenchmark.h"
+#include <algorithm>
+
+#define XBEE_BENCH_ADDRESS 0x0013A20040000002
+#define XBEE_BENCH_NI "BENCH"
+
+/**
+ * @brief Construct a new benchmark for a parser whose serial port is the
+ * given simulated modem
+ */
+XBeeBenchmark::XBeeBenchmark(XBeeAPIParser* parser, XBeeSimModem* modem) {
+  _parser = parser;
+  _modem = modem;
+  _sampleCount = 0;
+  _consumersDone = false;
+}
+
+/**
+ * Writes TX requests with frame ID 0 (no status) back to back
+ */
+xbeeBenchResult_t XBeeBenchmark::send(int frames) {
+  xbeeBenchResult_t result = {"send", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  apiFrame_t frame;
+  char payload[32];
+  memset(payload, 0x5A, sizeof(payload));
+  frame.type = 0x00;
+  frame.id = 0x00;
+  for (int i = 0; i < 8; i++) frame.data[i] = (XBEE_BENCH_ADDRESS >> (56 - 8*i)) & 0xFF;
+  frame.data[8] = 0x00;
+  memcpy(&frame.data[9], payload, sizeof(payload));
+  frame.length = 9 + sizeof(payload);
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < frames; i++) {
+    uint32_t t = _modem->now_us();
+    if (!_parser->send(&frame)) result.failures++;
+    _sample(_modem->now_us() - t);
+    result.operations++;
+  }
+  _finish(&result, _modem->now_us() - start);
+  return result;
+}
+
+/**
+ * Sends addressed packets one at a time, each waiting for its TX status
+ */
+xbeeBenchResult_t XBeeBenchmark::tx_addressed(int frames) {
+  xbeeBenchResult_t result = {"txAddressed", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  char payload[32];
+  memset(payload, 0x5A, sizeof(payload));
+  uint32_t lost = _modem->responses_lost();
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < frames; i++) {
+    uint32_t t = _modem->now_us();
+    if (_parser->txAddressed(XBEE_BENCH_ADDRESS, payload, sizeof(payload)) != 0) result.failures++;
+    _sample(_modem->now_us() - t);
+    result.operations++;
+  }
+  _finish(&result, _modem->now_us() - start);
+  result.drops = _modem->responses_lost() - lost;
+  return result;
+}
+
+/**
+ * Has the modem generate receive packets at the given rate and polls
+ * rxPacket for them. Latency runs from the modem generating a packet to
+ * rxPacket returning it, so it includes the 1ms polling interval.
+ */
+xbeeBenchResult_t XBeeBenchmark::rx_packet(int frames, float framesPerSecond) {
+  xbeeBenchResult_t result = {"rxPacket", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  char payload[MAX_FRAME_LENGTH];
+  uint64_t address;
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  _modem->start_rx_traffic(framesPerSecond, 16, frames);
+  // Allow the traffic its nominal duration plus a second to drain
+  uint32_t limit = (uint32_t) (1000000.0f * frames / framesPerSecond) + 1000000;
+  while ((result.operations < (uint32_t) frames) && (_modem->now_us() - start < limit)) {
+    int n = _parser->rxPacket(payload, &address);
+    if (n >= 4) {
+      uint32_t stamp;
+      memcpy(&stamp, payload, 4);
+      _sample(_modem->now_us() - stamp);
+      result.operations++;
+    } else {
+      ThisThread::sleep_for(1ms);
+    }
+  }
+  _finish(&result, _modem->now_us() - start);
+  _modem->stop_rx_traffic();
+  result.drops = frames - result.operations;
+  return result;
+}
+
+/**
+ * Resolves a node identifier with the address cache flushed, i.e. three AT
+ * round trips per lookup
+ */
+xbeeBenchResult_t XBeeBenchmark::get_address(int lookups) {
+  xbeeBenchResult_t result = {"get_address", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  _modem->add_node(XBEE_BENCH_NI, XBEE_BENCH_ADDRESS);
+  uint32_t lost = _modem->responses_lost();
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < lookups; i++) {
+    _parser->flush_address_cache();
+    uint32_t t = _modem->now_us();
+    if (_parser->get_address(XBEE_BENCH_NI) != XBEE_BENCH_ADDRESS) result.failures++;
+    _sample(_modem->now_us() - t);
+    result.operations++;
+  }
+  _finish(&result, _modem->now_us() - start);
+  result.drops = _modem->responses_lost() - lost;
+  return result;
+}
+
+/**
+ * Feeds receive packets as fast as the receive thread takes them and counts
+ * them in a subscriber, which measures the parser on its own. Latency runs
+ * from the modem generating a packet to the subscriber seeing it.
+ */
+xbeeBenchResult_t XBeeBenchmark::rx_parser(int frames, int payloadLength) {
+  xbeeBenchResult_t result = {"rx parser", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  if (payloadLength < 4) payloadLength = 4;
+  xbeeMetrics_t before, after;
+  _parser->metrics(&before);
+  if (!_parser->subscribe(0x90, callback(&XBeeBenchmark::_count_frame, this))) {
+    result.failures = frames;
+    return result;
+  }
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  _modem->start_rx_traffic(0, payloadLength, frames);
+  uint32_t last = start;
+  uint32_t seen = 0;
+  // Finish once every frame is in or nothing has arrived for 100ms
+  while ((_sampleCount < (uint32_t) frames) && (_modem->now_us() - last < 100000)) {
+    ThisThread::sleep_for(1ms);
+    if (_sampleCount != seen) {
+      seen = _sampleCount;
+      last = _modem->now_us();
+    }
+  }
+  result.operations = _sampleCount;
+  _finish(&result, last - start);
+  _parser->unsubscribe(0x90);
+  _modem->stop_rx_traffic();
+  _parser->metrics(&after);
+  result.failures = after.checksumErrors - before.checksumErrors;
+  result.drops = frames - result.operations;
+  return result;
+}
+
+/**
+ * Sends messages through an XBeeMessageLayer with the modem looping every
+ * packet back, so each one is fragmented, acknowledged and reassembled.
+ * Latency runs from send_message to the message being received; goodput
+ * counts message bytes that arrived intact.
+ */
+xbeeBenchResult_t XBeeBenchmark::message(int messages, int size) {
+  xbeeBenchResult_t result = {"message", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  if ((size <= 0) || (size > XBEE_MSG_MAX_SIZE)) size = XBEE_MSG_MAX_SIZE;
+  // Buffers are too big for most thread stacks
+  XBeeMessageLayer* layer = new XBeeMessageLayer(_parser);
+  char* sent = new char[size];
+  char* received = new char[size];
+  _modem->set_loopback(true);
+  _sampleCount = 0;
+  uint32_t delivered = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < messages; i++) {
+    for (int j = 0; j < size; j++) sent[j] = i + j * 7;
+    uint32_t t = _modem->now_us();
+    uint64_t address = 0;
+    if (layer->send_message(XBEE_BENCH_ADDRESS, sent, size) != 0) result.failures++;
+    int n = layer->receive_message(&address, received, size, Kernel::Clock::now() + 1s);
+    result.operations++;
+    if ((n != size) || (address != XBEE_BENCH_ADDRESS) || (memcmp(sent, received, size) != 0)) {
+      result.drops++;
+      continue;
+    }
+    _sample(_modem->now_us() - t);
+    delivered += size;
+  }
+  uint32_t elapsed = _modem->now_us() - start;
+  _finish(&result, elapsed);
+  if (elapsed > 0) result.bytesPerSecond = 1000000.0f * delivered / elapsed;
+  _modem->set_loopback(false);
+  delete layer;
+  delete[] sent;
+  delete[] received;
+  return result;
+}
+
+/**
+ * Feeds receive packets as fast as the receive thread takes them to several
+ * application threads competing for the frame buffer, each blocking in 
+ * wait_for_frame. The data lane blocks the producer for the run and is put
+ * back to XBEE_DROP_OLDEST afterwards. Failures count mutex timeouts, which
+ * consumer contention should never cause. Latency runs from the modem generating a packet to a 
+ * consumer taking it.
+ */
+xbeeBenchResult_t XBeeBenchmark::rx_consumers(int frames, int consumers) {
+  xbeeBenchResult_t result = {"rx consumers", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  if (consumers < 1) consumers = 1;
+  if (consumers > XBEE_BENCH_MAX_CONSUMERS) consumers = XBEE_BENCH_MAX_CONSUMERS;
+  xbeeMetrics_t before, after;
+  _parser->metrics(&before);
+  // Pace the burst to the consumers rather than measuring evictions
+  _parser->set_overflow_policy(XBEE_LANE_DATA, XBEE_BLOCK_PRODUCER);
+  Thread* threads[XBEE_BENCH_MAX_CONSUMERS];
+  _sampleCount = 0;
+  _consumersDone = false;
+  for (int i = 0; i < consumers; i++) {
+    threads[i] = new Thread(osPriorityNormal, XBEE_BENCH_STACK_SIZE, NULL, "XBeeBenchConsumer");
+    threads[i]->start(callback(&XBeeBenchmark::_consume, this));
+  }
+  uint32_t start = _modem->now_us();
+  _modem->start_rx_traffic(0, 16, frames);
+  uint32_t last = start;
+  uint32_t seen = 0;
+  // Finish once every frame is in or nothing has arrived for 100ms
+  while ((_sampleCount < (uint32_t) frames) && (_modem->now_us() - last < 100000)) {
+    ThisThread::sleep_for(1ms);
+    if (_sampleCount != seen) {
+      seen = _sampleCount;
+      last = _modem->now_us();
+    }
+  }
+  result.operations = _sampleCount;
+  _finish(&result, last - start);
+  _modem->stop_rx_traffic();
+  _consumersDone = true;
+  for (int i = 0; i < consumers; i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  _parser->set_overflow_policy(XBEE_LANE_DATA, XBEE_DROP_OLDEST);
+  _parser->metrics(&after);
+  result.failures = after.mutexTimeouts - before.mutexTimeouts;
+  result.drops = frames - result.operations;
+  return result;
+}
+
+/**
+ * Sends packets through an XBeeReliableLink in loopback. With modem loss
+ * set, a lost 0x89 status makes the link send a packet the radio already
+ * delivered, so every loss is a duplicate to suppress. Operations count
+ * packets received once; failures count packets given up and drops those
+ * never received.
+ */
+xbeeBenchResult_t XBeeBenchmark::reliable(int packets) {
+  xbeeBenchResult_t result = {"reliable", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  XBeeReliableLink* link = new XBeeReliableLink(_parser);
+  link->set_receive_handler(callback(&XBeeBenchmark::_count_message, this));
+  _modem->set_loopback(true);
+  char payload[32];
+  memset(payload, 0x5A, sizeof(payload));
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < packets; i++) {
+    uint32_t t = _modem->now_us();
+    memcpy(payload, &t, 4);
+    if (link->send(XBEE_BENCH_ADDRESS, payload, sizeof(payload)) < 0) result.failures++;
+  }
+  link->flush();
+  uint32_t elapsed = _modem->now_us() - start;
+  result.operations = link->frames_received();
+  _finish(&result, elapsed);
+  result.failures += link->frames_failed();
+  result.drops = packets - result.operations;
+  _modem->set_loopback(false);
+  delete link;
+  return result;
+}
+
+/**
+ * Decodes a full 0x82 I/O sample frame (D0-D3 and A0-A2) over and over.
+ * Operations are frames; bytesPerSecond is sample data decoded per second.
+ */
+xbeeBenchResult_t XBeeBenchmark::io_decode(int frames) {
+  xbeeBenchResult_t result = {"io_decode", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  const int stride = 8; // DIO word and three readings
+  int count = (MAX_FRAME_LENGTH - 13) / stride;
+  if (count > XBEE_IO_MAX_SAMPLES) count = XBEE_IO_MAX_SAMPLES;
+  apiFrame_t frame;
+  frame.type = 0x82;
+  frame.id = 0xFF;
+  for (int i = 0; i < 8; i++) frame.data[i] = (XBEE_BENCH_ADDRESS >> (56 - 8*i)) & 0xFF;
+  frame.data[8] = 0x28;
+  frame.data[9] = 0x00;
+  frame.data[10] = count;
+  frame.data[11] = 0x0E; // A0-A2
+  frame.data[12] = 0x0F; // D0-D3
+  for (int i = 0; i < count*stride; i++) frame.data[13 + i] = (i * 37) & 0x03;
+  frame.length = 13 + count*stride;
+  xbeeIOSamples_t* samples = new xbeeIOSamples_t;
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < frames; i++) {
+    uint32_t t = _modem->now_us();
+    if (_parser->decode_io_samples(&frame, samples)) result.operations++;
+    else result.failures++;
+    _sample(_modem->now_us() - t);
+  }
+  uint32_t elapsed = _modem->now_us() - start;
+  _finish(&result, elapsed);
+  if (elapsed > 0) result.bytesPerSecond = 1000000.0f * result.operations * count * stride / elapsed;
+  delete samples;
+  return result;
+}
+
+/**
+ * Sends packets with the modem looping each one back, with the parser and
+ * modem in AP=1 or AP=2, so escaping costs show up on both sides. One
+ * payload byte in eight must be escaped. Latency runs from sending a packet
+ * to its echo reaching a subscriber; the parser's own parse and encode rates
+ * come back in parseMBytesPerSecond and encodeMBytesPerSecond.
+ */
+xbeeBenchResult_t XBeeBenchmark::api_mode(int frames, int mode) {
+  xbeeBenchResult_t result = {(mode == 2) ? "AP=2 escaped" : "AP=1", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  const char escaped[4] = {0x7E, 0x7D, 0x11, 0x13};
+  apiFrame_t frame;
+  frame.type = 0x00;
+  frame.id = 0x00;
+  for (int i = 0; i < 8; i++) frame.data[i] = (XBEE_BENCH_ADDRESS >> (56 - 8*i)) & 0xFF;
+  frame.data[8] = 0x00;
+  for (int i = 0; i < 64; i++) frame.data[9 + i] = (i % 8 == 7) ? escaped[(i / 8) % 4] : 0x5A;
+  frame.length = 9 + 64;
+  if (!_parser->subscribe(0x90, callback(&XBeeBenchmark::_count_frame, this))) {
+    result.failures = frames;
+    return result;
+  }
+  int parserMode = _parser->api_mode();
+  int modemMode = _modem->api_mode();
+  _parser->set_api_mode(mode);
+  _modem->set_api_mode(mode);
+  _modem->set_loopback(true);
+  _parser->reset_rx_stats();
+  _parser->reset_tx_stats();
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < frames; i++) {
+    // Keep a few echoes in flight so the modem's buffer never overflows
+    uint32_t t = _modem->now_us();
+    while (((uint32_t) i - _sampleCount >= 8) && (_modem->now_us() - t < 100000)) ThisThread::sleep_for(1ms);
+    t = _modem->now_us();
+    memcpy(&frame.data[9], &t, 4);
+    if (!_parser->send(&frame)) result.failures++;
+  }
+  uint32_t last = _modem->now_us();
+  uint32_t seen = _sampleCount;
+  while ((_sampleCount < (uint32_t) frames) && (_modem->now_us() - last < 100000)) {
+    ThisThread::sleep_for(1ms);
+    if (_sampleCount != seen) {
+      seen = _sampleCount;
+      last = _modem->now_us();
+    }
+  }
+  result.operations = _sampleCount;
+  _finish(&result, last - start);
+  result.drops = frames - result.operations;
+  result.parseMBytesPerSecond = _parser->rx_parse_mbytes_per_second();
+  result.encodeMBytesPerSecond = _parser->tx_encode_mbytes_per_second();
+  _parser->unsubscribe(0x90);
+  _modem->set_loopback(false);
+  _parser->set_api_mode(parserMode);
+  _modem->set_api_mode(modemMode);
+  return result;
+}
+
+/**
+ * Sends CH, ID, SM and WR to a simulated fleet, either with one fan-out or
+ * one node and command at a time. Each sample is the time to configure the
+ * whole fleet; operations counts commands the nodes answered with OK.
+ */
+xbeeBenchResult_t XBeeBenchmark::remote_config(int rounds, int nodes, bool fanout) {
+  xbeeBenchResult_t result = {fanout ? "remote AT fan-out" : "remote AT serial", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  if (nodes > XBEE_BENCH_MAX_NODES) nodes = XBEE_BENCH_MAX_NODES;
+  const remoteATCommand_t commands[4] = {
+    {"CH", string("\x0C", 1)},
+    {"ID", string("\x33\x32", 2)},
+    {"SM", string("\x00", 1)},
+    {"WR", string()}
+  };
+  uint64_t addresses[XBEE_BENCH_MAX_NODES];
+  remoteATResult_t results[XBEE_BENCH_MAX_NODES * 4];
+  for (int n = 0; n < nodes; n++) {
+    char ni[8];
+    snprintf(ni, sizeof(ni), "NODE%d", n);
+    addresses[n] = XBEE_BENCH_ADDRESS + 0x100 + n;
+    _modem->add_node(ni, addresses[n]);
+  }
+  uint32_t lost = _modem->responses_lost();
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int r = 0; r < rounds; r++) {
+    uint32_t t = _modem->now_us();
+    if (fanout) {
+      _parser->remote_at_fanout(addresses, nodes, commands, 4, results);
+      for (int i = 0; i < nodes * 4; i++) {
+        if (results[i].status == 0) result.operations++;
+        else result.failures++;
+      }
+    } else {
+      XBeeFuture future;
+      for (int n = 0; n < nodes; n++) {
+        for (int c = 0; c < 4; c++) {
+          _parser->remote_at_request(addresses[n], commands[c].command, commands[c].parameter, &future, c == 3);
+          if ((future.wait() == XBEE_TXN_OK) && (future.response()->length >= 13) && (future.response()->data[12] == 0)) result.operations++;
+          else result.failures++;
+        }
+      }
+    }
+    _sample(_modem->now_us() - t);
+  }
+  _finish(&result, _modem->now_us() - start);
+  result.drops = _modem->responses_lost() - lost;
+  return result;
+}
+
+/**
+ * Sends small messages back to back with the modem looping them back, either
+ * one txStream frame each or packed by an XBeeBatcher, and counts them as
+ * they arrive. Operations are messages received, frames per second counts 
+ * messages, and latency runs from sending a message to receiving it.
+ */
+xbeeBenchResult_t XBeeBenchmark::batch(int messages, int size, bool batched) {
+  xbeeBenchResult_t result = {batched ? "batched" : "unbatched", 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  if (size < 4) size = 4;
+  if (size > XBEE_BATCH_MAX_MESSAGE) size = XBEE_BATCH_MAX_MESSAGE;
+  XBeeBatcher* batcher = new XBeeBatcher(_parser);
+  batcher->set_receive_handler(callback(&XBeeBenchmark::_count_message, this));
+  _modem->set_loopback(true);
+  char message[XBEE_BATCH_MAX_MESSAGE];
+  memset(message, 0x5A, size);
+  _sampleCount = 0;
+  uint32_t start = _modem->now_us();
+  for (int i = 0; i < messages; i++) {
+    uint32_t t = _modem->now_us();
+    memcpy(message, &t, 4);
+    int sent = batched ? batcher->send(XBEE_BENCH_ADDRESS, message, size) 
+                       : _parser->txStream(XBEE_BENCH_ADDRESS, message, size);
+    if (sent < 0) result.failures++;
+  }
+  batcher->flush();
+  uint32_t last = _modem->now_us();
+  uint32_t seen = _sampleCount;
+  // Finish once every message is in or nothing has arrived for 100ms
+  while ((_sampleCount < (uint32_t) messages) && (_modem->now_us() - last < 100000)) {
+    ThisThread::sleep_for(1ms);
+    if (_sampleCount != seen) {
+      seen = _sampleCount;
+      last = _modem->now_us();
+    }
+  }
+  _parser->txStreamFlush();
+  result.operations = _sampleCount;
+  _finish(&result, last - start);
+  if (last != start) result.bytesPerSecond = 1000000.0f * result.operations * size / (last - start);
+  result.failures += batcher->failed_frames();
+  result.drops = messages - result.operations;
+  _modem->set_loopback(false);
+  delete batcher;
+  return result;
+}
+
+void XBeeBenchmark::print(const xbeeBenchResult_t& result) {
+  printf("%-12s %8lu ops %10.1f frames/s  p50 %7lu us  p99 %7lu us  %5lu failed  %5lu dropped\r\n",
+         result.name, (unsigned long) result.operations, result.framesPerSecond,
+         (unsigned long) result.p50, (unsigned long) result.p99,
+         (unsigned long) result.failures, (unsigned long) result.drops);
+  if (result.bytesPerSecond > 0) printf("%-12s %10.1f bytes/s goodput\r\n", "", result.bytesPerSecond);
+  if (result.parseMBytesPerSecond > 0) {
+    printf("%-12s %10.2f MB/s parse %8.2f MB/s encode\r\n", "",
+           result.parseMBytesPerSecond, result.encodeMBytesPerSecond);
+  }
+}
+
+/**
+ * Runs every benchmark against the modem's current latency and loss
+ * settings and prints the results
+ */
+void XBeeBenchmark::run_all(int frames) {
+  print(send(frames));
+  print(tx_addressed(frames));
+  print(rx_packet(frames, 200));
+  print(get_address(frames / 10 + 1));
+  print(rx_parser(frames * 10, 16));
+  print(message(frames / 10 + 1, 1000));
+  print(rx_consumers(frames * 10, XBEE_BENCH_MAX_CONSUMERS));
+  print(batch(frames, 8, false));
+  print(batch(frames, 8, true));
+  print(remote_config(frames / 40 + 1, XBEE_BENCH_MAX_NODES, false));
+  print(remote_config(frames / 40 + 1, XBEE_BENCH_MAX_NODES, true));
+  print(io_decode(frames * 50));
+  print(api_mode(frames * 5, 1));
+  print(api_mode(frames * 5, 2));
+  print(reliable(frames));
+}
+
+/**
+ * Records a latency. Safe to call from several threads at once.
+ */
+void XBeeBenchmark::_sample(uint32_t us) {
+  uint32_t n = core_util_atomic_incr_u32(&_sampleCount, 1) - 1;
+  _samples[n % XBEE_BENCH_MAX_SAMPLES] = us;
+}
+
+/**
+ * Fills in rate and percentiles from the samples taken
+ */
+void XBeeBenchmark::_finish(xbeeBenchResult_t* result, uint32_t elapsed) {
+  if (elapsed > 0) result->framesPerSecond = 1000000.0f * result->operations / elapsed;
+  int n = (_sampleCount < XBEE_BENCH_MAX_SAMPLES) ? _sampleCount : XBEE_BENCH_MAX_SAMPLES;
+  if (n == 0) return;
+  std::sort(_samples, _samples + n);
+  result->p50 = _samples[(n - 1) / 2];
+  result->p99 = _samples[(n - 1) * 99 / 100];
+}
+
+/**
+ * Subscriber for rx_parser; runs on the receive thread
+ */
+void XBeeBenchmark::_count_frame(XBeeBenchmark* bench, const apiFrame_t* frame) {
+  uint32_t stamp;
+  memcpy(&stamp, &frame->data[11], 4);
+  bench->_sample(bench->_modem->now_us() - stamp);
+}
+
+/**
+ * Consumer thread for rx_consumers
+ */
+void XBeeBenchmark::_consume(XBeeBenchmark* bench) {
+  XBeeFrameHandle frame;
+  while (!bench->_consumersDone) {
+    if (!bench->_parser->wait_for_frame(0x90, 0xFF, Kernel::Clock::now() + 10ms, &frame)) continue;
+    uint32_t stamp;
+    memcpy(&stamp, &frame->data[11], 4);
+    frame.release();
+    bench->_sample(bench->_modem->now_us() - stamp);
+  }
+}
+
+/**
+ * Receive handler for batch; runs on the receive thread
+ */
+void XBeeBenchmark::_count_message(XBeeBenchmark* bench, uint64_t /* address */, const char* message, int len) {
+  if (len < 4) return;
+  uint32_t stamp;
+  memcpy(&stamp, message, 4);
+  bench->_sample(bench->_modem->now_us() - stamp);
+}
@@ -0,0 +1,78 @@
+/** Throughput and latency benchmarks for XBeeAPIParser
+ *
+ *  Drives a parser connected to an XBeeSimModem and reports frames per
+ *  second, median and 99th percentile latency and drops for the main entry
+ *  points, so a regression shows up as a number.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_BENCHMARK_H
+#define XBEE_BENCHMARK_H
+
+#include "XBeeAPIParser.h"
+#include "XBeeBatcher.h"
+#include "XBeeMessageLayer.h"
+#include "XBeeReliableLink.h"
+#include "XBeeSimModem.h"
+
+// Latency samples kept per benchmark; longer runs keep the most recent
+#ifndef XBEE_BENCH_MAX_SAMPLES
+#define XBEE_BENCH_MAX_SAMPLES 512
+#endif
+
+// Consumer threads for rx_consumers
+#define XBEE_BENCH_MAX_CONSUMERS 4
+#define XBEE_BENCH_STACK_SIZE 2048
+
+// Simulated nodes remote_config configures; the modem keeps one for
+// get_address
+#define XBEE_BENCH_MAX_NODES (XBEE_SIM_MAX_NODES - 1)
+
+typedef struct {
+    const char* name;
+    uint32_t operations;
+    uint32_t failures;
+    uint32_t drops;
+    float framesPerSecond;
+    uint32_t p50; // us
+    uint32_t p99; // us
+    float bytesPerSecond; // Application payload, for benchmarks that move messages
+    float parseMBytesPerSecond; // Parser and encoder throughput, for api_mode
+    float encodeMBytesPerSecond;
+} xbeeBenchResult_t;
+
+class XBeeBenchmark
+{
+private:
+    XBeeAPIParser* _parser;
+    XBeeSimModem* _modem;
+    uint32_t _samples[XBEE_BENCH_MAX_SAMPLES];
+    volatile uint32_t _sampleCount;
+    volatile bool _consumersDone;
+
+    void _sample(uint32_t us);
+    void _finish(xbeeBenchResult_t* result, uint32_t elapsed);
+    static void _count_frame(XBeeBenchmark* bench, const apiFrame_t* frame);
+    static void _consume(XBeeBenchmark* bench);
+    static void _count_message(XBeeBenchmark* bench, uint64_t address, const char* message, int len);
+
+public:
+    XBeeBenchmark(XBeeAPIParser* parser, XBeeSimModem* modem);
+    xbeeBenchResult_t send(int frames);
+    xbeeBenchResult_t tx_addressed(int frames);
+    xbeeBenchResult_t rx_packet(int frames, float framesPerSecond);
+    xbeeBenchResult_t get_address(int lookups);
+    xbeeBenchResult_t rx_parser(int frames, int payloadLength);
+    xbeeBenchResult_t message(int messages, int size);
+    xbeeBenchResult_t rx_consumers(int frames, int consumers);
+    xbeeBenchResult_t batch(int messages, int size, bool batched);
+    xbeeBenchResult_t reliable(int packets);
+    xbeeBenchResult_t remote_config(int rounds, int nodes, bool fanout);
+    xbeeBenchResult_t io_decode(int frames);
+    xbeeBenchResult_t api_mode(int frames, int mode);
+    void print(const xbeeBenchResult_t& result);
+    void run_all(int frames = 200);
+};
+
+#endif
@@ -0,0 +1,337 @@
+#include "XBeeCapture.h"
+#include <cerrno>
+
+/**
+ * @brief Construct a new capture writing to the given log, e.g. a file on
+ * an SD card. The magic is written straight away.
+ */
+XBeeCapture::XBeeCapture(FileHandle* log) {
+  _log = log;
+  memcpy(_buffer, "XBC1", 4);
+  _used = 4;
+  _lastTime = 0;
+  _records = 0;
+  _bytes = 0;
+  _writeErrors = 0;
+  _clock.start();
+}
+
+XBeeCapture::~XBeeCapture() {
+  flush();
+}
+
+/**
+ * Appends a time stamped record. Called by the parser for every read from
+ * and write to its serial port, so it only copies into the buffer; the log
+ * is written when the buffer fills.
+ */
+void XBeeCapture::record(int direction, const char* bytes, int len) {
+  if ((len <= 0) || (len > XBEE_CAPTURE_MAX_RECORD)) return;
+  char header[10];
+  _mutex.lock();
+  uint32_t now = _clock.elapsed_time().count();
+  int headerLen = _put_varint(now - _lastTime, header);
+  headerLen += _put_varint(((uint32_t) len << 1) | (direction & 1), &header[headerLen]);
+  _lastTime = now;
+  if (_used + headerLen + len > XBEE_CAPTURE_BUFFER_SIZE) _flush();
+  if (headerLen + len > XBEE_CAPTURE_BUFFER_SIZE) { // Too big to gather; write it through
+    if ((_log->write(header, headerLen) != headerLen) || (_log->write(bytes, len) != len)) _writeErrors++;
+  } else {
+    memcpy(&_buffer[_used], header, headerLen);
+    memcpy(&_buffer[_used + headerLen], bytes, len);
+    _used += headerLen + len;
+  }
+  _records++;
+  _bytes += len;
+  _mutex.unlock();
+}
+
+/**
+ * Writes out everything recorded so far
+ *
+ * @returns false if the log could not be written
+ */
+bool XBeeCapture::flush() {
+  _mutex.lock();
+  bool ok = _flush();
+  _mutex.unlock();
+  return ok;
+}
+
+uint32_t XBeeCapture::records() {
+  return _records;
+}
+
+uint32_t XBeeCapture::bytes_captured() {
+  return _bytes;
+}
+
+/**
+ * @returns number of times the log refused a write (the records are lost)
+ */
+uint32_t XBeeCapture::write_errors() {
+  return _writeErrors;
+}
+
+/**
+ * The mutex must be held.
+ */
+bool XBeeCapture::_flush() {
+  if (_used == 0) return true;
+  bool ok = _log->write(_buffer, _used) == _used;
+  if (!ok) _writeErrors++;
+  _used = 0;
+  return ok;
+}
+
+/**
+ * @returns bytes written to out (1 to 5)
+ */
+int XBeeCapture::_put_varint(uint32_t value, char* out) {
+  int n = 0;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+/**
+ * @brief Construct a new replay of a capture log
+ *
+ * @param log capture written by XBeeCapture
+ * @param realTime true to release received bytes with their original
+ * spacing (to the nearest ms), false to hand them over as fast as they are
+ * read
+ */
+XBeeReplaySource::XBeeReplaySource(FileHandle* log, bool realTime) :
+  _thread(osPriorityNormal, XBEE_REPLAY_STACK_SIZE, NULL, "XBeeReplaySource") {
+  _log = log;
+  _realTime = realTime;
+  _inPos = 0;
+  _inLen = 0;
+  _logEnded = false;
+  _readyHead = 0;
+  _readyCount = 0;
+  _recordLen = 0;
+  _recordTime = 0;
+  _logTime = 0;
+  _replayed = 0;
+  _skipped = 0;
+  _overruns = 0;
+  _blocking = true;
+  _stop = false;
+  _valid = true;
+  for (int i = 0; (i < 4) && _valid; i++) {
+    _valid = _get_byte() == "XBC1"[i];
+  }
+  if (!_valid) _logEnded = true;
+  _clock.start();
+  if (_realTime && _valid) _thread.start(callback(this, &XBeeReplaySource::_run));
+}
+
+XBeeReplaySource::~XBeeReplaySource() {
+  if (_realTime && _valid) {
+    _stop = true;
+    _events.set(XBEE_REPLAY_WAKE_FLAG);
+    _thread.join();
+  }
+}
+
+/**
+ * @returns bytes read | -EAGAIN if non-blocking and nothing has been
+ * released yet | 0 once the whole capture has been read
+ */
+ssize_t XBeeReplaySource::read(void* buffer, size_t size) {
+  while (true) {
+    _mutex.lock();
+    if (!_realTime) { // Top up straight from the log
+      while ((_recordLen > 0) || (!_logEnded && _load_record())) {
+        if (!_release_record()) break;
+      }
+    }
+    int n = ((size_t) _readyCount < size) ? _readyCount : (int) size;
+    for (int i = 0; i < n; i++) {
+      ((char*) buffer)[i] = _ready[_readyHead];
+      _readyHead = (_readyHead + 1) % XBEE_REPLAY_BUFFER_SIZE;
+    }
+    _readyCount -= n;
+    bool ended = _logEnded && (_recordLen == 0) && (_readyCount == 0);
+    _mutex.unlock();
+    if (n > 0) return n;
+    if (ended) return _blocking ? 0 : -EAGAIN;
+    if (!_blocking) return -EAGAIN;
+    _events.wait_any(XBEE_REPLAY_READ_FLAG);
+  }
+}
+
+/**
+ * Discards what the parser sends; the capture already holds the replies
+ */
+ssize_t XBeeReplaySource::write(const void* /* buffer */, size_t size) {
+  return size;
+}
+
+bool XBeeReplaySource::readable() const {
+  return _readyCount > 0;
+}
+
+int XBeeReplaySource::set_blocking(bool blocking) {
+  _blocking = blocking;
+  return 0;
+}
+
+bool XBeeReplaySource::is_blocking() const {
+  return _blocking;
+}
+
+/**
+ * Registers the data available callback. Without real time replay the
+ * whole capture is available at once, so it is called straight away.
+ */
+void XBeeReplaySource::sigio(Callback<void()> func) {
+  _sigio = func;
+  if (!_realTime && func) func();
+}
+
+/**
+ * @returns false if the log is not a capture
+ */
+bool XBeeReplaySource::valid() {
+  return _valid;
+}
+
+/**
+ * @returns true once every received byte in the capture has been read
+ */
+bool XBeeReplaySource::finished() {
+  _mutex.lock();
+  bool ended = _logEnded && (_recordLen == 0) && (_readyCount == 0);
+  _mutex.unlock();
+  return ended;
+}
+
+uint32_t XBeeReplaySource::bytes_replayed() {
+  return _replayed;
+}
+
+/**
+ * @returns bytes the parser sent in the original capture
+ */
+uint32_t XBeeReplaySource::tx_bytes_skipped() {
+  return _skipped;
+}
+
+/**
+ * @returns received records dropped in real time replay because the
+ * parser had not read the previous ones
+ */
+uint32_t XBeeReplaySource::overruns() {
+  return _overruns;
+}
+
+/**
+ * @returns next byte of the log | -1 at its end
+ */
+int XBeeReplaySource::_get_byte() {
+  if (_inPos == _inLen) {
+    ssize_t n = _log->read(_in, sizeof(_in));
+    if (n <= 0) return -1;
+    _inPos = 0;
+    _inLen = n;
+  }
+  return (uint8_t) _in[_inPos++];
+}
+
+bool XBeeReplaySource::_get_varint(uint32_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    int c = _get_byte();
+    if (c < 0) return false;
+    *value |= (uint32_t) (c & 0x7F) << shift;
+    if ((c & 0x80) == 0) return true;
+  }
+  return false; // Corrupt
+}
+
+/**
+ * Reads records up to and including the next received one, skipping the
+ * parser's own transmissions. The mutex must be held.
+ *
+ * @returns false at the end of the log
+ */
+bool XBeeReplaySource::_load_record() {
+  uint32_t delta, lenDir;
+  while (_get_varint(&delta) && _get_varint(&lenDir)) {
+    int len = lenDir >> 1;
+    if (len > XBEE_CAPTURE_MAX_RECORD) break; // Corrupt
+    _logTime += delta;
+    int got = 0;
+    int c = 0;
+    while ((got < len) && ((c = _get_byte()) >= 0)) _record[got++] = c;
+    if (got < len) break; // Truncated
+    if ((lenDir & 1) == XBEE_CAPTURE_TX) {
+      _skipped += len;
+      continue;
+    }
+    _recordLen = len;
+    _recordTime = _logTime;
+    return true;
+  }
+  _logEnded = true;
+  return false;
+}
+
+/**
+ * Moves the loaded record into the bytes the parser can read. The mutex
+ * must be held.
+ *
+ * @returns false if there is not room for it yet
+ */
+bool XBeeReplaySource::_release_record() {
+  if (XBEE_REPLAY_BUFFER_SIZE - _readyCount < _recordLen) return false;
+  int tail = (_readyHead + _readyCount) % XBEE_REPLAY_BUFFER_SIZE;
+  for (int i = 0; i < _recordLen; i++) {
+    _ready[tail] = _record[i];
+    tail = (tail + 1) % XBEE_REPLAY_BUFFER_SIZE;
+  }
+  _readyCount += _recordLen;
+  _replayed += _recordLen;
+  _recordLen = 0;
+  return true;
+}
+
+/**
+ * Real time replay thread. Releases each received record when its time
+ * since the start of the capture comes round.
+ */
+void XBeeReplaySource::_run() {
+  while (!_stop) {
+    _mutex.lock();
+    if ((_recordLen == 0) && !_load_record()) {
+      _mutex.unlock();
+      break;
+    }
+    uint64_t due = _recordTime;
+    _mutex.unlock();
+    uint64_t now = _clock.elapsed_time().count();
+    if (due > now) {
+      _events.wait_any_for(XBEE_REPLAY_WAKE_FLAG, std::chrono::milliseconds((due - now + 999) / 1000));
+      continue;
+    }
+    _mutex.lock();
+    if (!_release_record()) { // Parser too slow; the UART would have dropped it
+      _overruns++;
+      _recordLen = 0;
+    }
+    _mutex.unlock();
+    _notify();
+  }
+  _notify(); // Let a blocked reader see the end
+}
+
+void XBeeReplaySource::_notify() {
+  _events.set(XBEE_REPLAY_READ_FLAG);
+  if (_sigio) _sigio();
+}
@@ -0,0 +1,119 @@
+/** Raw serial capture and replay for XBeeAPIParser
+ *
+ *  XBeeCapture appends the bytes the parser reads from and writes to its
+ *  serial port, time stamped, to a compact binary log. XBeeReplaySource
+ *  plays the received side of such a log back to a parser, at the original
+ *  timing or as fast as the parser can take it.
+ *
+ *  Log format: the magic "XBC1", then one record per read or write:
+ *  varint microseconds since the previous record, varint (length << 1 |
+ *  direction), then the bytes. Varints are little endian base 128.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_CAPTURE_H
+#define XBEE_CAPTURE_H
+
+#include "XBeePlatform.h"
+
+#define XBEE_CAPTURE_RX 0
+#define XBEE_CAPTURE_TX 1
+
+// Records are gathered here and written to the log when it fills
+#ifndef XBEE_CAPTURE_BUFFER_SIZE
+#define XBEE_CAPTURE_BUFFER_SIZE 512
+#endif
+// Bytes the replay source holds for the parser to read
+#ifndef XBEE_REPLAY_BUFFER_SIZE
+#define XBEE_REPLAY_BUFFER_SIZE 512
+#endif
+#define XBEE_CAPTURE_MAX_RECORD 512
+#define XBEE_REPLAY_STACK_SIZE 2048
+
+#define XBEE_REPLAY_WAKE_FLAG 0x01
+#define XBEE_REPLAY_READ_FLAG 0x02
+
+class XBeeCapture
+{
+private:
+    FileHandle* _log;
+    Mutex _mutex;
+    char _buffer[XBEE_CAPTURE_BUFFER_SIZE];
+    int _used;
+    Timer _clock;
+    uint32_t _lastTime;
+    uint32_t _records;
+    uint32_t _bytes;
+    uint32_t _writeErrors;
+
+    bool _flush();
+    static int _put_varint(uint32_t value, char* out);
+
+public:
+    XBeeCapture(FileHandle* log);
+    ~XBeeCapture();
+    void record(int direction, const char* bytes, int len);
+    bool flush();
+    uint32_t records();
+    uint32_t bytes_captured();
+    uint32_t write_errors();
+};
+
+class XBeeReplaySource : public FileHandle
+{
+private:
+    FileHandle* _log;
+    bool _realTime;
+    bool _valid;
+    // Buffered reads of the log
+    char _in[128];
+    int _inPos;
+    int _inLen;
+    bool _logEnded;
+    // Received bytes released to the parser
+    Mutex _mutex;
+    char _ready[XBEE_REPLAY_BUFFER_SIZE];
+    int _readyHead;
+    int _readyCount;
+    // Next received record, loaded but not yet released
+    char _record[XBEE_CAPTURE_MAX_RECORD];
+    int _recordLen;
+    uint64_t _recordTime; // us since the start of the capture
+    uint64_t _logTime;
+    uint32_t _replayed;
+    uint32_t _skipped;
+    uint32_t _overruns;
+    bool _blocking;
+    Callback<void()> _sigio;
+    Timer _clock;
+    EventFlags _events;
+    volatile bool _stop;
+    Thread _thread;
+
+    int _get_byte();
+    bool _get_varint(uint32_t* value);
+    bool _load_record();
+    bool _release_record();
+    void _run();
+    void _notify();
+
+public:
+    XBeeReplaySource(FileHandle* log, bool realTime = false);
+    ~XBeeReplaySource();
+    XBeeReplaySource(const XBeeReplaySource&) = delete;
+    XBeeReplaySource& operator=(const XBeeReplaySource&) = delete;
+    ssize_t read(void* buffer, size_t size) override;
+    ssize_t write(const void* buffer, size_t size) override;
+    bool readable() const override;
+    int set_blocking(bool blocking) override;
+    bool is_blocking() const override;
+    void sigio(Callback<void()> func) override;
+    bool valid();
+    bool finished();
+    uint32_t bytes_replayed();
+    uint32_t tx_bytes_skipped();
+    uint32_t overruns();
+};
+
+#endif
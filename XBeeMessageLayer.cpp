@@ -0,0 +1,400 @@
+#include "XBeeMessageLayer.h"
+
+static_assert(XBEE_MSG_FRAGMENT_DATA > 0, "MAX_FRAME_LENGTH leaves no room for message fragments");
+static_assert(XBEE_MSG_MAX_FRAGMENTS <= 255, "XBEE_MSG_MAX_SIZE needs more than 255 fragments");
+
+/**
+ * @brief Construct a new message layer. It takes over 0x90 receive packets
+ * from the parser; packets that are not fragments go to the packet handler.
+ */
+XBeeMessageLayer::XBeeMessageLayer(XBeeAPIParser* parser) :
+  _slotsFree(XBEE_MAX_TX_WINDOW, XBEE_MAX_TX_WINDOW),
+  _messageReady(_mutex) {
+  _parser = parser;
+  _nextMessageID = 0;
+  for (int i = 0; i < XBEE_MAX_TX_WINDOW; i++) {
+    _slots[i].layer = this;
+    _slots[i].fragment = 0;
+    _slots[i].busy = false;
+  }
+  memset(_pendingMap, 0, sizeof(_pendingMap));
+  _sentBytes = 0;
+  _sendTime = 0;
+  _messagesSent = 0;
+  _sendFailures = 0;
+  _retransmits = 0;
+  for (int i = 0; i < XBEE_MSG_REASSEMBLY_SLOTS; i++) _reassembly[i].state = XBEE_MSG_FREE;
+  for (int i = 0; i < XBEE_MSG_COMPLETED_SENDERS; i++) _completed[i].valid = false;
+  _timeout = 2000ms;
+  _messagesReceived = 0;
+  _timeouts = 0;
+  _fragmentsDropped = 0;
+  _clock.start();
+  // Senders with a short address reach us in 0x81 frames
+  _subscribed = _parser->subscribe_packets(callback(this, &XBeeMessageLayer::_on_packet));
+}
+
+XBeeMessageLayer::~XBeeMessageLayer() {
+  if (_subscribed) _parser->unsubscribe_packets();
+}
+
+/**
+ * Sends a message of up to XBEE_MSG_MAX_SIZE bytes. Fragments go out through
+ * txStream, so the parser's transmit window sets how many are in flight;
+ * fragments that fail are sent again, up to XBEE_MSG_MAX_ATTEMPTS rounds.
+ *
+ * @returns 0 if every fragment was delivered | -1 if the message is empty or
+ * too long | -3 if fragments were still failing after the last round
+ */
+int XBeeMessageLayer::send_message(uint64_t address, const char* data, int len) {
+  if ((len <= 0) || (len > XBEE_MSG_MAX_SIZE)) return -1;
+  int fragments = (len + XBEE_MSG_FRAGMENT_DATA - 1) / XBEE_MSG_FRAGMENT_DATA;
+  char payload[XBEE_MSG_HEADER_SIZE + XBEE_MSG_FRAGMENT_DATA];
+  _sendMutex.lock();
+  uint32_t start = _clock.elapsed_time().count();
+  payload[0] = XBEE_MSG_MARKER;
+  payload[1] = _nextMessageID++;
+  payload[3] = fragments;
+  _mutex.lock();
+  for (int i = 0; i < fragments; i++) _pendingMap[i / 32] |= 1UL << (i % 32);
+  _mutex.unlock();
+  bool pending = true;
+  for (int attempt = 0; (attempt < XBEE_MSG_MAX_ATTEMPTS) && pending; attempt++) {
+    for (int i = 0; i < fragments; i++) {
+      _mutex.lock();
+      bool send = (_pendingMap[i / 32] >> (i % 32)) & 1;
+      _pendingMap[i / 32] &= ~(1UL << (i % 32)); // Set again if it fails
+      _mutex.unlock();
+      if (!send) continue;
+      if (attempt > 0) _retransmits++;
+      int offset = i * XBEE_MSG_FRAGMENT_DATA;
+      int n = (len - offset < XBEE_MSG_FRAGMENT_DATA) ? len - offset : XBEE_MSG_FRAGMENT_DATA;
+      payload[2] = i;
+      memcpy(&payload[XBEE_MSG_HEADER_SIZE], &data[offset], n);
+      _slotsFree.acquire();
+      messageSlot_t* slot = NULL;
+      for (int j = 0; (j < XBEE_MAX_TX_WINDOW) && (slot == NULL); j++) {
+        if (!_slots[j].busy) slot = &_slots[j];
+      }
+      slot->busy = true;
+      slot->fragment = i;
+      int frameID = _parser->txStream(address, payload, XBEE_MSG_HEADER_SIZE + n, callback(&XBeeMessageLayer::_fragment_sent, slot));
+      if ((frameID < 0) && slot->busy) { // Never queued, so no status will come
+        _fragment_sent(slot, -3);
+      }
+    }
+    // Wait for every fragment of this round to report
+    for (int j = 0; j < XBEE_MAX_TX_WINDOW; j++) _slotsFree.acquire();
+    for (int j = 0; j < XBEE_MAX_TX_WINDOW; j++) _slotsFree.release();
+    _mutex.lock();
+    pending = false;
+    for (int i = 0; i < XBEE_MSG_MAP_WORDS; i++) {
+      if (_pendingMap[i] != 0) pending = true;
+    }
+    _mutex.unlock();
+  }
+  if (pending) {
+    _mutex.lock();
+    memset(_pendingMap, 0, sizeof(_pendingMap));
+    _mutex.unlock();
+    _sendFailures++;
+  } else {
+    _messagesSent++;
+    _sentBytes += len;
+  }
+  _sendTime += (uint32_t) _clock.elapsed_time().count() - start;
+  _sendMutex.unlock();
+  return pending ? -3 : 0;
+}
+
+/**
+ * Waits for a reassembled message, unless a message handler takes them.
+ * Meanwhile it frees the buffers of messages whose sender went quiet, so a
+ * lost last fragment does not hold one until the next fragment arrives.
+ *
+ * @returns message length | 0 if none arrived by the deadline | -1 if the
+ * message did not fit in size bytes (it is discarded)
+ */
+int XBeeMessageLayer::receive_message(uint64_t* address, char* data, int size, Kernel::Clock::time_point deadline) {
+  int result = 0;
+  _mutex.lock();
+  while (true) {
+    Kernel::Clock::time_point now = Kernel::Clock::now();
+    _expire(now);
+    reassembly_t* done = NULL;
+    for (int i = 0; (i < XBEE_MSG_REASSEMBLY_SLOTS) && (done == NULL); i++) {
+      if (_reassembly[i].state == XBEE_MSG_COMPLETE) done = &_reassembly[i];
+    }
+    if (done != NULL) {
+      *address = done->address;
+      if (done->length <= size) {
+        memcpy(data, done->data, done->length);
+        result = done->length;
+      } else {
+        result = -1;
+      }
+      done->state = XBEE_MSG_FREE;
+      break;
+    }
+    if (now >= deadline) break;
+    // Wake when the deadline or the first partial message's timeout passes
+    Kernel::Clock::time_point wake = deadline;
+    for (int i = 0; i < XBEE_MSG_REASSEMBLY_SLOTS; i++) {
+      if ((_reassembly[i].state == XBEE_MSG_ASSEMBLING) && (_reassembly[i].expires < wake)) wake = _reassembly[i].expires;
+    }
+    _messageReady.wait_until(wake);
+  }
+  _mutex.unlock();
+  return result;
+}
+
+/**
+ * Has every reassembled message passed to handler(address, data, length) on
+ * the parser's receive thread instead of being held for receive_message.
+ * The data is only valid during the call.
+ */
+void XBeeMessageLayer::set_message_handler(Callback<void(uint64_t, const char*, int)> handler) {
+  _mutex.lock();
+  _messageHandler = handler;
+  _mutex.unlock();
+}
+
+/**
+ * Has receive packets that are not message fragments passed to
+ * handler(address, payload, length) on the receive thread. Without a
+ * handler they are dropped.
+ */
+void XBeeMessageLayer::set_packet_handler(Callback<void(uint64_t, const char*, int)> handler) {
+  _mutex.lock();
+  _packetHandler = handler;
+  _mutex.unlock();
+}
+
+/**
+ * Sets how long a partly received message waits for its next fragment
+ * before its buffer is freed
+ */
+void XBeeMessageLayer::set_reassembly_timeout(std::chrono::milliseconds timeout) {
+  _mutex.lock();
+  _timeout = timeout;
+  _mutex.unlock();
+}
+
+/**
+ * @returns message bytes delivered per second spent in send_message
+ */
+float XBeeMessageLayer::goodput_bytes_per_second() {
+  if (_sendTime == 0) return 0.0f;
+  return _sentBytes * 1.0e6f / _sendTime;
+}
+
+uint32_t XBeeMessageLayer::messages_sent() {
+  return _messagesSent;
+}
+
+uint32_t XBeeMessageLayer::messages_received() {
+  return _messagesReceived;
+}
+
+/**
+ * @returns fragments sent again after failing
+ */
+uint32_t XBeeMessageLayer::retransmits() {
+  return _retransmits;
+}
+
+/**
+ * @returns partly received messages abandoned for lack of fragments
+ */
+uint32_t XBeeMessageLayer::reassembly_timeouts() {
+  return _timeouts;
+}
+
+/**
+ * @returns fragments dropped because they were malformed, repeated a 
+ * message already received or no reassembly buffer was free
+ */
+uint32_t XBeeMessageLayer::fragments_dropped() {
+  return _fragmentsDropped;
+}
+
+/**
+ * @returns true if the layer receives 0x90 and 0x81 packets; false if
+ * another layer or subscriber already had them when it was constructed
+ */
+bool XBeeMessageLayer::receiving() {
+  return _subscribed;
+}
+
+/**
+ * Subscriber for 0x90 and 0x81 frames; runs on the receive thread. A 0x81
+ * sender is identified through the parser's short address table.
+ */
+void XBeeMessageLayer::_on_packet(const apiFrame_t* frame) {
+  uint64_t address;
+  const char* payload;
+  int len = _parser->packet_source(frame, &address, &payload);
+  if (len < 0) return;
+  if ((len > XBEE_MSG_HEADER_SIZE) && ((uint8_t) payload[0] == XBEE_MSG_MARKER)) {
+    _on_fragment(address, payload, len);
+    return;
+  }
+  _mutex.lock();
+  Callback<void(uint64_t, const char*, int)> handler = _packetHandler;
+  _mutex.unlock();
+  if (handler) handler(address, payload, len);
+}
+
+/**
+ * Files a fragment in its sender's reassembly buffer
+ */
+void XBeeMessageLayer::_on_fragment(uint64_t address, const char* payload, int len) {
+  uint8_t messageID = payload[1];
+  uint8_t index = payload[2];
+  uint8_t fragments = payload[3];
+  int n = len - XBEE_MSG_HEADER_SIZE;
+  // Only the last fragment may be short
+  bool valid = (fragments > 0) && (fragments <= XBEE_MSG_MAX_FRAGMENTS) && (index < fragments)
+               && ((index == fragments - 1) ? (n <= XBEE_MSG_FRAGMENT_DATA) : (n == XBEE_MSG_FRAGMENT_DATA))
+               && (index * XBEE_MSG_FRAGMENT_DATA + n <= XBEE_MSG_MAX_SIZE);
+  _mutex.lock();
+  Kernel::Clock::time_point now = Kernel::Clock::now();
+  _expire(now);
+  // The radio can deliver a fragment whose status then fails or is lost; 
+  // the sender sends it again after the message is already complete
+  completedMessage_t* done = valid ? _find_completed(address, messageID) : NULL;
+  if (done != NULL) done->expires = now + _timeout;
+  reassembly_t* msg = (valid && (done == NULL)) ? _find_reassembly(address, messageID, fragments) : NULL;
+  if (msg == NULL) {
+    _fragmentsDropped++;
+    _mutex.unlock();
+    return;
+  }
+  if (!((msg->receivedMap[index / 32] >> (index % 32)) & 1)) { // Not a repeat
+    memcpy(&msg->data[index * XBEE_MSG_FRAGMENT_DATA], &payload[XBEE_MSG_HEADER_SIZE], n);
+    msg->receivedMap[index / 32] |= 1UL << (index % 32);
+    msg->received++;
+    if (index == fragments - 1) msg->length = index * XBEE_MSG_FRAGMENT_DATA + n;
+  }
+  msg->expires = now + _timeout;
+  if (msg->received < msg->fragments) {
+    _mutex.unlock();
+    return;
+  }
+  msg->state = XBEE_MSG_COMPLETE;
+  _remember_completed(address, messageID, now);
+  _messagesReceived++;
+  Callback<void(uint64_t, const char*, int)> handler = _messageHandler;
+  if (!handler) {
+    _messageReady.notify_all();
+    _mutex.unlock();
+    return;
+  }
+  msg->state = XBEE_MSG_DELIVERING; // Not for receive_message on another thread
+  _mutex.unlock();
+  handler(msg->address, msg->data, msg->length);
+  _mutex.lock();
+  msg->state = XBEE_MSG_FREE;
+  _mutex.unlock();
+}
+
+/**
+ * Finds the buffer assembling this sender's message, starting a new one if
+ * needed. A sender sends one message at a time, so a new message ID
+ * abandons whatever it was sending before. The mutex must be held.
+ *
+ * @returns NULL if every buffer is busy
+ */
+reassembly_t* XBeeMessageLayer::_find_reassembly(uint64_t address, uint8_t messageID, uint8_t fragments) {
+  reassembly_t* msg = NULL;
+  reassembly_t* free = NULL;
+  for (int i = 0; i < XBEE_MSG_REASSEMBLY_SLOTS; i++) {
+    if ((_reassembly[i].state == XBEE_MSG_ASSEMBLING) && (_reassembly[i].address == address)) msg = &_reassembly[i];
+    if ((_reassembly[i].state == XBEE_MSG_FREE) && (free == NULL)) free = &_reassembly[i];
+  }
+  if ((msg != NULL) && (msg->messageID == messageID)) {
+    return (msg->fragments == fragments) ? msg : NULL;
+  }
+  if (msg != NULL) { // Abandoned for a newer message
+    _timeouts++;
+  } else {
+    msg = free;
+  }
+  if (msg == NULL) return NULL;
+  msg->state = XBEE_MSG_ASSEMBLING;
+  msg->address = address;
+  msg->messageID = messageID;
+  msg->fragments = fragments;
+  msg->received = 0;
+  msg->length = 0;
+  memset(msg->receivedMap, 0, sizeof(msg->receivedMap));
+  return msg;
+}
+
+/**
+ * Finds the record of a sender's message completed within the reassembly
+ * timeout. The mutex must be held.
+ *
+ * @returns NULL if there is none
+ */
+completedMessage_t* XBeeMessageLayer::_find_completed(uint64_t address, uint8_t messageID) {
+  for (int i = 0; i < XBEE_MSG_COMPLETED_SENDERS; i++) {
+    completedMessage_t* done = &_completed[i];
+    if (done->valid && (done->address == address) && (done->messageID == messageID)) return done;
+  }
+  return NULL;
+}
+
+/**
+ * Records a completed message in place of the sender's previous one, or 
+ * of the record closest to expiring. The mutex must be held.
+ */
+void XBeeMessageLayer::_remember_completed(uint64_t address, uint8_t messageID, Kernel::Clock::time_point now) {
+  completedMessage_t* slot = &_completed[0];
+  for (int i = 0; i < XBEE_MSG_COMPLETED_SENDERS; i++) {
+    completedMessage_t* done = &_completed[i];
+    if (done->valid && (done->address == address)) {
+      slot = done;
+      break;
+    }
+    if (!done->valid) {
+      if (slot->valid) slot = done;
+    } else if (slot->valid && (done->expires < slot->expires)) {
+      slot = done;
+    }
+  }
+  slot->valid = true;
+  slot->address = address;
+  slot->messageID = messageID;
+  slot->expires = now + _timeout;
+}
+
+/**
+ * Frees buffers whose sender went quiet and forgets completed messages 
+ * nothing has been repeated for. The mutex must be held.
+ */
+void XBeeMessageLayer::_expire(Kernel::Clock::time_point now) {
+  for (int i = 0; i < XBEE_MSG_REASSEMBLY_SLOTS; i++) {
+    if ((_reassembly[i].state == XBEE_MSG_ASSEMBLING) && (_reassembly[i].expires <= now)) {
+      _reassembly[i].state = XBEE_MSG_FREE;
+      _timeouts++;
+    }
+  }
+  for (int i = 0; i < XBEE_MSG_COMPLETED_SENDERS; i++) {
+    if (_completed[i].valid && (_completed[i].expires <= now)) _completed[i].valid = false;
+  }
+}
+
+/**
+ * txStream delivery callback; runs on the receive thread
+ */
+void XBeeMessageLayer::_fragment_sent(messageSlot_t* slot, int result) {
+  XBeeMessageLayer* layer = slot->layer;
+  if (result != 0) {
+    layer->_mutex.lock();
+    layer->_pendingMap[slot->fragment / 32] |= 1UL << (slot->fragment % 32);
+    layer->_mutex.unlock();
+  }
+  slot->busy = false;
+  layer->_slotsFree.release();
+}
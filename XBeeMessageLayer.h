@@ -0,0 +1,128 @@
+/** Large message layer for XBeeAPIParser
+ *
+ *  Splits messages larger than one RF packet across several TX requests,
+ *  with the transmit window's worth of fragments in flight, and reassembles
+ *  them from 0x90 and 0x81 receive packets into preallocated buffers.
+ *
+ *  Each fragment carries a 4 byte header: XBEE_MSG_MARKER, message ID,
+ *  fragment index and fragment count. Every fragment but the last is full.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_MESSAGE_LAYER_H
+#define XBEE_MESSAGE_LAYER_H
+
+#include "XBeeAPIParser.h"
+
+#define XBEE_MSG_MARKER 0xA7
+#define XBEE_MSG_HEADER_SIZE 4
+// Fragment data that fits a 0x90 frame after its 11 byte address/options header
+#define XBEE_MSG_FRAGMENT_DATA (MAX_FRAME_LENGTH - 11 - XBEE_MSG_HEADER_SIZE)
+// Largest message and how many can be reassembled at once
+#ifndef XBEE_MSG_MAX_SIZE
+#define XBEE_MSG_MAX_SIZE 4096
+#endif
+#ifndef XBEE_MSG_REASSEMBLY_SLOTS
+#define XBEE_MSG_REASSEMBLY_SLOTS 2
+#endif
+#define XBEE_MSG_MAX_FRAGMENTS ((XBEE_MSG_MAX_SIZE + XBEE_MSG_FRAGMENT_DATA - 1) / XBEE_MSG_FRAGMENT_DATA)
+#define XBEE_MSG_MAP_WORDS ((XBEE_MSG_MAX_FRAGMENTS + 31) / 32)
+// Rounds of retransmitting failed fragments before giving up
+#define XBEE_MSG_MAX_ATTEMPTS 3
+// Senders whose last completed message is remembered for a reassembly 
+// timeout, so fragments the sender retransmits after all were delivered 
+// are dropped rather than starting the message over
+#ifndef XBEE_MSG_COMPLETED_SENDERS
+#define XBEE_MSG_COMPLETED_SENDERS 4
+#endif
+
+#define XBEE_MSG_FREE 0
+#define XBEE_MSG_ASSEMBLING 1
+#define XBEE_MSG_COMPLETE 2
+#define XBEE_MSG_DELIVERING 3 // With the message handler
+
+class XBeeMessageLayer;
+
+typedef struct {
+    uint8_t state;
+    uint8_t messageID;
+    uint8_t fragments;
+    uint8_t received;
+    uint64_t address;
+    int length;
+    Kernel::Clock::time_point expires;
+    uint32_t receivedMap[XBEE_MSG_MAP_WORDS];
+    char data[XBEE_MSG_MAX_SIZE];
+} reassembly_t;
+
+typedef struct {
+    bool valid;
+    uint64_t address;
+    uint8_t messageID;
+    Kernel::Clock::time_point expires;
+} completedMessage_t;
+
+typedef struct {
+    XBeeMessageLayer* layer;
+    uint8_t fragment;
+    volatile bool busy;
+} messageSlot_t;
+
+class XBeeMessageLayer
+{
+private:
+    XBeeAPIParser* _parser;
+    // Sending, one message at a time
+    Mutex _sendMutex;
+    uint8_t _nextMessageID;
+    messageSlot_t _slots[XBEE_MAX_TX_WINDOW];
+    Semaphore _slotsFree;
+    uint32_t _pendingMap[XBEE_MSG_MAP_WORDS]; // Fragments still to send, guarded by _mutex
+    Timer _clock;
+    uint64_t _sentBytes;
+    uint64_t _sendTime;
+    uint32_t _messagesSent;
+    uint32_t _sendFailures;
+    uint32_t _retransmits;
+    // Receiving
+    Mutex _mutex;
+    ConditionVariable _messageReady;
+    reassembly_t _reassembly[XBEE_MSG_REASSEMBLY_SLOTS];
+    completedMessage_t _completed[XBEE_MSG_COMPLETED_SENDERS];
+    std::chrono::milliseconds _timeout;
+    Callback<void(uint64_t, const char*, int)> _messageHandler;
+    Callback<void(uint64_t, const char*, int)> _packetHandler;
+    uint32_t _messagesReceived;
+    uint32_t _timeouts;
+    uint32_t _fragmentsDropped;
+    bool _subscribed; // Owns the parser's 0x90 and 0x81 subscriptions
+
+    void _on_packet(const apiFrame_t* frame);
+    void _on_fragment(uint64_t address, const char* payload, int len);
+    reassembly_t* _find_reassembly(uint64_t address, uint8_t messageID, uint8_t fragments);
+    completedMessage_t* _find_completed(uint64_t address, uint8_t messageID);
+    void _remember_completed(uint64_t address, uint8_t messageID, Kernel::Clock::time_point now);
+    void _expire(Kernel::Clock::time_point now);
+    static void _fragment_sent(messageSlot_t* slot, int result);
+
+public:
+    XBeeMessageLayer(XBeeAPIParser* parser);
+    ~XBeeMessageLayer();
+    XBeeMessageLayer(const XBeeMessageLayer&) = delete;
+    XBeeMessageLayer& operator=(const XBeeMessageLayer&) = delete;
+    int send_message(uint64_t address, const char* data, int len);
+    int receive_message(uint64_t* address, char* data, int size, Kernel::Clock::time_point deadline);
+    void set_message_handler(Callback<void(uint64_t, const char*, int)> handler);
+    void set_packet_handler(Callback<void(uint64_t, const char*, int)> handler);
+    void set_reassembly_timeout(std::chrono::milliseconds timeout);
+    float goodput_bytes_per_second();
+    uint32_t messages_sent();
+    uint32_t messages_received();
+    uint32_t retransmits();
+    uint32_t reassembly_timeouts();
+    uint32_t fragments_dropped();
+    bool receiving();
+};
+
+#endif
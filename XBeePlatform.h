@@ -0,0 +1,24 @@
+/** Platform selection for XBeeAPIParser
+ *
+ *  The parser is written against the mbed OS 6 API: a FileHandle for the
+ *  serial link plus the rtos Mutex, ConditionVariable, Semaphore, EventFlags,
+ *  Thread and Kernel::Clock. On mbed targets those come from mbed.h.
+ *  Everywhere else XBeePosix.h supplies the same subset on top of POSIX
+ *  termios/poll and the C++ standard library, so the parser source is the
+ *  same on both.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_PLATFORM_H
+#define XBEE_PLATFORM_H
+
+#if defined(__MBED__)
+#include "mbed.h"
+#define XBEE_PLATFORM_MBED 1
+#else
+#include "XBeePosix.h"
+#define XBEE_PLATFORM_POSIX 1
+#endif
+
+#endif
@@ -0,0 +1,537 @@
+#if !defined(__MBED__)
+
+#include "XBeePosix.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+static std::chrono::steady_clock::time_point _steady(Kernel::Clock::time_point t) {
+  return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(t.time_since_epoch()));
+}
+
+/**
+ * Sets thread flags on a thread obtained from Thread::get_id() or
+ * ThisThread::get_id()
+ */
+int32_t osSignalSet(osThreadId_t thread_id, int32_t signals) {
+  if (thread_id == NULL) return (int32_t) osFlagsError;
+  return ((EventFlags*) thread_id)->set(signals);
+}
+
+void Timer::start() {
+  if (_running) return;
+  _started = std::chrono::steady_clock::now();
+  _running = true;
+}
+
+void Timer::stop() {
+  if (!_running) return;
+  _elapsed += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _started);
+  _running = false;
+}
+
+void Timer::reset() {
+  _started = std::chrono::steady_clock::now();
+  _elapsed = std::chrono::microseconds(0);
+}
+
+std::chrono::microseconds Timer::elapsed_time() const {
+  if (!_running) return _elapsed;
+  return _elapsed + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _started);
+}
+
+bool Mutex::trylock_until(Kernel::Clock::time_point abs_time) {
+  return _taken(_mutex.try_lock_until(_steady(abs_time)));
+}
+
+void Mutex::unlock() {
+  if (--_depth == 0) _owner = NULL;
+  _mutex.unlock();
+}
+
+/**
+ * Records the calling thread as the owner if the mutex was just taken
+ *
+ * @returns locked
+ */
+bool Mutex::_taken(bool locked) {
+  if (locked) {
+    _owner = ThisThread::get_id();
+    _depth++;
+  }
+  return locked;
+}
+
+void ConditionVariable::notify_one() {
+  MBED_ASSERT(_mutex.get_owner() == ThisThread::get_id());
+  _cv.notify_one();
+}
+
+void ConditionVariable::notify_all() {
+  MBED_ASSERT(_mutex.get_owner() == ThisThread::get_id());
+  _cv.notify_all();
+}
+
+/**
+ * @returns true if the wait timed out
+ */
+bool ConditionVariable::wait_for(Kernel::Clock::duration rel_time) {
+  return _cv.wait_for(_mutex, rel_time) == std::cv_status::timeout;
+}
+
+/**
+ * @returns true if the wait timed out
+ */
+bool ConditionVariable::wait_until(Kernel::Clock::time_point abs_time) {
+  return _cv.wait_until(_mutex, _steady(abs_time)) == std::cv_status::timeout;
+}
+
+void Semaphore::acquire() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [this] { return _count > 0; });
+  _count--;
+}
+
+bool Semaphore::try_acquire() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_count == 0) return false;
+  _count--;
+  return true;
+}
+
+bool Semaphore::try_acquire_for(Kernel::Clock::duration rel_time) {
+  return try_acquire_until(Kernel::Clock::now() + rel_time);
+}
+
+bool Semaphore::try_acquire_until(Kernel::Clock::time_point abs_time) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (!_cv.wait_until(lock, _steady(abs_time), [this] { return _count > 0; })) return false;
+  _count--;
+  return true;
+}
+
+/**
+ * @returns 0 | -1 if the semaphore is already at its maximum count
+ */
+int Semaphore::release() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_count >= _maxCount) return -1;
+  _count++;
+  _cv.notify_all();
+  return 0;
+}
+
+/**
+ * @returns flags after setting
+ */
+uint32_t EventFlags::set(uint32_t flags) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _flags |= flags;
+  _cv.notify_all();
+  return _flags;
+}
+
+/**
+ * @returns flags before clearing
+ */
+uint32_t EventFlags::clear(uint32_t flags) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  uint32_t previous = _flags;
+  _flags &= ~flags;
+  return previous;
+}
+
+uint32_t EventFlags::get() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _flags;
+}
+
+uint32_t EventFlags::wait_any(uint32_t flags, uint32_t millisec, bool clear) {
+  if (millisec == osWaitForever) return wait_any_until(flags, Kernel::Clock::time_point::max(), clear);
+  return wait_any_for(flags, std::chrono::milliseconds(millisec), clear);
+}
+
+uint32_t EventFlags::wait_any_for(uint32_t flags, Kernel::Clock::duration rel_time, bool clear) {
+  return wait_any_until(flags, Kernel::Clock::now() + rel_time, clear);
+}
+
+/**
+ * Waits for any of the flags (any flag at all if flags is 0)
+ *
+ * @returns flags that were set when the wait ended | osFlagsErrorTimeout
+ */
+uint32_t EventFlags::wait_any_until(uint32_t flags, Kernel::Clock::time_point abs_time, bool clear) {
+  uint32_t mask = (flags == 0) ? 0x7FFFFFFF : flags;
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto ready = [this, mask] { return (_flags & mask) != 0; };
+  if (abs_time == Kernel::Clock::time_point::max()) {
+    _cv.wait(lock, ready);
+  } else if (!_cv.wait_until(lock, _steady(abs_time), ready)) {
+    return osFlagsErrorTimeout;
+  }
+  uint32_t result = _flags;
+  if (clear) _flags &= ~mask;
+  return result;
+}
+
+// Flags for threads not started through Thread, e.g. main
+static thread_local EventFlags* _currentThreadFlags = NULL;
+
+Thread::~Thread() {
+  // A std::thread cannot be terminated; leave it to finish on its own
+  if (_thread.joinable()) _thread.detach();
+}
+
+/**
+ * @returns 0 | -1 if already started
+ */
+int Thread::start(mbed::Callback<void()> task) {
+  if (_thread.joinable()) return -1;
+  EventFlags* flags = &_threadFlags;
+  _thread = std::thread([task, flags] {
+    _currentThreadFlags = flags;
+    task();
+  });
+  return 0;
+}
+
+int Thread::join() {
+  if (!_thread.joinable()) return -1;
+  _thread.join();
+  return 0;
+}
+
+void ThisThread::sleep_for(Kernel::Clock::duration rel_time) {
+  std::this_thread::sleep_for(rel_time);
+}
+
+void ThisThread::sleep_until(Kernel::Clock::time_point abs_time) {
+  std::this_thread::sleep_until(_steady(abs_time));
+}
+
+osThreadId_t ThisThread::get_id() {
+  static thread_local EventFlags ownFlags;
+  if (_currentThreadFlags == NULL) _currentThreadFlags = &ownFlags;
+  return (osThreadId_t) _currentThreadFlags;
+}
+
+uint32_t ThisThread::flags_wait_any(uint32_t flags, bool clear) {
+  return ((EventFlags*) get_id())->wait_any(flags, osWaitForever, clear);
+}
+
+static speed_t _termios_speed(int baud) {
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+    default: return B0;
+  }
+}
+
+/**
+ * @brief Opens a tty (e.g. /dev/ttyUSB0) in raw 8N1 mode
+ *
+ * @param path device path
+ * @param baud 9600 to 921600
+ */
+XBeePosixSerial::XBeePosixSerial(const char* path, int baud) :
+  XBeePosixSerial(::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK)) {
+  _ownsFd = true;
+  if (_fd < 0) return;
+  struct termios tio;
+  if (tcgetattr(_fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(_fd, TCSANOW, &tio);
+  }
+  set_baud(baud);
+}
+
+/**
+ * @brief Wraps an open descriptor, e.g. one end of a pty pair from
+ * open_pty(). The descriptor is closed with the port.
+ */
+XBeePosixSerial::XBeePosixSerial(int fd) {
+  _fd = fd;
+  _ownsFd = true;
+  _blocking = true;
+  _readArmed = true;
+  _writeArmed = false;
+  _stop = false;
+  _wake[0] = _wake[1] = -1;
+  if (_fd < 0) return;
+  fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK); // Blocking is emulated with poll()
+  if (pipe(_wake) == 0) {
+    fcntl(_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake[1], F_SETFL, O_NONBLOCK);
+    _watcher = std::thread(&XBeePosixSerial::_watch, this);
+  }
+}
+
+XBeePosixSerial::~XBeePosixSerial() {
+  close();
+}
+
+bool XBeePosixSerial::is_open() const {
+  return _fd >= 0;
+}
+
+/**
+ * @returns 0 | -1 if the rate is not supported
+ */
+int XBeePosixSerial::set_baud(int baud) {
+  speed_t speed = _termios_speed(baud);
+  struct termios tio;
+  if ((speed == B0) || (tcgetattr(_fd, &tio) != 0)) return -1;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  return tcsetattr(_fd, TCSANOW, &tio);
+}
+
+/**
+ * @returns bytes read | -EAGAIN if non-blocking and nothing is waiting
+ */
+ssize_t XBeePosixSerial::read(void* buffer, size_t size) {
+  while (true) {
+    ssize_t n = ::read(_fd, buffer, size);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if ((n < 0) && (errno != EAGAIN)) return -errno;
+    if (n == 0) return 0; // End of file, e.g. a file or a pipe rather than a tty
+    if ((n > 0) && ((size_t) n == size)) return n; // There may be more
+    _arm(true, false); // Drained, so the next byte to arrive signals again
+    if (n > 0) return n;
+    if (!_blocking) return -EAGAIN;
+    if (!_wait_ready(POLLIN)) return -EIO;
+  }
+}
+
+/**
+ * @returns bytes written | -EAGAIN if non-blocking and the port is full
+ */
+ssize_t XBeePosixSerial::write(const void* buffer, size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    ssize_t n = ::write(_fd, (const char*) buffer + sent, size - sent);
+    if (n > 0) {
+      sent += n;
+    } else if ((n < 0) && (errno == EINTR)) {
+      continue;
+    } else if ((n < 0) && (errno != EAGAIN)) {
+      return (sent > 0) ? (ssize_t) sent : -errno;
+    } else {
+      _arm(false, true); // Signal when there is room again
+      if (!_blocking) return (sent > 0) ? (ssize_t) sent : -EAGAIN;
+      if (!_wait_ready(POLLOUT)) return (sent > 0) ? (ssize_t) sent : -EIO;
+    }
+  }
+  return sent;
+}
+
+bool XBeePosixSerial::readable() const {
+  struct pollfd p = {_fd, POLLIN, 0};
+  return (poll(&p, 1, 0) > 0) && (p.revents & POLLIN);
+}
+
+bool XBeePosixSerial::writable() const {
+  struct pollfd p = {_fd, POLLOUT, 0};
+  return (poll(&p, 1, 0) > 0) && (p.revents & POLLOUT);
+}
+
+int XBeePosixSerial::set_blocking(bool blocking) {
+  _blocking = blocking;
+  return 0;
+}
+
+bool XBeePosixSerial::is_blocking() const {
+  return _blocking;
+}
+
+/**
+ * Registers the callback run (from the watcher thread) when the port
+ * becomes readable or writable. Like BufferedSerial it fires on edges: after
+ * signalling readable it waits for a read to drain the port before
+ * signalling again.
+ */
+void XBeePosixSerial::sigio(Callback<void()> func) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sigio = func;
+  }
+  _arm(true, false);
+}
+
+/**
+ * Stops the watcher and closes the descriptor
+ */
+int XBeePosixSerial::close() {
+  if (_watcher.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    char c = 0;
+    (void) ::write(_wake[1], &c, 1);
+    _watcher.join();
+  }
+  if (_wake[0] >= 0) ::close(_wake[0]);
+  if (_wake[1] >= 0) ::close(_wake[1]);
+  _wake[0] = _wake[1] = -1;
+  int result = 0;
+  if ((_fd >= 0) && _ownsFd) result = ::close(_fd);
+  _fd = -1;
+  return result;
+}
+
+/**
+ * Opens a pseudo terminal pair in raw mode. Bytes written to one end are
+ * read from the other, so a simulated modem on one end can stand in for an
+ * XBee on the other.
+ *
+ * @returns true if both ends were opened
+ */
+bool XBeePosixSerial::open_pty(int* master, int* slave) {
+  int m = posix_openpt(O_RDWR | O_NOCTTY);
+  if (m < 0) return false;
+  if ((grantpt(m) != 0) || (unlockpt(m) != 0)) {
+    ::close(m);
+    return false;
+  }
+  int s = ::open(ptsname(m), O_RDWR | O_NOCTTY);
+  if (s < 0) {
+    ::close(m);
+    return false;
+  }
+  // The slave's line discipline applies to both directions
+  struct termios tio;
+  tcgetattr(s, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(s, TCSANOW, &tio);
+  *master = m;
+  *slave = s;
+  return true;
+}
+
+void XBeePosixSerial::_arm(bool read, bool write) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if ((read && _readArmed) || (write && _writeArmed) || !(read || write)) return;
+    _readArmed = _readArmed || read;
+    _writeArmed = _writeArmed || write;
+  }
+  char c = 0;
+  if (_wake[1] >= 0) (void) ::write(_wake[1], &c, 1); // Let the watcher poll for it
+}
+
+/**
+ * Blocks until the descriptor is ready for a blocking read or write
+ *
+ * @returns false if the port failed or hung up
+ */
+bool XBeePosixSerial::_wait_ready(short events) {
+  struct pollfd p = {_fd, events, 0};
+  while (poll(&p, 1, -1) < 0) {
+    if (errno != EINTR) return false;
+  }
+  return (p.revents & events) != 0;
+}
+
+/**
+ * Watcher thread. Polls for whichever directions are armed and runs the
+ * sigio callback once per edge.
+ */
+void XBeePosixSerial::_watch() {
+  while (true) {
+    struct pollfd p[2];
+    p[0].fd = _wake[0];
+    p[0].events = POLLIN;
+    p[1].fd = _fd;
+    p[1].events = 0;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_stop) return;
+      if (_readArmed) p[1].events |= POLLIN;
+      if (_writeArmed) p[1].events |= POLLOUT;
+    }
+    if (poll(p, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    if (p[0].revents & POLLIN) { // Drain wake ups; the loop re-reads the armed state
+      char c[16];
+      while (::read(_wake[0], c, sizeof(c)) > 0) {}
+    }
+    if (p[1].revents & (POLLHUP | POLLERR)) {
+      // Nothing on the other end of a pty yet; don't spin on the hang up
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    short ready = p[1].revents & (POLLIN | POLLOUT);
+    if (ready == 0) continue;
+    Callback<void()> func;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (ready & POLLIN) _readArmed = false;
+      if (ready & POLLOUT) _writeArmed = false;
+      func = _sigio;
+    }
+    if (func) func();
+  }
+}
+
+/**
+ * @brief Opens a file
+ *
+ * @param mode "r" to read, "w" to create or truncate, "a" to append
+ */
+XBeePosixFile::XBeePosixFile(const char* path, const char* mode) {
+  int flags = O_RDONLY;
+  if (mode[0] == 'w') flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (mode[0] == 'a') flags = O_WRONLY | O_CREAT | O_APPEND;
+  _fd = ::open(path, flags, 0644);
+}
+
+XBeePosixFile::~XBeePosixFile() {
+  close();
+}
+
+bool XBeePosixFile::is_open() const {
+  return _fd >= 0;
+}
+
+ssize_t XBeePosixFile::read(void* buffer, size_t size) {
+  ssize_t n;
+  while (((n = ::read(_fd, buffer, size)) < 0) && (errno == EINTR)) {}
+  return (n < 0) ? -errno : n;
+}
+
+ssize_t XBeePosixFile::write(const void* buffer, size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    ssize_t n = ::write(_fd, (const char*) buffer + sent, size - sent);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return (sent > 0) ? (ssize_t) sent : -errno;
+    sent += n;
+  }
+  return sent;
+}
+
+int XBeePosixFile::close() {
+  int result = 0;
+  if (_fd >= 0) result = ::close(_fd);
+  _fd = -1;
+  return result;
+}
+
+#endif
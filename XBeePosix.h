@@ -0,0 +1,321 @@
+/** POSIX backend for XBeeAPIParser
+ *
+ *  Implements the subset of the mbed OS 6 API that the parser uses with
+ *  std::thread, std::condition_variable and a termios serial port, so the
+ *  parser runs unchanged on a Linux host. Include XBeePlatform.h rather than
+ *  this file.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_POSIX_H
+#define XBEE_POSIX_H
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <sys/types.h>
+
+using namespace std::chrono_literals;
+
+// CMSIS-RTOS names the parser's public API uses
+typedef void* osThreadId_t;
+typedef int osPriority;
+#define osPriorityNormal 24
+#define osPriorityAboveNormal 32
+#define osPriorityHigh 40
+#define osWaitForever 0xFFFFFFFFU
+#define osFlagsError 0x80000000U
+#define osFlagsErrorTimeout 0xFFFFFFFEU
+
+#define MBED_ASSERT(expr) assert(expr)
+
+int32_t osSignalSet(osThreadId_t thread_id, int32_t signals);
+
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t* valuePtr, uint32_t delta) {
+    return __atomic_add_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_decr_u32(volatile uint32_t* valuePtr, uint32_t delta) {
+    return __atomic_sub_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+inline uint8_t core_util_atomic_load_u8(const volatile uint8_t* valuePtr) {
+    return __atomic_load_n(valuePtr, __ATOMIC_SEQ_CST);
+}
+
+inline void core_util_atomic_store_u8(volatile uint8_t* valuePtr, uint8_t desiredValue) {
+    __atomic_store_n(valuePtr, desiredValue, __ATOMIC_SEQ_CST);
+}
+
+namespace rtos {
+namespace Kernel {
+
+/** Monotonic millisecond clock, like the RTOS kernel tick */
+struct Clock {
+    typedef std::chrono::milliseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<Clock> time_point;
+    typedef std::chrono::duration<uint32_t, std::milli> duration_u32;
+    static const bool is_steady = true;
+    static time_point now() {
+        return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()));
+    }
+};
+
+} // namespace Kernel
+} // namespace rtos
+
+namespace mbed {
+
+template <typename F> class Callback;
+
+/** Callback holding a function, a bound member function or a function with
+ *  a bound first argument, like mbed::Callback
+ */
+template <typename R, typename... A>
+class Callback<R(A...)>
+{
+private:
+    std::function<R(A...)> _f;
+
+public:
+    Callback() {}
+    Callback(std::nullptr_t) {}
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Callback>::value>::type>
+    Callback(F f) : _f(std::move(f)) {}
+    template <typename T, typename U>
+    Callback(U* obj, R (T::*method)(A...)) : _f([obj, method](A... args) -> R { return (obj->*method)(args...); }) {}
+    template <typename T, typename U>
+    Callback(R (*func)(T*, A...), U* arg) : _f([func, arg](A... args) -> R { return func(arg, args...); }) {}
+    R call(A... args) const { return _f(args...); }
+    R operator()(A... args) const { return _f(args...); }
+    explicit operator bool() const { return (bool) _f; }
+};
+
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(U* obj, R (T::*method)(A...)) {
+    return Callback<R(A...)>(obj, method);
+}
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*func)(A...)) {
+    return Callback<R(A...)>(func);
+}
+
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(R (*func)(T*, A...), U* arg) {
+    return Callback<R(A...)>(func, arg);
+}
+
+/** Byte stream interface of mbed::FileHandle that the parser talks to */
+class FileHandle
+{
+public:
+    virtual ~FileHandle() {}
+    virtual ssize_t read(void* buffer, size_t size) = 0;
+    virtual ssize_t write(const void* buffer, size_t size) = 0;
+    virtual bool readable() const { return true; }
+    virtual bool writable() const { return true; }
+    virtual int set_blocking(bool blocking) { return blocking ? 0 : -1; }
+    virtual bool is_blocking() const { return true; }
+    virtual void sigio(Callback<void()> /* func */) {}
+    virtual int close() { return 0; }
+};
+
+/** Microsecond stopwatch */
+class Timer
+{
+private:
+    std::chrono::steady_clock::time_point _started;
+    std::chrono::microseconds _elapsed;
+    bool _running;
+
+public:
+    Timer() : _elapsed(0), _running(false) {}
+    void start();
+    void stop();
+    void reset();
+    std::chrono::microseconds elapsed_time() const;
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+namespace rtos {
+
+/** Recursive mutex with timed locking, like rtos::Mutex */
+class Mutex
+{
+private:
+    std::recursive_timed_mutex _mutex;
+    osThreadId_t _owner; // Guarded by _mutex, like mbed's owner tracking
+    int _depth;
+
+    bool _taken(bool locked);
+
+public:
+    Mutex() : _owner(NULL), _depth(0) {}
+    Mutex(const char* /* name */) : _owner(NULL), _depth(0) {}
+    void lock() { _mutex.lock(); _taken(true); }
+    void unlock();
+    bool trylock() { return _taken(_mutex.try_lock()); }
+    bool trylock_for(Kernel::Clock::duration rel_time) { return _taken(_mutex.try_lock_for(rel_time)); }
+    bool trylock_until(Kernel::Clock::time_point abs_time);
+    osThreadId_t get_owner() { return _owner; }
+};
+
+/** Condition variable bound to a Mutex. The wait calls return true on timeout.
+ *  As on mbed, notifying requires holding the mutex. */
+class ConditionVariable
+{
+private:
+    Mutex& _mutex;
+    std::condition_variable_any _cv;
+
+public:
+    ConditionVariable(Mutex& mutex) : _mutex(mutex) {}
+    void wait() { _cv.wait(_mutex); }
+    bool wait_for(Kernel::Clock::duration rel_time);
+    bool wait_until(Kernel::Clock::time_point abs_time);
+    void notify_one();
+    void notify_all();
+};
+
+class Semaphore
+{
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    int32_t _count;
+    int32_t _maxCount;
+
+public:
+    Semaphore(int32_t count = 0) : _count(count), _maxCount(0x7FFFFFFF) {}
+    Semaphore(int32_t count, uint16_t max_count) : _count(count), _maxCount(max_count) {}
+    void acquire();
+    bool try_acquire();
+    bool try_acquire_for(Kernel::Clock::duration rel_time);
+    bool try_acquire_until(Kernel::Clock::time_point abs_time);
+    int release();
+};
+
+class EventFlags
+{
+private:
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    uint32_t _flags;
+
+public:
+    EventFlags() : _flags(0) {}
+    EventFlags(const char* /* name */) : _flags(0) {}
+    uint32_t set(uint32_t flags);
+    uint32_t clear(uint32_t flags = 0x7FFFFFFF);
+    uint32_t get() const;
+    uint32_t wait_any(uint32_t flags = 0, uint32_t millisec = osWaitForever, bool clear = true);
+    uint32_t wait_any_for(uint32_t flags, Kernel::Clock::duration rel_time, bool clear = true);
+    uint32_t wait_any_until(uint32_t flags, Kernel::Clock::time_point abs_time, bool clear = true);
+};
+
+/** Thread started on demand, like rtos::Thread. Priority and stack are
+ *  accepted for compatibility and left to the host scheduler.
+ */
+class Thread
+{
+private:
+    std::thread _thread;
+    EventFlags _threadFlags; // Serves osSignalSet and ThisThread::flags_wait_any
+
+public:
+    Thread(osPriority /* priority */ = osPriorityNormal, uint32_t /* stack_size */ = 0, unsigned char* /* stack_mem */ = nullptr, const char* /* name */ = nullptr) {}
+    ~Thread();
+    Thread(const Thread&) = delete;
+    Thread& operator=(const Thread&) = delete;
+    int start(mbed::Callback<void()> task);
+    int join();
+    osThreadId_t get_id() const { return (osThreadId_t) &_threadFlags; }
+};
+
+namespace ThisThread {
+void sleep_for(Kernel::Clock::duration rel_time);
+void sleep_until(Kernel::Clock::time_point abs_time);
+osThreadId_t get_id();
+uint32_t flags_wait_any(uint32_t flags, bool clear = true);
+} // namespace ThisThread
+
+} // namespace rtos
+
+using namespace rtos;
+
+/** Serial port on a tty or pty using termios and poll(). Reads and writes
+ *  are non-blocking after set_blocking(false), and a watcher thread calls
+ *  the sigio callback when the port becomes readable (or writable after a
+ *  write would have blocked), the way BufferedSerial does from its
+ *  interrupt.
+ */
+class XBeePosixSerial : public FileHandle
+{
+private:
+    int _fd;
+    bool _ownsFd;
+    int _wake[2]; // Self pipe that interrupts the watcher's poll()
+    volatile bool _blocking;
+    std::mutex _mutex;
+    Callback<void()> _sigio;
+    bool _readArmed;
+    bool _writeArmed;
+    bool _stop;
+    std::thread _watcher;
+
+    void _watch();
+    void _arm(bool read, bool write);
+    bool _wait_ready(short events);
+
+public:
+    XBeePosixSerial(const char* path, int baud = 9600);
+    XBeePosixSerial(int fd);
+    ~XBeePosixSerial();
+    XBeePosixSerial(const XBeePosixSerial&) = delete;
+    XBeePosixSerial& operator=(const XBeePosixSerial&) = delete;
+    bool is_open() const;
+    int set_baud(int baud);
+    ssize_t read(void* buffer, size_t size) override;
+    ssize_t write(const void* buffer, size_t size) override;
+    bool readable() const override;
+    bool writable() const override;
+    int set_blocking(bool blocking) override;
+    bool is_blocking() const override;
+    void sigio(Callback<void()> func) override;
+    int close() override;
+    static bool open_pty(int* master, int* slave);
+};
+
+/** Regular file as a FileHandle, e.g. for capture logs */
+class XBeePosixFile : public FileHandle
+{
+private:
+    int _fd;
+
+public:
+    XBeePosixFile(const char* path, const char* mode = "r");
+    ~XBeePosixFile();
+    XBeePosixFile(const XBeePosixFile&) = delete;
+    XBeePosixFile& operator=(const XBeePosixFile&) = delete;
+    bool is_open() const;
+    ssize_t read(void* buffer, size_t size) override;
+    ssize_t write(const void* buffer, size_t size) override;
+    int close() override;
+};
+
+#endif
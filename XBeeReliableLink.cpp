@@ -0,0 +1,363 @@
+#include "XBeeReliableLink.h"
+
+static_assert(XBEE_REL_MAX_PAYLOAD > 0, "MAX_FRAME_LENGTH leaves no room for reliable packets");
+static_assert(XBEE_REL_WINDOW == 64, "the duplicate window is one 64-bit word");
+
+/**
+ * @brief Construct a new reliable link sending through the given parser
+ */
+XBeeReliableLink::XBeeReliableLink(XBeeAPIParser* parser) :
+  _idle(_mutex),
+  _framesFree(XBEE_REL_QUEUE, XBEE_REL_QUEUE),
+  _thread(osPriorityNormal, XBEE_REL_STACK_SIZE, NULL, "XBeeReliableLink") {
+  _parser = parser;
+  for (int i = 0; i < XBEE_REL_PEERS; i++) {
+    _sendPeers[i].valid = false;
+    _receivePeers[i].valid = false;
+  }
+  _peerClock = 0;
+  for (int i = 0; i < XBEE_REL_QUEUE; i++) {
+    _frames[i].link = this;
+    _frames[i].state = XBEE_REL_FREE;
+  }
+  _random = (uint32_t) Kernel::Clock::now().time_since_epoch().count() | 1;
+  _framesSent = 0;
+  _retransmits = 0;
+  _delivered = 0;
+  _failed = 0;
+  _received = 0;
+  _duplicates = 0;
+  _subscribed = false;
+  _stop = false;
+  _thread.start(callback(this, &XBeeReliableLink::_run));
+}
+
+/**
+ * Waits for every queued frame to be delivered or given up, then stops the
+ * retransmit thread
+ */
+XBeeReliableLink::~XBeeReliableLink() {
+  flush();
+  _stop = true;
+  _events.set(XBEE_REL_WAKE_FLAG);
+  _thread.join();
+  if (_subscribed) _parser->unsubscribe_packets();
+}
+
+/**
+ * Numbers a packet for its peer and sends it through txStream. If its 0x89
+ * status reports a failure it is sent again after a backoff, up to
+ * XBEE_REL_MAX_ATTEMPTS times in all. Blocks while XBEE_REL_QUEUE frames are
+ * outstanding, while a frame to the same peer is still outstanding a whole
+ * duplicate window ago (so its retransmits stay inside the receiver's
+ * window) or while the transmit window is full.
+ *
+ * @returns sequence number given to the packet, as later passed to the
+ * delivery handler | -1 if the payload is longer than XBEE_REL_MAX_PAYLOAD
+ */
+int XBeeReliableLink::send(uint64_t address, const char* data, int len) {
+  if ((len < 0) || (len > XBEE_REL_MAX_PAYLOAD)) return -1;
+  _framesFree.acquire();
+  _mutex.lock();
+  relPeer_t* peer = _peer(_sendPeers, address);
+  while (_lagging(peer)) {
+    _idle.wait();
+    peer = _peer(_sendPeers, address); // It may have made way for another peer meanwhile
+  }
+  relFrame_t* frame = _frames;
+  while (frame->state != XBEE_REL_FREE) frame++;
+  frame->state = XBEE_REL_IN_FLIGHT;
+  frame->attempts = 1;
+  frame->address = address;
+  frame->sequence = peer->nextSequence++;
+  frame->data[0] = XBEE_REL_MARKER;
+  frame->data[1] = frame->sequence >> 8;
+  frame->data[2] = frame->sequence & 0xFF;
+  memcpy(&frame->data[XBEE_REL_HEADER_SIZE], data, len);
+  frame->length = XBEE_REL_HEADER_SIZE + len;
+  uint16_t sequence = frame->sequence;
+  _framesSent++;
+  _mutex.unlock();
+  _transmit(frame);
+  return sequence;
+}
+
+/**
+ * Waits until every queued frame has been delivered or given up
+ */
+void XBeeReliableLink::flush() {
+  _mutex.lock();
+  bool busy = true;
+  while (busy) {
+    busy = false;
+    for (int i = 0; i < XBEE_REL_QUEUE; i++) {
+      if (_frames[i].state != XBEE_REL_FREE) busy = true;
+    }
+    if (busy) _idle.wait();
+  }
+  _mutex.unlock();
+}
+
+/**
+ * Subscribes to 0x90 and 0x81 packets and passes each one to
+ * handler(address, payload, length) on the receive thread, once: the header
+ * is stripped and duplicates are dropped. Packets without the header are
+ * passed on whole, and those from a 0x81 sender whose 64-bit address is
+ * unknown are not checked for duplicates. A null handler unsubscribes.
+ *
+ * @returns false if another layer or subscriber already receives 0x90 or
+ * 0x81 packets; the handler is then never called
+ */
+bool XBeeReliableLink::set_receive_handler(Callback<void(uint64_t, const char*, int)> handler) {
+  _mutex.lock();
+  _receiveHandler = handler;
+  _mutex.unlock();
+  if (handler && !_subscribed) {
+    _subscribed = _parser->subscribe_packets(callback(this, &XBeeReliableLink::_on_packet));
+  } else if (!handler && _subscribed) {
+    _parser->unsubscribe_packets();
+    _subscribed = false;
+  }
+  return _subscribed || !handler;
+}
+
+/**
+ * Calls handler(address, sequence, result) on the receive thread once each
+ * packet is finished: result 0 if delivered, else the txStream code of its
+ * last attempt (-2 if that made the parser disassociate)
+ */
+void XBeeReliableLink::set_delivery_handler(Callback<void(uint64_t, uint16_t, int)> handler) {
+  _mutex.lock();
+  _deliveryHandler = handler;
+  _mutex.unlock();
+}
+
+/**
+ * Forgets a peer's sequence numbers in both directions, e.g. once it is
+ * known to have restarted
+ */
+void XBeeReliableLink::reset_peer(uint64_t address) {
+  _mutex.lock();
+  for (int i = 0; i < XBEE_REL_PEERS; i++) {
+    if (_sendPeers[i].valid && (_sendPeers[i].address == address)) _sendPeers[i].valid = false;
+    if (_receivePeers[i].valid && (_receivePeers[i].address == address)) _receivePeers[i].valid = false;
+  }
+  _mutex.unlock();
+}
+
+/**
+ * @returns packets sent, not counting retransmits
+ */
+uint32_t XBeeReliableLink::frames_sent() {
+  return _framesSent;
+}
+
+uint32_t XBeeReliableLink::retransmits() {
+  return _retransmits;
+}
+
+uint32_t XBeeReliableLink::frames_delivered() {
+  return _delivered;
+}
+
+/**
+ * @returns packets that failed every attempt
+ */
+uint32_t XBeeReliableLink::frames_failed() {
+  return _failed;
+}
+
+/**
+ * @returns packets passed to the receive handler, not counting duplicates
+ */
+uint32_t XBeeReliableLink::frames_received() {
+  return _received;
+}
+
+uint32_t XBeeReliableLink::duplicates_dropped() {
+  return _duplicates;
+}
+
+/**
+ * Retransmit thread. Sends frames whose backoff has passed and sleeps until
+ * the next one is due or a frame starts backing off.
+ */
+void XBeeReliableLink::_run() {
+  while (!_stop) {
+    relFrame_t* due[XBEE_REL_QUEUE];
+    int n = 0;
+    bool waiting = false;
+    Kernel::Clock::time_point next = Kernel::Clock::now();
+    _mutex.lock();
+    Kernel::Clock::time_point now = Kernel::Clock::now();
+    for (int i = 0; i < XBEE_REL_QUEUE; i++) {
+      relFrame_t* frame = &_frames[i];
+      if (frame->state != XBEE_REL_BACKING_OFF) continue;
+      if (frame->due <= now) {
+        frame->state = XBEE_REL_IN_FLIGHT;
+        frame->attempts++;
+        _retransmits++;
+        due[n++] = frame;
+      } else if (!waiting || (frame->due < next)) {
+        next = frame->due;
+        waiting = true;
+      }
+    }
+    _mutex.unlock();
+    for (int i = 0; i < n; i++) _transmit(due[i]);
+    if (n > 0) continue; // Sending may have taken a while; look again
+    if (waiting) _events.wait_any_until(XBEE_REL_WAKE_FLAG, next);
+    else _events.wait_any(XBEE_REL_WAKE_FLAG);
+  }
+}
+
+/**
+ * @returns the peer's entry in peers (_sendPeers or _receivePeers), set up
+ * with a random first sequence number if it is new. The mutex must be held.
+ */
+relPeer_t* XBeeReliableLink::_peer(relPeer_t* peers, uint64_t address) {
+  relPeer_t* victim = &peers[0];
+  for (int i = 0; i < XBEE_REL_PEERS; i++) {
+    relPeer_t* peer = &peers[i];
+    if (peer->valid && (peer->address == address)) {
+      peer->lastUsed = ++_peerClock;
+      return peer;
+    }
+    if (!peer->valid) {
+      if (victim->valid) victim = peer;
+    } else if (victim->valid && (peer->lastUsed < victim->lastUsed)) {
+      victim = peer;
+    }
+  }
+  // xorshift32
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  victim->valid = true;
+  victim->address = address;
+  victim->nextSequence = _random & 0xFFFF;
+  victim->synced = false;
+  victim->lastUsed = ++_peerClock;
+  return victim;
+}
+
+/**
+ * @returns true if a frame to the peer is still outstanding a whole
+ * duplicate window behind its next sequence number. The mutex must be held.
+ */
+bool XBeeReliableLink::_lagging(relPeer_t* peer) {
+  for (int i = 0; i < XBEE_REL_QUEUE; i++) {
+    relFrame_t* frame = &_frames[i];
+    if ((frame->state != XBEE_REL_FREE) && (frame->address == peer->address)
+        && ((uint16_t) (peer->nextSequence - frame->sequence) >= XBEE_REL_WINDOW)) return true;
+  }
+  return false;
+}
+
+/**
+ * Records a received sequence number in the peer's window. A number more
+ * than a window behind the newest is taken as the sender having restarted.
+ * The mutex must be held.
+ *
+ * @returns false if it was received before
+ */
+bool XBeeReliableLink::_accept(relPeer_t* peer, uint16_t sequence) {
+  int16_t ahead = (int16_t) (sequence - peer->highest);
+  if (!peer->synced || (ahead <= -XBEE_REL_WINDOW)) {
+    peer->synced = true;
+    peer->highest = sequence;
+    peer->window = 1;
+    return true;
+  }
+  if (ahead > 0) {
+    peer->window = (ahead >= XBEE_REL_WINDOW) ? 1 : ((peer->window << ahead) | 1);
+    peer->highest = sequence;
+    return true;
+  }
+  uint64_t bit = 1ULL << -ahead;
+  if (peer->window & bit) return false;
+  peer->window |= bit; // Late, but new
+  return true;
+}
+
+/**
+ * @returns delay before the next attempt of a frame sent attempts times:
+ * XBEE_REL_BACKOFF doubled per earlier attempt, capped at
+ * XBEE_REL_MAX_BACKOFF, plus up to half again of jitter so peers that
+ * failed together do not retry together. The mutex must be held.
+ */
+std::chrono::milliseconds XBeeReliableLink::_backoff(int attempts) {
+  std::chrono::milliseconds delay = XBEE_REL_BACKOFF;
+  for (int i = 1; (i < attempts) && (delay < XBEE_REL_MAX_BACKOFF); i++) delay *= 2;
+  if (delay > XBEE_REL_MAX_BACKOFF) delay = XBEE_REL_MAX_BACKOFF;
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  return delay + std::chrono::milliseconds(_random % (delay.count() / 2 + 1));
+}
+
+/**
+ * Hands a frame to txStream. Only the last attempt counts towards the
+ * parser's disassociation threshold.
+ */
+void XBeeReliableLink::_transmit(relFrame_t* frame) {
+  bool last = frame->attempts >= XBEE_REL_MAX_ATTEMPTS;
+  _parser->txStream(frame->address, frame->data, frame->length, callback(&XBeeReliableLink::_frame_sent, frame), last);
+}
+
+/**
+ * txStream delivery callback; runs on the receive thread, or in the sending
+ * thread if the request never got out
+ */
+void XBeeReliableLink::_frame_sent(relFrame_t* frame, int result) {
+  XBeeReliableLink* link = frame->link;
+  link->_mutex.lock();
+  uint64_t address = frame->address;
+  uint16_t sequence = frame->sequence;
+  bool finished = true;
+  if (result == 0) {
+    link->_delivered++;
+  } else if (frame->attempts < XBEE_REL_MAX_ATTEMPTS) {
+    frame->state = XBEE_REL_BACKING_OFF;
+    frame->due = Kernel::Clock::now() + link->_backoff(frame->attempts);
+    finished = false;
+  } else {
+    link->_failed++;
+  }
+  Callback<void(uint64_t, uint16_t, int)> handler = link->_deliveryHandler;
+  if (finished) {
+    frame->state = XBEE_REL_FREE;
+    link->_idle.notify_all();
+  }
+  link->_mutex.unlock();
+  if (!finished) {
+    link->_events.set(XBEE_REL_WAKE_FLAG);
+    return;
+  }
+  link->_framesFree.release();
+  if (handler) handler(address, sequence, result);
+}
+
+/**
+ * Subscriber for 0x90 and 0x81 frames; runs on the receive thread
+ */
+void XBeeReliableLink::_on_packet(const apiFrame_t* frame) {
+  uint64_t address;
+  const char* payload;
+  int len = _parser->packet_source(frame, &address, &payload);
+  if (len < 0) return;
+  bool numbered = (len >= XBEE_REL_HEADER_SIZE) && ((uint8_t) payload[0] == XBEE_REL_MARKER);
+  bool fresh = true;
+  _mutex.lock();
+  if (numbered && (address != XBEE_ADDRESS_UNKNOWN)) {
+    uint16_t sequence = ((uint8_t) payload[1] << 8) | (uint8_t) payload[2];
+    fresh = _accept(_peer(_receivePeers, address), sequence);
+  }
+  if (fresh) _received++;
+  else _duplicates++;
+  Callback<void(uint64_t, const char*, int)> handler = _receiveHandler;
+  _mutex.unlock();
+  if (!fresh || !handler) return;
+  if (numbered) handler(address, &payload[XBEE_REL_HEADER_SIZE], len - XBEE_REL_HEADER_SIZE);
+  else handler(address, payload, len);
+}
@@ -0,0 +1,127 @@
+/** Reliable delivery layer for XBeeAPIParser
+ *
+ *  Numbers every packet per peer and drops duplicates on the receiving side
+ *  with a sliding bitmap window, so a frame the radio delivered but whose
+ *  ACK was lost is passed on once even though it arrives twice. Frames whose
+ *  0x89 status reports a failure are retransmitted on their own after an
+ *  exponential backoff, and only a frame that fails every attempt counts
+ *  towards the parser's disassociation threshold.
+ *
+ *  Each packet carries a 3 byte header: XBEE_REL_MARKER and a 16-bit
+ *  big-endian sequence number. Sequence numbers start at a random value per
+ *  peer, so a restarted sender is unlikely to land inside the receiver's
+ *  window.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_RELIABLE_LINK_H
+#define XBEE_RELIABLE_LINK_H
+
+#include "XBeeAPIParser.h"
+
+#define XBEE_REL_MARKER 0xA9
+#define XBEE_REL_HEADER_SIZE 3
+// Largest payload; it has to fit a 0x90 frame after its 11 byte header
+#define XBEE_REL_MAX_PAYLOAD (MAX_FRAME_LENGTH - 11 - XBEE_REL_HEADER_SIZE)
+// Peers with sequence state, per direction; the least recently used one
+// makes way, so incoming traffic never resets a peer being sent to
+#ifndef XBEE_REL_PEERS
+#define XBEE_REL_PEERS 8
+#endif
+// Frames awaiting their status or a retransmit
+#ifndef XBEE_REL_QUEUE
+#define XBEE_REL_QUEUE 8
+#endif
+// Sequence numbers remembered behind the newest one received from a peer
+#define XBEE_REL_WINDOW 64
+#define XBEE_REL_MAX_ATTEMPTS 5
+// First retransmit delay; it doubles with every attempt up to the maximum,
+// plus up to half again of random jitter
+#define XBEE_REL_BACKOFF 20ms
+#define XBEE_REL_MAX_BACKOFF 500ms
+#define XBEE_REL_STACK_SIZE 2048
+
+#define XBEE_REL_WAKE_FLAG 0x01
+
+#define XBEE_REL_FREE 0
+#define XBEE_REL_IN_FLIGHT 1 // Waiting for its 0x89 status
+#define XBEE_REL_BACKING_OFF 2 // Waiting to be sent again
+
+class XBeeReliableLink;
+
+typedef struct {
+    bool valid;
+    uint64_t address;
+    uint16_t nextSequence; // In _sendPeers
+    bool synced; // In _receivePeers: highest and window hold something
+    uint16_t highest;
+    uint64_t window; // Bit i set if highest - i has been received
+    uint32_t lastUsed;
+} relPeer_t;
+
+typedef struct {
+    XBeeReliableLink* link;
+    uint8_t state;
+    uint8_t attempts;
+    uint64_t address;
+    uint16_t sequence;
+    int length;
+    Kernel::Clock::time_point due;
+    char data[XBEE_REL_HEADER_SIZE + XBEE_REL_MAX_PAYLOAD];
+} relFrame_t;
+
+class XBeeReliableLink
+{
+private:
+    XBeeAPIParser* _parser;
+    Mutex _mutex;
+    ConditionVariable _idle;
+    relPeer_t _sendPeers[XBEE_REL_PEERS];
+    relPeer_t _receivePeers[XBEE_REL_PEERS];
+    uint32_t _peerClock;
+    relFrame_t _frames[XBEE_REL_QUEUE];
+    Semaphore _framesFree;
+    uint32_t _random;
+    Callback<void(uint64_t, const char*, int)> _receiveHandler;
+    Callback<void(uint64_t, uint16_t, int)> _deliveryHandler;
+    // Counters, guarded by _mutex
+    uint32_t _framesSent;
+    uint32_t _retransmits;
+    uint32_t _delivered;
+    uint32_t _failed;
+    uint32_t _received;
+    uint32_t _duplicates;
+    bool _subscribed; // Owns the parser's 0x90 and 0x81 subscriptions
+    EventFlags _events;
+    volatile bool _stop;
+    Thread _thread;
+
+    void _run();
+    relPeer_t* _peer(relPeer_t* peers, uint64_t address);
+    bool _lagging(relPeer_t* peer);
+    bool _accept(relPeer_t* peer, uint16_t sequence);
+    std::chrono::milliseconds _backoff(int attempts);
+    void _transmit(relFrame_t* frame);
+    static void _frame_sent(relFrame_t* frame, int result);
+    void _on_packet(const apiFrame_t* frame);
+
+public:
+    XBeeReliableLink(XBeeAPIParser* parser);
+    ~XBeeReliableLink();
+    XBeeReliableLink(const XBeeReliableLink&) = delete;
+    XBeeReliableLink& operator=(const XBeeReliableLink&) = delete;
+    int send(uint64_t address, const char* data, int len);
+    void flush();
+    bool set_receive_handler(Callback<void(uint64_t, const char*, int)> handler);
+    void set_delivery_handler(Callback<void(uint64_t, uint16_t, int)> handler);
+    void reset_peer(uint64_t address);
+    uint32_t frames_sent();
+    uint32_t retransmits();
+    uint32_t frames_delivered();
+    uint32_t frames_failed();
+    uint32_t frames_received();
+    uint32_t duplicates_dropped();
+};
+
+#endif
@@ -0,0 +1,779 @@
+#include "XBeeSimModem.h"
+#include <cerrno>
+
+/**
+ * @brief Construct a new simulated modem. It starts associated, answers
+ * immediately and loses nothing.
+ */
+XBeeSimModem::XBeeSimModem() :
+  _thread(osPriorityNormal, XBEE_SIM_STACK_SIZE, NULL, "XBeeSimModem") {
+  _outHead = 0;
+  _outCount = 0;
+  _inCount = 0;
+  _inEscape = false;
+  for (int i = 0; i < XBEE_SIM_MAX_SCHEDULED; i++) _scheduled[i].active = false;
+  for (int i = 0; i < XBEE_SIM_MAX_NODES; i++) _nodes[i].valid = false;
+  _latency = 0;
+  _lossThreshold = 0;
+  _random = 1;
+  _txStatus = 0x00;
+  _rssi = 0x28;
+  _associated = true;
+  _destination = 0;
+  _loopback = false;
+  _apiMode = 1;
+  _rxInterval = 0;
+  _rxLength = 0;
+  _rxSource = 0;
+  _rxNext = 0;
+  _rxRemaining = 0;
+  _rxRunning = false;
+  _framesIn = 0;
+  _responses = 0;
+  _lost = 0;
+  _rxInjected = 0;
+  _overruns = 0;
+  _blocking = true;
+  _stop = false;
+  _clock.start();
+  _thread.start(callback(this, &XBeeSimModem::_run));
+}
+
+XBeeSimModem::~XBeeSimModem() {
+  _stop = true;
+  _events.set(XBEE_SIM_WAKE_FLAG);
+  _thread.join();
+}
+
+/**
+ * @returns bytes read | -EAGAIN if non-blocking and nothing is waiting
+ */
+ssize_t XBeeSimModem::read(void* buffer, size_t size) {
+  while (true) {
+    _mutex.lock();
+    int n = ((size_t) _outCount < size) ? _outCount : (int) size;
+    for (int i = 0; i < n; i++) {
+      ((char*) buffer)[i] = _out[_outHead];
+      _outHead = (_outHead + 1) % XBEE_SIM_BUFFER_SIZE;
+    }
+    _outCount -= n;
+    bool refill = _rxRunning && (_rxInterval == 0);
+    _mutex.unlock();
+    if (refill && (n > 0)) _events.set(XBEE_SIM_WAKE_FLAG); // Room for more burst traffic
+    if (n > 0) return n;
+    if (!_blocking) return -EAGAIN;
+    _events.wait_any(XBEE_SIM_READ_FLAG);
+  }
+}
+
+/**
+ * Takes frames from the parser and queues the responses
+ *
+ * @returns size (the modem never pushes back)
+ */
+ssize_t XBeeSimModem::write(const void* buffer, size_t size) {
+  _mutex.lock();
+  int before = _outCount;
+  for (size_t i = 0; i < size; i++) _accept(((const char*) buffer)[i]);
+  bool added = _outCount > before;
+  _mutex.unlock();
+  if (added) _notify();
+  return size;
+}
+
+bool XBeeSimModem::readable() const {
+  return _outCount > 0;
+}
+
+int XBeeSimModem::set_blocking(bool blocking) {
+  _blocking = blocking;
+  return 0;
+}
+
+bool XBeeSimModem::is_blocking() const {
+  return _blocking;
+}
+
+void XBeeSimModem::sigio(Callback<void()> func) {
+  _sigio = func;
+}
+
+/**
+ * Sets how long the modem takes to answer an AT command or report the
+ * status of a transmission
+ */
+void XBeeSimModem::set_latency(std::chrono::microseconds latency) {
+  _mutex.lock();
+  _latency = latency.count();
+  _mutex.unlock();
+}
+
+/**
+ * Sets the chance (0 to 1) that a response is never sent, as if the frame
+ * had been lost. The seed makes runs repeatable.
+ */
+void XBeeSimModem::set_loss(float probability, uint32_t seed) {
+  if (probability < 0) probability = 0;
+  if (probability > 1) probability = 1;
+  _mutex.lock();
+  _lossThreshold = (uint32_t) (probability * 4294967295.0);
+  _random = (seed != 0) ? seed : 1;
+  _mutex.unlock();
+}
+
+/**
+ * Sets the delivery status reported in 0x89 frames (0x00 success, 0x01 no
+ * ACK, 0x02 CCA failure, 0x03 purged)
+ */
+void XBeeSimModem::set_tx_status(uint8_t status) {
+  _txStatus = status;
+}
+
+void XBeeSimModem::set_rssi(uint8_t rssi) {
+  _rssi = rssi;
+}
+
+void XBeeSimModem::set_associated(bool associated) {
+  _associated = associated;
+}
+
+/**
+ * Echoes the payload of every delivered 64-bit TX request back to the
+ * parser as a 0x90 packet from the destination, as if the remote node had
+ * sent it. Handy for exercising both directions with one modem.
+ */
+void XBeeSimModem::set_loopback(bool loopback) {
+  _loopback = loopback;
+}
+
+/**
+ * Selects unescaped (AP=1) or escaped (AP=2) API operation, as an AP
+ * command would. It must match the parser's set_api_mode(). Frames already
+ * queued for the parser keep the mode they were queued in.
+ */
+void XBeeSimModem::set_api_mode(int mode) {
+  if ((mode != 1) && (mode != 2)) return;
+  _mutex.lock();
+  _apiMode = mode;
+  _inEscape = false;
+  _mutex.unlock();
+}
+
+int XBeeSimModem::api_mode() {
+  return _apiMode;
+}
+
+/**
+ * Adds a node that DN can resolve and remote AT commands can reach. Packets
+ * from a node with a short address carry it in their 0x90 frames, as a real
+ * radio's would.
+ *
+ * @returns false if the node table is full or the identifier is too long
+ */
+bool XBeeSimModem::add_node(string ni, uint64_t address, uint16_t shortAddress) {
+  if (ni.length() > XBEE_MAX_NI_LENGTH) return false;
+  bool added = false;
+  _mutex.lock();
+  for (int i = 0; (i < XBEE_SIM_MAX_NODES) && !added; i++) {
+    if (!_nodes[i].valid || (ni == _nodes[i].ni)) {
+      _nodes[i].valid = true;
+      strcpy(_nodes[i].ni, ni.c_str());
+      _nodes[i].address = address;
+      _nodes[i].shortAddress = shortAddress;
+      _nodes[i].registerCount = 0;
+      added = true;
+    }
+  }
+  _mutex.unlock();
+  return added;
+}
+
+/**
+ * Delivers one 0x82 I/O sample frame to the parser: count samples laid out
+ * as the channel indicator says
+ *
+ * @returns false if the modem's buffer is full or the samples do not fit
+ */
+bool XBeeSimModem::inject_io_samples(uint64_t source, uint16_t indicator, int count, const char* samples, int len) {
+  char body[XBEE_SIM_FRAME_SIZE];
+  if ((len > MAX_FRAME_LENGTH - 13) || (count > 0xFF)) return false;
+  for (int i = 0; i < 8; i++) body[i] = (source >> (56 - 8*i)) & 0xFF;
+  body[8] = _rssi;
+  body[9] = 0x00; // Options
+  body[10] = count;
+  body[11] = indicator >> 8;
+  body[12] = indicator & 0xFF;
+  memcpy(&body[13], samples, len);
+  char bytes[XBEE_SIM_FRAME_SIZE];
+  _mutex.lock();
+  bool pushed = _push(bytes, _encode(0x82, body, len + 13, bytes));
+  if (pushed) _rxInjected++;
+  _mutex.unlock();
+  if (pushed) _notify();
+  return pushed;
+}
+
+/**
+ * Reads back a setting a remote AT command left on a node
+ *
+ * @param value receives up to XBEE_REMOTE_AT_MAX_VALUE bytes
+ * @returns false if the node is unknown or the setting was never set
+ */
+bool XBeeSimModem::node_setting(uint64_t address, string cmd, char* value, int* len) {
+  if (cmd.length() != 2) return false;
+  bool found = false;
+  _mutex.lock();
+  for (int i = 0; i < XBEE_SIM_MAX_NODES; i++) {
+    simNode_t* node = &_nodes[i];
+    if (!node->valid || (node->address != address)) continue;
+    for (int r = 0; r < node->registerCount; r++) {
+      simRegister_t* reg = &node->registers[r];
+      if ((reg->command[0] == cmd[0]) && (reg->command[1] == cmd[1])) {
+        memcpy(value, reg->value, reg->length);
+        *len = reg->length;
+        found = true;
+      }
+    }
+  }
+  _mutex.unlock();
+  return found;
+}
+
+/**
+ * Delivers one 0x90 receive packet to the parser
+ *
+ * @returns false if the modem's buffer is full
+ */
+bool XBeeSimModem::inject_rx(uint64_t source, const char* payload, int len) {
+  _mutex.lock();
+  bool pushed = _inject(source, payload, len);
+  _mutex.unlock();
+  if (pushed) _notify();
+  return pushed;
+}
+
+/**
+ * Delivers one 0x81 receive packet, sent from a 16-bit address
+ *
+ * @returns false if the modem's buffer is full
+ */
+bool XBeeSimModem::inject_rx16(uint16_t source, const char* payload, int len) {
+  _mutex.lock();
+  bool pushed = _inject16(source, payload, len);
+  _mutex.unlock();
+  if (pushed) _notify();
+  return pushed;
+}
+
+/**
+ * Starts generating 0x90 receive packets. At a rate of 0 frames are
+ * generated as fast as the parser reads them. Payloads of 4 or more bytes
+ * start with the modem clock (now_us()) at the moment the frame was
+ * generated, so a consumer can measure delivery latency.
+ *
+ * @param frames number of frames to generate, 0 for no limit
+ */
+void XBeeSimModem::start_rx_traffic(float framesPerSecond, int payloadLength, uint32_t frames, uint64_t source) {
+  if (payloadLength > MAX_FRAME_LENGTH - 11) payloadLength = MAX_FRAME_LENGTH - 11;
+  if (payloadLength < 0) payloadLength = 0;
+  _mutex.lock();
+  _rxInterval = (framesPerSecond > 0) ? (uint32_t) (1000000.0f / framesPerSecond) : 0;
+  _rxLength = payloadLength;
+  _rxSource = source;
+  _rxNext = _clock.elapsed_time().count();
+  _rxRemaining = (frames > 0) ? frames : 0xFFFFFFFF;
+  _rxRunning = true;
+  _mutex.unlock();
+  _events.set(XBEE_SIM_WAKE_FLAG);
+}
+
+void XBeeSimModem::stop_rx_traffic() {
+  _mutex.lock();
+  _rxRunning = false;
+  _mutex.unlock();
+}
+
+/**
+ * @returns true until start_rx_traffic has generated all its frames
+ */
+bool XBeeSimModem::rx_traffic_running() {
+  return _rxRunning;
+}
+
+/**
+ * @returns modem clock in us, for timing against payload time stamps
+ */
+uint32_t XBeeSimModem::now_us() {
+  return _clock.elapsed_time().count();
+}
+
+uint32_t XBeeSimModem::frames_received() {
+  return _framesIn;
+}
+
+uint32_t XBeeSimModem::responses_sent() {
+  return _responses;
+}
+
+uint32_t XBeeSimModem::responses_lost() {
+  return _lost;
+}
+
+uint32_t XBeeSimModem::rx_injected() {
+  return _rxInjected;
+}
+
+/**
+ * @returns frames (responses or receive traffic) dropped because the
+ * parser had not read the modem's buffer
+ */
+uint32_t XBeeSimModem::rx_overruns() {
+  return _overruns;
+}
+
+/**
+ * Modem thread. Releases delayed responses when they are due and generates
+ * receive traffic.
+ */
+void XBeeSimModem::_run() {
+  while (!_stop) {
+    uint64_t now = _clock.elapsed_time().count();
+    uint64_t next = now + 100000; // Look again at least every 100ms
+    bool added = false;
+    _mutex.lock();
+    for (int i = 0; i < XBEE_SIM_MAX_SCHEDULED; i++) {
+      simScheduledFrame_t* frame = &_scheduled[i];
+      if (!frame->active) continue;
+      if (frame->due <= now) {
+        frame->active = false;
+        if (_push(frame->bytes, frame->length)) added = true;
+        else _overruns++;
+      } else if (frame->due < next) {
+        next = frame->due;
+      }
+    }
+    if (_rxRunning) {
+      char payload[MAX_FRAME_LENGTH];
+      memset(payload, 0xA5, _rxLength);
+      if (_rxInterval == 0) { // Fill whatever room the parser has left
+        int room = (_apiMode == 2) ? 2*(_rxLength + 16) : _rxLength + 16; // Worst case escaped
+        while (_rxRunning && (XBEE_SIM_BUFFER_SIZE - _outCount >= room)) {
+          uint32_t stamp = now_us();
+          if (_rxLength >= 4) memcpy(payload, &stamp, 4);
+          _inject(_rxSource, payload, _rxLength);
+          added = true;
+          if (--_rxRemaining == 0) _rxRunning = false;
+        }
+      } else {
+        while (_rxRunning && (_rxNext <= now)) {
+          uint32_t stamp = now_us();
+          if (_rxLength >= 4) memcpy(payload, &stamp, 4);
+          if (_inject(_rxSource, payload, _rxLength)) added = true;
+          else _overruns++;
+          _rxNext += _rxInterval;
+          if (--_rxRemaining == 0) _rxRunning = false;
+        }
+        if (_rxRunning && (_rxNext < next)) next = _rxNext;
+      }
+    }
+    _mutex.unlock();
+    if (added) _notify();
+    now = _clock.elapsed_time().count();
+    uint32_t wait = (next > now) ? (uint32_t) ((next - now + 999) / 1000) : 0;
+    if (wait > 0) _events.wait_any_for(XBEE_SIM_WAKE_FLAG, std::chrono::milliseconds(wait));
+    else _events.clear(XBEE_SIM_WAKE_FLAG);
+  }
+}
+
+/**
+ * Collects the bytes of a frame written by the parser, removing escapes in
+ * AP=2. The mutex must be held.
+ */
+void XBeeSimModem::_accept(char c) {
+  if (_apiMode == 2) {
+    if (c == 0x7E) { // Always a frame start when escaping
+      _inCount = 0;
+      _inEscape = false;
+    } else if (c == 0x7D) {
+      _inEscape = true;
+      return;
+    } else if (_inEscape) {
+      c ^= 0x20;
+      _inEscape = false;
+    }
+  }
+  if ((_inCount == 0) && (c != 0x7E)) return; // Wait for a start delimiter
+  _in[_inCount++] = c;
+  if (_inCount < 3) return;
+  int len = ((uint8_t) _in[1] << 8) | (uint8_t) _in[2];
+  if (len + 4 > XBEE_SIM_FRAME_SIZE) { // Can't be ours
+    _inCount = 0;
+    return;
+  }
+  if (_inCount < len + 4) return;
+  uint8_t sum = 0;
+  for (int i = 3; i < len + 4; i++) sum += (uint8_t) _in[i];
+  if (sum == 0xFF) _handle_frame(&_in[3], len);
+  _inCount = 0;
+}
+
+/**
+ * Acts on a frame from the parser (type, frame ID and data). The mutex must
+ * be held.
+ */
+void XBeeSimModem::_handle_frame(const char* frame, int len) {
+  if (len < 2) return;
+  _framesIn++;
+  char status;
+  switch (frame[0]) {
+    case 0x08: // Local AT command
+      if (len >= 4) _handle_AT(frame[1], &frame[2], &frame[4], len - 4);
+      break;
+    case 0x17: // Remote AT command
+      if (len >= 15) _handle_remote_AT(frame[1], &frame[2], len - 2);
+      break;
+    case 0x00: // 64-bit TX request
+    case 0x01: // 16-bit TX request
+      status = _associated ? _txStatus : 0x01;
+      if (_loopback && (frame[0] == 0x00) && (status == 0x00) && (len >= 11)) {
+        uint64_t destination = 0;
+        for (int i = 2; i < 10; i++) destination = (destination << 8) | (uint8_t) frame[i];
+        if (!_inject(destination, &frame[11], len - 11)) _overruns++;
+      }
+      if (_loopback && (frame[0] == 0x01) && (status == 0x00) && (len >= 5)) {
+        uint16_t destination = ((uint8_t) frame[2] << 8) | (uint8_t) frame[3];
+        if (!_inject16(destination, &frame[5], len - 5)) _overruns++;
+      }
+      if (frame[1] != 0) _respond(0x89, frame[1], &status, 1);
+      break;
+    default: // Not simulated
+      break;
+  }
+}
+
+/**
+ * Answers a local AT command. The mutex must be held.
+ */
+void XBeeSimModem::_handle_AT(char frameID, const char* cmd, const char* param, int paramLen) {
+  char data[11];
+  int n = 3;
+  data[0] = cmd[0];
+  data[1] = cmd[1];
+  data[2] = 0x00; // OK
+  if ((cmd[0] == 'A') && (cmd[1] == 'I')) {
+    data[n++] = _associated ? 0x00 : 0x03;
+  } else if ((cmd[0] == 'D') && (cmd[1] == 'B')) {
+    data[n++] = _rssi;
+  } else if ((cmd[0] == 'D') && (cmd[1] == 'N')) {
+    data[2] = 0x01; // ERROR unless found
+    for (int i = 0; i < XBEE_SIM_MAX_NODES; i++) {
+      if (_nodes[i].valid && ((int) strlen(_nodes[i].ni) == paramLen) && (memcmp(_nodes[i].ni, param, paramLen) == 0)) {
+        _destination = _nodes[i].address; // DN leaves DH/DL pointing at the node
+        data[2] = 0x00;
+      }
+    }
+  } else if ((cmd[0] == 'D') && ((cmd[1] == 'H') || (cmd[1] == 'L'))) {
+    int shift = (cmd[1] == 'H') ? 32 : 0;
+    if (paramLen == 4) { // Set
+      uint64_t half = 0;
+      for (int i = 0; i < 4; i++) half = (half << 8) | (uint8_t) param[i];
+      _destination = (_destination & ~(0xFFFFFFFFULL << shift)) | (half << shift);
+    } else if (paramLen == 0) { // Read
+      for (int i = 0; i < 4; i++) data[n++] = (_destination >> (shift + 24 - 8*i)) & 0xFF;
+    } else {
+      data[2] = 0x03; // Invalid parameter
+    }
+  } else if ((cmd[0] == 'N') && (cmd[1] == 'D')) {
+    // One response per node, then an empty one once discovery times out
+    if (frameID == 0) return;
+    for (int i = 0; i < XBEE_SIM_MAX_NODES; i++) {
+      simNode_t* node = &_nodes[i];
+      if (!node->valid) continue;
+      char record[3 + 11 + XBEE_MAX_NI_LENGTH + 1];
+      memcpy(record, data, 3);
+      record[3] = node->shortAddress >> 8;
+      record[4] = node->shortAddress & 0xFF;
+      for (int j = 0; j < 8; j++) record[5 + j] = (node->address >> (56 - 8*j)) & 0xFF;
+      record[13] = _rssi;
+      int niLen = strlen(node->ni);
+      memcpy(&record[14], node->ni, niLen + 1);
+      _respond(0x88, frameID, record, 15 + niLen);
+    }
+    _respond_after(0x88, frameID, data, n, 2*_latency);
+    return;
+  } else if ((cmd[0] == 'A') && (cmd[1] == 'P')) {
+    if (paramLen == 0) { // Read
+      data[n++] = _apiMode;
+    } else if ((paramLen == 1) && ((param[0] == 1) || (param[0] == 2))) {
+      // Answer in the old mode, then switch
+      if (frameID != 0) _respond(0x88, frameID, data, n);
+      _apiMode = param[0];
+      _inEscape = false;
+      return;
+    } else {
+      data[2] = 0x03; // Invalid parameter
+    }
+  } else if ((cmd[0] == 'D') && (cmd[1] == 'A')) {
+    // Drops off the network and rejoins; the parser sees both modem statuses
+    char frames[2*7];
+    char status = 0x03; // Disassociated
+    int len = _encode(0x8A, &status, 1, frames);
+    status = 0x02; // Associated
+    len += _encode(0x8A, &status, 1, &frames[len]);
+    if (frameID != 0) _respond(0x88, frameID, data, n);
+    if (_latency == 0) {
+      if (!_push(frames, len)) _overruns++;
+      return;
+    }
+    for (int i = 0; i < XBEE_SIM_MAX_SCHEDULED; i++) {
+      if (!_scheduled[i].active) {
+        _scheduled[i].active = true;
+        _scheduled[i].due = _clock.elapsed_time().count() + 2*(uint64_t)_latency;
+        _scheduled[i].length = len;
+        memcpy(_scheduled[i].bytes, frames, len);
+        break;
+      }
+    }
+    return;
+  } else {
+    data[2] = 0x02; // Invalid command
+  }
+  if (frameID != 0) _respond(0x88, frameID, data, n);
+}
+
+/**
+ * Answers a remote AT command (destination, options, command and parameter)
+ * for the addressed node. Nodes the modem does not know never answer, which
+ * the radio reports as status 4. The mutex must be held.
+ */
+void XBeeSimModem::_handle_remote_AT(char frameID, const char* data, int len) {
+  char response[13 + XBEE_REMOTE_AT_MAX_VALUE + XBEE_MAX_NI_LENGTH];
+  uint64_t address = 0;
+  for (int i = 0; i < 8; i++) address = (address << 8) | (uint8_t) data[i];
+  simNode_t* node = NULL;
+  for (int i = 0; i < XBEE_SIM_MAX_NODES; i++) {
+    if (_nodes[i].valid && (_nodes[i].address == address)) node = &_nodes[i];
+  }
+  uint16_t shortAddress = (node != NULL) ? node->shortAddress : XBEE_SHORT_ADDRESS_NONE;
+  memcpy(response, data, 8);
+  response[8] = shortAddress >> 8;
+  response[9] = shortAddress & 0xFF;
+  response[10] = data[11];
+  response[11] = data[12];
+  int n = 13;
+  if (!_associated || (node == NULL)) {
+    response[12] = 0x04; // No response from the node
+  } else {
+    int valueLen = _node_register(node, &data[11], &data[13], len - 13, &response[13]);
+    if (valueLen < 0) {
+      response[12] = (valueLen == -1) ? 0x03 : 0x01; // Invalid parameter | ERROR
+    } else {
+      response[12] = 0x00;
+      n += valueLen;
+    }
+  }
+  if (frameID != 0) _respond(0x97, frameID, response, n);
+}
+
+/**
+ * Sets a node's setting when a parameter is given, otherwise reads it. SH,
+ * SL, MY and NI come from the node table; anything else is kept in the
+ * node's registers and reads as a single zero byte until set. The mutex must
+ * be held.
+ *
+ * @returns bytes written to value | -1 if the parameter is too long | -2 if
+ * the node has no register left
+ */
+int XBeeSimModem::_node_register(simNode_t* node, const char* cmd, const char* param, int paramLen, char* value) {
+  if ((cmd[0] == 'S') && ((cmd[1] == 'H') || (cmd[1] == 'L')) && (paramLen == 0)) {
+    int shift = (cmd[1] == 'H') ? 32 : 0;
+    for (int i = 0; i < 4; i++) value[i] = (node->address >> (shift + 24 - 8*i)) & 0xFF;
+    return 4;
+  }
+  if ((cmd[0] == 'M') && (cmd[1] == 'Y')) {
+    if (paramLen == 2) {
+      node->shortAddress = ((uint8_t) param[0] << 8) | (uint8_t) param[1];
+    } else if (paramLen == 0) {
+      value[0] = node->shortAddress >> 8;
+      value[1] = node->shortAddress & 0xFF;
+      return 2;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+  if ((cmd[0] == 'N') && (cmd[1] == 'I') && (paramLen == 0)) {
+    int niLen = strlen(node->ni);
+    memcpy(value, node->ni, niLen);
+    return niLen;
+  }
+  if (paramLen > XBEE_REMOTE_AT_MAX_VALUE) return -1;
+  simRegister_t* reg = NULL;
+  for (int r = 0; r < node->registerCount; r++) {
+    if ((node->registers[r].command[0] == cmd[0]) && (node->registers[r].command[1] == cmd[1])) reg = &node->registers[r];
+  }
+  if (paramLen == 0) { // Read
+    if (reg == NULL) {
+      value[0] = 0x00;
+      return 1;
+    }
+    memcpy(value, reg->value, reg->length);
+    return reg->length;
+  }
+  if (reg == NULL) {
+    if (node->registerCount == XBEE_SIM_NODE_REGISTERS) return -2;
+    reg = &node->registers[node->registerCount++];
+    reg->command[0] = cmd[0];
+    reg->command[1] = cmd[1];
+  }
+  memcpy(reg->value, param, paramLen);
+  reg->length = paramLen;
+  return 0;
+}
+
+/**
+ * Sends a response frame after the configured latency, unless it is lost.
+ * The mutex must be held.
+ */
+void XBeeSimModem::_respond(char type, char frameID, const char* data, int len) {
+  _respond_after(type, frameID, data, len, _latency);
+}
+
+/**
+ * Sends a response frame after the given delay in us, unless it is lost.
+ * The mutex must be held.
+ */
+void XBeeSimModem::_respond_after(char type, char frameID, const char* data, int len, uint32_t delay) {
+  if ((_lossThreshold > 0) && (_next_random() < _lossThreshold)) {
+    _lost++;
+    return;
+  }
+  char body[XBEE_SIM_FRAME_SIZE];
+  body[0] = frameID;
+  memcpy(&body[1], data, len);
+  _responses++;
+  if (delay > 0) {
+    for (int i = 0; i < XBEE_SIM_MAX_SCHEDULED; i++) {
+      simScheduledFrame_t* frame = &_scheduled[i];
+      if (frame->active) continue;
+      frame->active = true;
+      frame->due = _clock.elapsed_time().count() + delay;
+      frame->length = _encode(type, body, len + 1, frame->bytes);
+      _events.set(XBEE_SIM_WAKE_FLAG); // Have the modem thread wait for it
+      return;
+    }
+  } // Answer straight away if there is no latency or nowhere to hold it
+  char bytes[XBEE_SIM_FRAME_SIZE];
+  if (!_push(bytes, _encode(type, body, len + 1, bytes))) _overruns++;
+}
+
+/**
+ * Serializes an API frame from its type and everything after it
+ *
+ * @returns bytes written to out (len + 5)
+ */
+int XBeeSimModem::_encode(char type, const char* data, int len, char* out) {
+  uint8_t sum = type;
+  out[0] = 0x7E;
+  out[1] = ((len + 1) >> 8) & 0xFF;
+  out[2] = (len + 1) & 0xFF;
+  out[3] = type;
+  for (int i = 0; i < len; i++) {
+    out[4+i] = data[i];
+    sum += (uint8_t) data[i];
+  }
+  out[4+len] = 0xFF - sum;
+  return len + 5;
+}
+
+/**
+ * Queues encoded frames for the parser to read. In AP=2 everything but each
+ * frame's start delimiter is escaped on the way in. The mutex must be held.
+ *
+ * @returns false, queueing nothing, if they don't all fit
+ */
+bool XBeeSimModem::_push(const char* bytes, int len) {
+  int frameEnd = 0;
+  int wireLen = len;
+  if (_apiMode == 2) {
+    for (int i = 0; i < len; i++) {
+      char c = bytes[i];
+      if (i == frameEnd) { // Start delimiter; the next frame follows this one
+        if (i + 2 < len) frameEnd = i + (((uint8_t) bytes[i+1] << 8) | (uint8_t) bytes[i+2]) + 4;
+      } else if ((c == 0x7E) || (c == 0x7D) || (c == 0x11) || (c == 0x13)) {
+        wireLen++;
+      }
+    }
+  }
+  if (XBEE_SIM_BUFFER_SIZE - _outCount < wireLen) return false;
+  int tail = (_outHead + _outCount) % XBEE_SIM_BUFFER_SIZE;
+  frameEnd = 0;
+  for (int i = 0; i < len; i++) {
+    char c = bytes[i];
+    if ((_apiMode == 2) && (i == frameEnd)) {
+      if (i + 2 < len) frameEnd = i + (((uint8_t) bytes[i+1] << 8) | (uint8_t) bytes[i+2]) + 4;
+    } else if ((_apiMode == 2) && ((c == 0x7E) || (c == 0x7D) || (c == 0x11) || (c == 0x13))) {
+      _out[tail] = 0x7D;
+      tail = (tail + 1) % XBEE_SIM_BUFFER_SIZE;
+      c ^= 0x20;
+    }
+    _out[tail] = c;
+    tail = (tail + 1) % XBEE_SIM_BUFFER_SIZE;
+  }
+  _outCount += wireLen;
+  return true;
+}
+
+/**
+ * Queues a 0x90 receive packet. The mutex must be held.
+ */
+bool XBeeSimModem::_inject(uint64_t source, const char* payload, int len) {
+  char body[XBEE_SIM_FRAME_SIZE];
+  if (len > MAX_FRAME_LENGTH - 11) return false;
+  uint16_t shortAddress = XBEE_SHORT_ADDRESS_NONE;
+  for (int i = 0; i < XBEE_SIM_MAX_NODES; i++) {
+    if (_nodes[i].valid && (_nodes[i].address == source)) shortAddress = _nodes[i].shortAddress;
+  }
+  for (int i = 0; i < 8; i++) body[i] = (source >> (56 - 8*i)) & 0xFF;
+  body[8] = shortAddress >> 8;
+  body[9] = shortAddress & 0xFF;
+  body[10] = 0x01; // Acknowledged
+  memcpy(&body[11], payload, len);
+  char bytes[XBEE_SIM_FRAME_SIZE];
+  if (!_push(bytes, _encode(0x90, body, len + 11, bytes))) return false;
+  _rxInjected++;
+  return true;
+}
+
+/**
+ * Queues a 0x81 receive packet. The mutex must be held.
+ */
+bool XBeeSimModem::_inject16(uint16_t source, const char* payload, int len) {
+  char body[XBEE_SIM_FRAME_SIZE];
+  if (len > MAX_FRAME_LENGTH - 4) return false;
+  body[0] = source >> 8;
+  body[1] = source & 0xFF;
+  body[2] = _rssi;
+  body[3] = 0x01; // Acknowledged
+  memcpy(&body[4], payload, len);
+  char bytes[XBEE_SIM_FRAME_SIZE];
+  if (!_push(bytes, _encode(0x81, body, len + 4, bytes))) return false;
+  _rxInjected++;
+  return true;
+}
+
+/**
+ * Tells the reader there are bytes, the way a UART interrupt would
+ */
+void XBeeSimModem::_notify() {
+  _events.set(XBEE_SIM_READ_FLAG);
+  if (_sigio) _sigio();
+}
+
+uint32_t XBeeSimModem::_next_random() {
+  // xorshift32
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  return _random;
+}
@@ -0,0 +1,150 @@
+/** Simulated XBee modem
+ *
+ *  An in-process 802.15.4 XBee in API mode 1 or 2 (escaped) that the parser
+ *  can be pointed at instead of a serial port. It answers local AT commands
+ *  (AI, DB, DN, ND, DH, DL, DA, AP), remote AT commands to the nodes it knows and TX requests
+ *  after a configurable latency, with
+ *  configurable loss and delivery status, and can generate 0x90 receive
+ *  traffic at a set rate. In loopback, delivered TX requests come back as
+ *  0x90 packets (0x81 for 16-bit requests) from their destination.
+ *
+ *  @copyright MIT License
+ */
+
+#ifndef XBEE_SIM_MODEM_H
+#define XBEE_SIM_MODEM_H
+
+#include "XBeeAPIParser.h"
+
+// Bytes the modem can hold for the parser to read, like a UART buffer
+#ifndef XBEE_SIM_BUFFER_SIZE
+#define XBEE_SIM_BUFFER_SIZE 2048
+#endif
+#define XBEE_SIM_MAX_SCHEDULED 16
+#define XBEE_SIM_MAX_NODES 8
+// Settings each node keeps from remote AT commands
+#define XBEE_SIM_NODE_REGISTERS 8
+#define XBEE_SIM_FRAME_SIZE (MAX_FRAME_LENGTH + 6)
+#define XBEE_SIM_STACK_SIZE 2048
+
+#define XBEE_SIM_WAKE_FLAG 0x01
+#define XBEE_SIM_READ_FLAG 0x02
+
+typedef struct {
+    bool active;
+    uint64_t due; // us on the modem clock
+    int length;
+    char bytes[XBEE_SIM_FRAME_SIZE];
+} simScheduledFrame_t;
+
+typedef struct {
+    char command[2];
+    int length;
+    char value[XBEE_REMOTE_AT_MAX_VALUE];
+} simRegister_t;
+
+typedef struct {
+    bool valid;
+    char ni[XBEE_MAX_NI_LENGTH + 1];
+    uint64_t address;
+    uint16_t shortAddress; // MY, or XBEE_SHORT_ADDRESS_NONE
+    simRegister_t registers[XBEE_SIM_NODE_REGISTERS];
+    int registerCount;
+} simNode_t;
+
+class XBeeSimModem : public FileHandle
+{
+private:
+    Mutex _mutex;
+    // Bytes waiting for the parser to read
+    char _out[XBEE_SIM_BUFFER_SIZE];
+    int _outHead;
+    int _outCount;
+    // Frame the parser is writing
+    char _in[XBEE_SIM_FRAME_SIZE];
+    int _inCount;
+    bool _inEscape; // Last byte written was 0x7D in AP=2
+    simScheduledFrame_t _scheduled[XBEE_SIM_MAX_SCHEDULED];
+    simNode_t _nodes[XBEE_SIM_MAX_NODES];
+    // Behaviour
+    uint32_t _latency; // us
+    uint32_t _lossThreshold; // Responses are lost when a random word falls below
+    uint32_t _random;
+    uint8_t _txStatus;
+    uint8_t _rssi;
+    bool _associated;
+    uint64_t _destination; // DH/DL
+    bool _loopback;
+    int _apiMode; // AP=1 unescaped or AP=2 escaped
+    // Generated receive traffic
+    uint32_t _rxInterval; // us between frames, 0 for as fast as the buffer drains
+    int _rxLength;
+    uint64_t _rxSource;
+    uint64_t _rxNext;
+    uint32_t _rxRemaining;
+    bool _rxRunning;
+    // Counters
+    uint32_t _framesIn;
+    uint32_t _responses;
+    uint32_t _lost;
+    uint32_t _rxInjected;
+    uint32_t _overruns;
+
+    bool _blocking;
+    Callback<void()> _sigio;
+    Timer _clock;
+    EventFlags _events;
+    volatile bool _stop;
+    Thread _thread;
+
+    void _run();
+    void _accept(char c);
+    void _handle_frame(const char* frame, int len);
+    void _handle_AT(char frameID, const char* cmd, const char* param, int paramLen);
+    void _handle_remote_AT(char frameID, const char* data, int len);
+    int _node_register(simNode_t* node, const char* cmd, const char* param, int paramLen, char* value);
+    void _respond(char type, char frameID, const char* data, int len);
+    void _respond_after(char type, char frameID, const char* data, int len, uint32_t delay);
+    int _encode(char type, const char* data, int len, char* out);
+    bool _push(const char* bytes, int len);
+    bool _inject(uint64_t source, const char* payload, int len);
+    bool _inject16(uint16_t source, const char* payload, int len);
+    void _notify();
+    uint32_t _next_random();
+
+public:
+    XBeeSimModem();
+    ~XBeeSimModem();
+    XBeeSimModem(const XBeeSimModem&) = delete;
+    XBeeSimModem& operator=(const XBeeSimModem&) = delete;
+    ssize_t read(void* buffer, size_t size) override;
+    ssize_t write(const void* buffer, size_t size) override;
+    bool readable() const override;
+    int set_blocking(bool blocking) override;
+    bool is_blocking() const override;
+    void sigio(Callback<void()> func) override;
+    void set_latency(std::chrono::microseconds latency);
+    void set_loss(float probability, uint32_t seed = 1);
+    void set_tx_status(uint8_t status);
+    void set_rssi(uint8_t rssi);
+    void set_associated(bool associated);
+    void set_loopback(bool loopback);
+    void set_api_mode(int mode);
+    int api_mode();
+    bool add_node(string ni, uint64_t address, uint16_t shortAddress = XBEE_SHORT_ADDRESS_NONE);
+    bool node_setting(uint64_t address, string cmd, char* value, int* len);
+    bool inject_rx(uint64_t source, const char* payload, int len);
+    bool inject_rx16(uint16_t source, const char* payload, int len);
+    bool inject_io_samples(uint64_t source, uint16_t indicator, int count, const char* samples, int len);
+    void start_rx_traffic(float framesPerSecond, int payloadLength, uint32_t frames = 0, uint64_t source = 0x0013A20040000001);
+    void stop_rx_traffic();
+    bool rx_traffic_running();
+    uint32_t now_us();
+    uint32_t frames_received();
+    uint32_t responses_sent();
+    uint32_t responses_lost();
+    uint32_t rx_injected();
+    uint32_t rx_overruns();
+};
+
+#endif